@@ -0,0 +1,369 @@
+/**
+ * @file pipeline_benchmark.cpp
+ * @brief Replays a recorded sensor trace through the data pipeline on the host and reports the cost of each stage.
+ * Build and run with [env:native]:
+ *   pio run -e native && .pio/build/native/program "data source (not gzipped)/data.json" [samples]
+ * The trace is a data.json download (the CO2, humidity and temperature series), it is looped (with the epochs moved on)
+ * until the requested number of samples (default 200000) have been replayed. Each stage reports ns/op and heap
+ * allocations (operator new) per op, the pipeline also reports how much faster than real time it ran.
+ * @author Chris Dirks (@CDFER)
+ * @url https://www.keastudios.co.nz
+ * @license HIPPOCRATIC LICENSE Version 3.0
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "KeaPipeline.h"
+
+#define SAMPLE_SECONDS 5			   // Seconds between samples in the firmware
+#define MINUTE_SECONDS 60			   // Seconds in a log record
+#define DEFAULT_SAMPLES 200000		   // Samples replayed if the command line doesn't say
+#define SERIALIZE_PASSES 20			   // Times the whole ring is formatted as data.json points
+#define EXPORT_BATCH_RECORDS 240	   // Same as the firmware
+#define LOG_SEGMENT_SECONDS 86400	   // Same as the firmware
+#define LOG_FLUSH_MAX_SECONDS 3600	   // Same as the firmware
+#define LOG_FLUSH_DAYS 30			   // Days of one record a minute replayed through each log flush policy
+#define TIME_ZONE "NZST-12NZDT,M9.5.0,M4.1.0/3"  // Same as the firmware, so the CSV lines take the same path
+
+// -----------------------------------------
+//
+//    Allocation Counting
+//
+// -----------------------------------------
+
+static size_t allocationCount = 0;	// operator new calls since the program started
+
+void* operator new(size_t size) {
+	allocationCount++;
+	void* memory = malloc(size);
+	if (memory == NULL) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+void operator delete[](void* memory) noexcept {
+	free(memory);
+}
+
+// -----------------------------------------
+//
+//    Trace Loading
+//
+// -----------------------------------------
+
+struct TracePoint {
+	uint32_t epoch;
+	double value;
+};
+
+// Reads the [epoch,value] points of every series in a data.json file, in the order the series appear
+bool loadTrace(const char* path, std::vector<std::vector<TracePoint>>& series) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	std::string text;
+	char buffer[4096];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		text.append(buffer, length);
+	}
+	fclose(file);
+
+	size_t position = 0;
+	while ((position = text.find("\"data\"", position)) != std::string::npos) {
+		position = text.find('[', position);
+		if (position == std::string::npos) {
+			break;
+		}
+		position++;
+		series.push_back(std::vector<TracePoint>());
+
+		// each point is [epoch, value], the series ends with the ] after the last point
+		while (position < text.size()) {
+			position = text.find_first_not_of(" \t\r\n,", position);
+			if (position == std::string::npos || text[position] != '[') {
+				break;
+			}
+			char* end;
+			TracePoint point;
+			point.epoch = (uint32_t)strtoul(text.c_str() + position + 1, &end, 10);
+			end = strchr(end, ',');
+			if (end == NULL) {
+				break;
+			}
+			point.value = strtod(end + 1, &end);
+			series.back().push_back(point);
+			position = text.find(']', end - text.c_str()) + 1;
+		}
+	}
+	return series.size() >= SAMPLE_CHANNEL_COUNT;
+}
+
+// Turns the trace into count Samples, looping it with the epochs moved on each time round
+std::vector<Sample> makeSamples(const std::vector<std::vector<TracePoint>>& series, size_t count) {
+	size_t traceLength = series[co2Channel].size();
+	for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+		traceLength = std::min(traceLength, series[channel].size());
+	}
+
+	std::vector<Sample> samples(count);
+	uint32_t traceSeconds = series[co2Channel][traceLength - 1].epoch - series[co2Channel][0].epoch + SAMPLE_SECONDS;
+	for (size_t i = 0; i < count; i++) {
+		size_t point = i % traceLength;
+		Sample& sample = samples[i];
+		sample.sequence = i + 1;
+		sample.epoch = series[co2Channel][point].epoch + (uint32_t)(i / traceLength) * traceSeconds;
+		sample.co2 = (uint16_t)(series[co2Channel][point].value + 0.5);
+		sample.humidity = (int16_t)(series[humidityChannel][point].value * 100);
+		sample.temperature = (int16_t)(series[temperatureChannel][point].value * 100);
+		sample.lux = 0;
+		sample.status = sampleClockValid;
+	}
+	return samples;
+}
+
+// -----------------------------------------
+//
+//    Benchmarks
+//
+// -----------------------------------------
+
+volatile uint32_t sink;	 // Results are written here so the compiler can't remove the work
+
+struct BenchmarkResult {
+	const char* name;
+	size_t ops;
+	double nanoseconds;
+	size_t allocations;
+};
+
+typedef std::chrono::steady_clock benchmarkClock;
+
+// Times from start to now and counts the allocations since startAllocations
+BenchmarkResult finishBenchmark(const char* name, size_t ops, benchmarkClock::time_point start, size_t startAllocations) {
+	BenchmarkResult result;
+	result.name = name;
+	result.ops = ops;
+	result.nanoseconds = std::chrono::duration<double, std::nano>(benchmarkClock::now() - start).count();
+	result.allocations = allocationCount - startAllocations;
+	return result;
+}
+
+void printResult(const BenchmarkResult& result) {
+	printf("%-28s %10zu ops %10.1f ns/op %8.3f allocs/op\n", result.name, result.ops, result.nanoseconds / result.ops,
+		   (double)result.allocations / result.ops);
+}
+
+// Adding each sample to the sample ring (what jsonFileManagerTask does every 5s)
+BenchmarkResult benchmarkRingPush(SampleRing& ring, const std::vector<Sample>& samples) {
+	size_t startAllocations = allocationCount;
+	benchmarkClock::time_point start = benchmarkClock::now();
+	for (size_t i = 0; i < samples.size(); i++) {
+		pushSampleToRing(ring, samples[i]);
+	}
+	sink = ring.sequence;
+	return finishBenchmark("sample ring push", samples.size(), start, startAllocations);
+}
+
+// Formatting every point of the full ring as data.json points (what a page load streams)
+BenchmarkResult benchmarkRingSerialize(const SampleRing& ring) {
+	char point[32];
+	uint32_t bytes = 0;
+	size_t ops = 0;
+	size_t startAllocations = allocationCount;
+	benchmarkClock::time_point start = benchmarkClock::now();
+	for (uint8_t pass = 0; pass < SERIALIZE_PASSES; pass++) {
+		for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+			uint32_t oldestSequence = ring.sequence - ring.count;
+			for (uint32_t sequence = oldestSequence; sequence < ring.sequence; sequence++) {
+				uint16_t index = sequenceToIndex(ring, sequence);
+				sampleChannels sampleChannel = static_cast<sampleChannels>(channel);
+				bytes += formatGraphPoint(point, sampleChannel, ring.epoch[index], getGraphValue(ring, sampleChannel, index), sequence == oldestSequence);
+				ops++;
+			}
+		}
+	}
+	sink = bytes;
+	return finishBenchmark("data.json point format", ops, start, startAllocations);
+}
+
+// Rolling the samples up into one minute records (what csvFileManagerTask does every 5s)
+BenchmarkResult benchmarkRollup(const std::vector<Sample>& samples, std::vector<LogRecord>& records) {
+	RollupAccumulator minute;
+	resetRollup(minute, 0);
+	records.reserve(samples.size() * SAMPLE_SECONDS / MINUTE_SECONDS + 1);
+
+	size_t startAllocations = allocationCount;
+	benchmarkClock::time_point start = benchmarkClock::now();
+	for (size_t i = 0; i < samples.size(); i++) {
+		const Sample& sample = samples[i];
+		uint32_t minuteEpoch = sample.epoch - (sample.epoch % MINUTE_SECONDS);
+		if (minute.bucketEpoch != minuteEpoch) {
+			if (minute.count > 0) {
+				records.push_back(toLogRecord(toRollupRecord(minute)));
+			}
+			resetRollup(minute, minuteEpoch);
+		}
+		const int32_t values[SAMPLE_CHANNEL_COUNT] = {sample.co2, sample.humidity, sample.temperature};
+		addToRollup(minute, values);
+	}
+	sink = records.size();
+	return finishBenchmark("one minute rollup", samples.size(), start, startAllocations);
+}
+
+// Formatting each log record as a CSV line (what a Kea-CO2-Data.csv download does)
+BenchmarkResult benchmarkCsv(const std::vector<LogRecord>& records) {
+	char line[64];
+	uint32_t bytes = 0;
+	size_t startAllocations = allocationCount;
+	benchmarkClock::time_point start = benchmarkClock::now();
+	for (size_t i = 0; i < records.size(); i++) {
+		bytes += formatCsvLine(line, records[i]);
+	}
+	sink = bytes;
+	return finishBenchmark("csv line format", records.size(), start, startAllocations);
+}
+
+// Encoding the log records into export batches (what exporterTask sends), bytes is the size of all the batches
+BenchmarkResult benchmarkExport(const std::vector<LogRecord>& records, size_t& bytes) {
+	static uint8_t batch[EXPORT_BATCH_RECORDS * EXPORT_RECORD_MAX_BYTES];
+	ExportEncoder encoder;
+	startExportBatch(encoder);
+	bytes = 0;
+	size_t startAllocations = allocationCount;
+	benchmarkClock::time_point start = benchmarkClock::now();
+	for (size_t i = 0; i < records.size(); i++) {
+		if (encoder.count == EXPORT_BATCH_RECORDS) {
+			bytes += encoder.length;
+			startExportBatch(encoder);
+		}
+		addToExportBatch(encoder, batch, records[i]);
+	}
+	bytes += encoder.length;
+	sink = batch[0];
+	return finishBenchmark("export batch encode", records.size(), start, startAllocations);
+}
+
+// The flushes and estimated flash cost of writing the log records into daily segments
+struct LogFlushTotals {
+	size_t flushes;
+	size_t erases;
+	size_t programmedBytes;
+};
+
+// Adds one flush of the records waiting to a segment
+void addLogFlush(LogFlushTotals& totals, uint32_t& fileBytes, uint32_t& waitingBytes) {
+	LogFlushCost cost = estimateLogFlushCost(fileBytes, waitingBytes);
+	totals.flushes++;
+	totals.erases += cost.erases;
+	totals.programmedBytes += cost.programmedBytes;
+	fileBytes += waitingBytes;
+	waitingBytes = 0;
+}
+
+// Replays days of one record a minute through a flush policy: coalesced (the firmware's appendLogRecord) or the older
+// one that flushed every record of the first 512 bytes of a segment and then every 128 bytes (the trace isn't used,
+// its points are only where a value changed)
+LogFlushTotals replayLogFlushes(uint32_t days, bool isCoalesced) {
+	LogFlushTotals totals = {0, 0, 0};
+	uint32_t fileBytes = 0;
+	uint32_t waitingBytes = 0;
+	uint32_t firstWaitingEpoch = 0;
+	uint32_t recordCount = days * LOG_SEGMENT_SECONDS / MINUTE_SECONDS;
+	for (uint32_t i = 0; i < recordCount; i++) {
+		uint32_t epoch = i * MINUTE_SECONDS;
+		if (i > 0 && epoch % LOG_SEGMENT_SECONDS == 0) {
+			if (waitingBytes > 0) {
+				addLogFlush(totals, fileBytes, waitingBytes);  // the segment is closed
+			}
+			fileBytes = 0;
+		}
+		if (waitingBytes == 0) {
+			firstWaitingEpoch = epoch;
+		}
+		waitingBytes += sizeof(LogRecord);
+
+		bool isFlushed;
+		if (isCoalesced) {
+			isFlushed = isLogSectorFilled(fileBytes, waitingBytes / sizeof(LogRecord)) || epoch - firstWaitingEpoch >= LOG_FLUSH_MAX_SECONDS;
+		} else {
+			isFlushed = waitingBytes > 128 || fileBytes + waitingBytes < 512;
+		}
+		if (isFlushed) {
+			addLogFlush(totals, fileBytes, waitingBytes);
+		}
+	}
+	return totals;
+}
+
+// Mapping each sample onto the light bar and moving the bar one frame towards it
+BenchmarkResult benchmarkLightBar(const std::vector<Sample>& samples) {
+	uint16_t position = 0;
+	size_t startAllocations = allocationCount;
+	benchmarkClock::time_point start = benchmarkClock::now();
+	for (size_t i = 0; i < samples.size(); i++) {
+		uint16_t targetPosition = mapCO2toPosition(samples[i].co2);
+		updatePosition(position, targetPosition);
+	}
+	sink = position;
+	return finishBenchmark("light bar position", samples.size(), start, startAllocations);
+}
+
+int main(int argc, char** argv) {
+	const char* tracePath = (argc > 1) ? argv[1] : "data source (not gzipped)/data.json";
+	size_t sampleCount = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_SAMPLES;
+	setenv("TZ", TIME_ZONE, 1);
+	tzset();
+
+	std::vector<std::vector<TracePoint>> series;
+	if (loadTrace(tracePath, series) == false || series[co2Channel].empty() || sampleCount == 0) {
+		fprintf(stderr, "Could not read a CO2, humidity and temperature series from %s\n", tracePath);
+		return 1;
+	}
+	std::vector<Sample> samples = makeSamples(series, sampleCount);
+	printf("Replaying %zu samples (%zu point trace from %s)\n\n", samples.size(), series[co2Channel].size(), tracePath);
+
+	static SampleRing ring;	 // static like the firmware's (it is too big for the stack)
+	std::vector<LogRecord> records;
+
+	BenchmarkResult push = benchmarkRingPush(ring, samples);
+	BenchmarkResult serialize = benchmarkRingSerialize(ring);
+	BenchmarkResult rollup = benchmarkRollup(samples, records);
+	BenchmarkResult csv = benchmarkCsv(records);
+	size_t exportBytes;
+	BenchmarkResult exportBatches = benchmarkExport(records, exportBytes);
+	BenchmarkResult lightBar = benchmarkLightBar(samples);
+
+	printResult(push);
+	printResult(serialize);
+	printResult(rollup);
+	printResult(csv);
+	printResult(exportBatches);
+	printResult(lightBar);
+
+	// every sample goes through the ring, the rollup and the light bar, one in 12 becomes a csv line
+	double pipelineNanoseconds = push.nanoseconds + rollup.nanoseconds + lightBar.nanoseconds + csv.nanoseconds;
+	double simulatedNanoseconds = (double)samples.size() * SAMPLE_SECONDS * 1e9;
+	printf("\nPipeline: %.1f ns/sample, %.0fx faster than real time\n", pipelineNanoseconds / samples.size(), simulatedNanoseconds / pipelineNanoseconds);
+	printf("Export batches: %.2f bytes/record (%zu in the log)\n", (double)exportBytes / records.size(), sizeof(LogRecord));
+
+	const bool policies[] = {false, true};
+	for (uint8_t i = 0; i < 2; i++) {
+		LogFlushTotals totals = replayLogFlushes(LOG_FLUSH_DAYS, policies[i]);
+		printf("Log flushes (%s): %.1f/day, %.1f sector erases/day, %.0f bytes programmed/day\n", policies[i] ? "coalesced" : "every 128 B",
+			   (double)totals.flushes / LOG_FLUSH_DAYS, (double)totals.erases / LOG_FLUSH_DAYS, (double)totals.programmedBytes / LOG_FLUSH_DAYS);
+	}
+	return 0;
+}
@@ -0,0 +1,200 @@
+var defaultChartOptions = {
+    chart: {
+        type: 'line',
+        decimalsInFloat: 0,
+        height: 350,
+        animations: {
+            enabled: false,
+        },
+        toolbar: {
+            show: true,
+            tools: {
+                download: '<img class="icon" src="download.svg" width="50">',
+                selection: false,
+                zoom: false,
+                zoomin: false,
+                zoomout: false,
+                pan: false,
+                reset: false,
+            }
+        },
+    },
+    series: [],
+    noData: {
+        text: 'Loading Data...'
+    },
+    stroke: {
+        curve: 'smooth'
+    },
+    xaxis: {
+        type: 'datetime',
+        labels: {
+            datetimeUTC: false,
+        }
+    }
+};
+
+// The page arrives with the readings and a sparkline of each series already drawn by the device (see processPagePlaceholder),
+// so the chart library is only downloaded once that is on screen, the charts then replace the sparklines.
+let charts = []
+const chartScript = document.createElement('script')
+chartScript.src = 'apexcharts.min.js'
+chartScript.onload = startCharts
+document.body.appendChild(chartScript)
+
+// The first update downloads all the data, after that only points newer than newestEpoch are downloaded and appended.
+// Every fullUpdateInterval updates the whole series is downloaded again so the charts drop points the device no longer has.
+const fullUpdateInterval = 120
+let newestEpoch = 0
+let updatesSinceFullUpdate = 0
+let lastValues = []
+
+function startCharts() {
+    ['#chartCO2', '#chartHumidity', '#chartTemperature'].forEach(selector => {
+        const element = document.querySelector(selector)
+        element.innerHTML = ''  // remove the sparkline
+        charts.push(new ApexCharts(element, defaultChartOptions))
+    })
+    charts.forEach(
+        chart => { chart.render() }
+    )
+    updateData();
+
+    // New samples are pushed by the device as they are measured, fall back to polling if the browser can't do Server-Sent Events
+    if (window.EventSource) {
+        let source = new EventSource('events')
+        source.onopen = () => { if (newestEpoch > 0) updateData() }  // catch up on anything missed while disconnected
+        source.addEventListener('sample', event => { appendSample(JSON.parse(event.data)) })
+        setInterval(() => { updatesSinceFullUpdate = fullUpdateInterval; updateData() }, fullUpdateInterval * 5000)
+    } else {
+        setInterval(updateData, 5000);
+    }
+}
+
+const readingIds = ['readingCO2', 'readingHumidity', 'readingTemperature']
+
+// sample is [epoch, CO2, humidity, temperature], a point is only added to a chart when its value changes (same as data.json)
+function appendSample(sample) {
+    if (newestEpoch == 0 || sample[0] <= newestEpoch) return
+    newestEpoch = sample[0]
+    readingIds.forEach((id, index) => { document.getElementById(id).textContent = sample[index + 1] })
+    charts.forEach((chart, index) => {
+        if (sample[index + 1] !== lastValues[index]) {
+            lastValues[index] = sample[index + 1]
+            chart.appendData([{ data: [[sample[0] * 1000, sample[index + 1]]] }])
+        }
+    })
+}
+
+// Names, colours and the decimal places each series is graphed at, in the channel order of data.bin
+const seriesInfo = [
+    { name: 'CO2', color: '#70AE6E', y_title: 'CO2 Parts Per Million (PPM)', decimals: 0 },
+    { name: 'Humidity', color: '#333745', y_title: 'Relative humidity (%RH)', decimals: 0 },
+    { name: 'Temperature', color: '#FE5F55', y_title: 'Temperature (Deg C)', decimals: 1 },
+]
+
+// Decodes data.bin (see SampleRingBinaryStream in main.cpp) into the same series objects as data.json
+// returns { series: [...], newestEpoch: epoch of the newest sample (0 if empty) }
+function decodeDataBin(buffer) {
+    const view = new DataView(buffer)
+    if (view.byteLength < 12 || view.getUint32(0, true) != 0x3141454B) throw new Error('not data.bin')
+    const count = view.getUint16(4, true)
+    const channels = view.getUint8(6)
+    let epoch = view.getUint32(8, true)
+    let offset = 12
+    const descriptors = []
+    for (let channel = 0; channel < channels; channel++) descriptors.push(view.getUint8(offset++))
+    const valuesOffset = offset
+    offset += channels * count * 2
+
+    const epochs = new Float64Array(count)
+    for (let i = 0; i < count; i++) {
+        if (i > 0) {  // zigzag varint difference to the previous epoch
+            let zigzag = 0, shift = 0, byte
+            do {
+                byte = view.getUint8(offset++)  // throws past the end of a short (interrupted) file
+                zigzag |= (byte & 0x7F) << shift
+                shift += 7
+            } while (byte & 0x80)
+            epoch += (zigzag >>> 1) ^ -(zigzag & 1)
+        }
+        epochs[i] = epoch
+    }
+
+    const series = seriesInfo.slice(0, channels).map((info, channel) => {
+        const signed = descriptors[channel] & 0x80
+        const scale = Math.pow(10, descriptors[channel] & 0x7F)
+        const graphScale = Math.pow(10, info.decimals)
+        const data = []
+        let prevValue
+        for (let i = 0; i < count; i++) {
+            const position = valuesOffset + (channel * count + i) * 2
+            const raw = signed ? view.getInt16(position, true) : view.getUint16(position, true)
+            const value = Math.round(raw / scale * graphScale) / graphScale
+            if (value !== prevValue) data.push([epochs[i], value])  // only when the graphed value changes (same as data.json)
+            prevValue = value
+        }
+        return { name: info.name, color: info.color, y_title: info.y_title, data: data }
+    })
+    return { series: series, newestEpoch: (count > 0) ? epochs[count - 1] : 0 }
+}
+
+function updateData() {
+    let fullUpdate = (newestEpoch == 0 || updatesSinceFullUpdate >= fullUpdateInterval)
+    updatesSinceFullUpdate = fullUpdate ? 0 : updatesSinceFullUpdate + 1
+
+    if (fullUpdate && window.DataView) {
+        fetch('data.bin')
+            .then(response => {
+                if (!response.ok) throw new Error(response.status)
+                return response.arrayBuffer()
+            })
+            .then(buffer => {
+                const decoded = decodeDataBin(buffer)
+                decoded.series.forEach((dataSeries, index) => {
+                    dataSeries.data.forEach((datapoint) => {
+                        datapoint[0] = datapoint[0] * 1000
+                        lastValues[index] = datapoint[1]
+                    })
+                    charts[index].updateSeries([dataSeries])
+                    charts[index].updateOptions({ yaxis: { title: { text: dataSeries.y_title, style: { fontWeight: 300 } }, }, })
+                })
+                newestEpoch = Math.max(newestEpoch, decoded.newestEpoch)
+            })
+            .catch(() => { newestEpoch = 0 })
+        return
+    }
+
+    let responseNewestEpoch = 0
+    fetch(fullUpdate ? 'data.json' : 'data.json?since=' + newestEpoch)
+        .then(response => {
+            if (!response.ok) throw new Error(response.status)
+            responseNewestEpoch = Number(response.headers.get('X-Newest-Epoch'))
+            return response.json()
+        })
+        .then(response => {
+            response.forEach((dataSeries, index) => {
+                if (!fullUpdate) {
+                    dataSeries.data = dataSeries.data.filter(datapoint => datapoint[0] > newestEpoch)  // skip anything already pushed by events
+                }
+                dataSeries.data.forEach((datapoint) => {
+                    datapoint[0] = datapoint[0] * 1000
+                    lastValues[index] = datapoint[1]
+                })
+                if (fullUpdate) {
+                    charts[index].updateSeries([dataSeries])
+                    charts[index].updateOptions({ yaxis: { title: { text: dataSeries.y_title, style: { fontWeight: 300 } }, }, })
+                } else if (dataSeries.data.length > 0) {
+                    charts[index].appendData([{ data: dataSeries.data }])
+                }
+            })
+            newestEpoch = Math.max(newestEpoch, responseNewestEpoch)
+        })
+        .catch(() => { newestEpoch = 0 })
+}
+
+function clearData() {
+    var xhttp = new XMLHttpRequest();
+    xhttp.open("GET", "/clear", true);
+    xhttp.send();
+}
@@ -0,0 +1,638 @@
+/**
+ * @file KeaPipeline.h
+ * @brief The pure logic of the data pipeline (samples, the sample ring, log records, rollups and the light bar position).
+ * Nothing in here touches the hardware, FreeRTOS or Arduino, so the same code runs in the firmware and in the host
+ * benchmark ([env:native], see bench/). Everything is inline so the firmware's config defines (set before this is
+ * included) are the ones used, the defaults below are only for the host.
+ * @author Chris Dirks (@CDFER)
+ * @url https://www.keastudios.co.nz
+ * @license HIPPOCRATIC LICENSE Version 3.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+// Defaults for a host build (the firmware defines these in main.cpp)
+#ifndef SAMPLE_RING_POINTS
+#define SAMPLE_RING_POINTS 2048
+#endif
+#ifndef CO2_MAX
+#define CO2_MAX 2000
+#endif
+#ifndef CO2_MIN
+#define CO2_MIN 400
+#endif
+#ifndef LIGHTBAR_MAX_POSITION
+#define LIGHTBAR_MAX_POSITION 11 * 255
+#endif
+#ifndef LIGHTBAR_MIN_POSITION
+#define LIGHTBAR_MIN_POSITION 255
+#endif
+#ifndef FLEET_RING_POINTS
+#define FLEET_RING_POINTS 360
+#endif
+
+// -----------------------------------------
+//
+//    Samples
+//
+// -----------------------------------------
+
+// The graph series served in data.json, in the same order as the channels of the sample ring.
+enum sampleChannels {
+	co2Channel,
+	humidityChannel,
+	temperatureChannel,
+	SAMPLE_CHANNEL_COUNT
+};
+
+// Status flags of a Sample
+enum sampleStatusFlags {
+	sampleClockValid = 1 << 0,	// the epoch came from a clock that has been set (the RTC or NTP)
+	sampleNtpSynced = 1 << 1,	// the clock has been set by NTP since boot
+	sampleLuxValid = 1 << 2		// the light sensor has given a reading
+};
+
+/**
+ * @brief One measurement from the sensor manager, in the units the sample ring and log store.
+ * Published to sampleMailbox, see publishSample.
+ */
+struct Sample {
+	uint32_t sequence;	   // Increments every sample, so a consumer can tell if it missed one
+	uint32_t epoch;		   // Seconds since 1970 (UTC)
+	uint16_t co2;		   // CO2 (PPM)
+	int16_t humidity;	   // Relative humidity (centi %RH, smoothed)
+	int16_t temperature;   // Temperature (centi DegC, smoothed)
+	uint16_t lux;		   // Ambient light (lux) from the light bar's light sensor
+	uint8_t status;		   // sampleStatusFlags
+};
+
+/**
+ * @brief A fixed-layout circular buffer of sensor samples (struct of arrays).
+ * Every sample shares one epoch slot and has one value slot per channel, so inserting is O(1)
+ * and never touches the heap. JSON is only produced from this when a client asks for it.
+ * - head: index of the slot the next sample will be written to
+ * - count: number of valid samples in the buffer (0 - SAMPLE_RING_POINTS)
+ * - sequence: total number of samples ever written (never reset), so a reader can tell if a sample it
+ *   is part way through streaming has since been overwritten. The newest sample is sequence - 1.
+ */
+struct SampleRing {
+	uint32_t epoch[SAMPLE_RING_POINTS];		  // Seconds since 1970 (UTC)
+	uint16_t co2[SAMPLE_RING_POINTS];		  // CO2 (PPM)
+	int16_t humidity[SAMPLE_RING_POINTS];	  // Relative humidity (centi %RH)
+	int16_t temperature[SAMPLE_RING_POINTS];  // Temperature (centi DegC)
+	uint16_t head;
+	uint16_t count;
+	uint32_t sequence;
+};
+
+// Writes one sample over the oldest slot of a sample ring (O(1), no allocation, the caller does any locking)
+inline void pushSampleToRing(SampleRing& ring, const Sample& sample) {
+	uint16_t index = ring.head;
+	ring.epoch[index] = sample.epoch;
+	ring.co2[index] = sample.co2;
+	ring.humidity[index] = sample.humidity;
+	ring.temperature[index] = sample.temperature;
+
+	ring.head = (index + 1 < SAMPLE_RING_POINTS) ? (index + 1) : (0);	// increment from 0 -> SAMPLE_RING_POINTS - 1 -> 0 -> etc...
+	if (ring.count < SAMPLE_RING_POINTS) {
+		ring.count++;
+	}
+	ring.sequence++;
+}
+
+/**
+ * @brief Converts a stored value (PPM or centi units) to the resolution it is graphed at.
+ * - CO2: PPM
+ * - Humidity: %RH (rounded to 0 decimal places)
+ * - Temperature: tenths of a DegC (rounded to 1 decimal place)
+ * @param channel Which channel the value is from
+ * @param value The value as stored in the sample ring or log
+ */
+inline int32_t toGraphValue(sampleChannels channel, int32_t value) {
+	switch (channel) {
+	case co2Channel:
+		return value;
+	case humidityChannel:
+		return (value + ((value < 0) ? -50 : 50)) / 100;
+	default:
+		return (value + ((value < 0) ? -5 : 5)) / 10;
+	}
+}
+
+// Gets the value of a channel in a slot of a sample ring at the resolution it is graphed at (see toGraphValue)
+inline int32_t getGraphValue(const SampleRing& ring, sampleChannels channel, uint16_t index) {
+	switch (channel) {
+	case co2Channel:
+		return toGraphValue(channel, ring.co2[index]);
+	case humidityChannel:
+		return toGraphValue(channel, ring.humidity[index]);
+	default:
+		return toGraphValue(channel, ring.temperature[index]);
+	}
+}
+
+// Formats a graphed value as a JSON number (temperature has 1 decimal place, everything else is an integer)
+inline int formatGraphValue(char* buffer, sampleChannels channel, int32_t value) {
+	if (channel == temperatureChannel) {
+		const char* sign = (value < 0) ? "-" : "";
+		return sprintf(buffer, "%s%i.%i", sign, abs(value) / 10, abs(value) % 10);
+	}
+	return sprintf(buffer, "%i", value);
+}
+
+/**
+ * @brief Formats one [epoch,value] point of a data.json series.
+ * @param buffer Where to write the text (at least 32 chars)
+ * @param isFirstPoint Leaves out the leading comma for the first point of a series
+ * @return The number of chars written
+ */
+inline int formatGraphPoint(char* buffer, sampleChannels channel, uint32_t epoch, int32_t value, bool isFirstPoint) {
+	int length = sprintf(buffer, "%s[%u,", isFirstPoint ? "" : ",", epoch);
+	length += formatGraphValue(buffer + length, channel, value);
+	length += sprintf(buffer + length, "]");
+	return length;
+}
+
+// Converts a sequence number to its slot in the sample ring.
+// @note In the firmware the caller must hold sampleRingMutex, and the sequence must still be in the ring.
+inline uint16_t sequenceToIndex(const SampleRing& ring, uint32_t sequence) {
+	return (ring.head + SAMPLE_RING_POINTS - (ring.sequence - sequence)) % SAMPLE_RING_POINTS;
+}
+
+/**
+ * @brief Finds the oldest sample newer than an epoch, searching from the newest end of the ring
+ * (so finding a recent epoch only touches the few samples after it).
+ * @note In the firmware the caller must hold sampleRingMutex.
+ * @param sinceEpoch 0 finds the oldest sample in the ring
+ * @return The sequence number of the sample (ring.sequence if there are no newer samples)
+ */
+inline uint32_t findFirstSequenceAfter(const SampleRing& ring, uint32_t sinceEpoch) {
+	uint32_t oldestSequence = ring.sequence - ring.count;
+	uint32_t sequence = ring.sequence;
+	while (sequence > oldestSequence && ring.epoch[sequenceToIndex(ring, sequence - 1)] > sinceEpoch) {
+		sequence--;
+	}
+	return sequence;
+}
+
+// -----------------------------------------
+//
+//    Log Records and Rollups
+//
+// -----------------------------------------
+
+/**
+ * @brief One minute of sensor data as it is stored in the log.
+ * Records are a fixed 10 bytes (with no file header), so record n of a segment is always at n * sizeof(LogRecord)
+ * and the log can be seeked by time. The log is only turned into CSV text when it is downloaded.
+ */
+struct __attribute__((packed)) LogRecord {
+	uint32_t epoch;		  // Seconds since 1970 (UTC)
+	uint16_t co2;		  // CO2 (PPM)
+	int16_t humidity;	  // Relative humidity (centi %RH)
+	int16_t temperature;  // Temperature (centi DegC)
+};
+
+/**
+ * @brief The running min/max/mean of one bucket of samples (adding a sample is O(1)).
+ * Values are in the units they are stored in (PPM or centi units, see LogRecord).
+ */
+struct RollupAccumulator {
+	uint32_t bucketEpoch;  // Start of the bucket
+	uint32_t count;		   // Number of samples in the bucket (0 if it is empty)
+	int32_t minimum[SAMPLE_CHANNEL_COUNT];
+	int32_t maximum[SAMPLE_CHANNEL_COUNT];
+	int32_t sum[SAMPLE_CHANNEL_COUNT];
+};
+
+/**
+ * @brief One bucket of a rollup tier as it is stored in flash (24 bytes).
+ */
+struct __attribute__((packed)) RollupRecord {
+	uint32_t epoch;	 // Start of the bucket
+	uint16_t count;	 // Number of 5s samples in the bucket
+	uint16_t co2Minimum, co2Maximum, co2Mean;						  // CO2 (PPM)
+	int16_t humidityMinimum, humidityMaximum, humidityMean;			  // Relative humidity (centi %RH)
+	int16_t temperatureMinimum, temperatureMaximum, temperatureMean;  // Temperature (centi DegC)
+};
+
+// Empties an accumulator and moves it to a new bucket
+inline void resetRollup(RollupAccumulator& rollup, uint32_t bucketEpoch) {
+	rollup.bucketEpoch = bucketEpoch;
+	rollup.count = 0;
+	for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+		rollup.minimum[channel] = INT32_MAX;
+		rollup.maximum[channel] = INT32_MIN;
+		rollup.sum[channel] = 0;
+	}
+}
+
+// Adds one sample (values in stored units, in sampleChannels order) to an accumulator
+inline void addToRollup(RollupAccumulator& rollup, const int32_t values[SAMPLE_CHANNEL_COUNT]) {
+	for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+		rollup.minimum[channel] = std::min(rollup.minimum[channel], values[channel]);
+		rollup.maximum[channel] = std::max(rollup.maximum[channel], values[channel]);
+		rollup.sum[channel] += values[channel];
+	}
+	rollup.count++;
+}
+
+// Adds a whole finer bucket to an accumulator (the mean stays weighted by the number of samples)
+inline void mergeRollup(RollupAccumulator& rollup, const RollupRecord& record) {
+	const int32_t minimums[SAMPLE_CHANNEL_COUNT] = {record.co2Minimum, record.humidityMinimum, record.temperatureMinimum};
+	const int32_t maximums[SAMPLE_CHANNEL_COUNT] = {record.co2Maximum, record.humidityMaximum, record.temperatureMaximum};
+	const int32_t means[SAMPLE_CHANNEL_COUNT] = {record.co2Mean, record.humidityMean, record.temperatureMean};
+	for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+		rollup.minimum[channel] = std::min(rollup.minimum[channel], minimums[channel]);
+		rollup.maximum[channel] = std::max(rollup.maximum[channel], maximums[channel]);
+		rollup.sum[channel] += means[channel] * record.count;
+	}
+	rollup.count += record.count;
+}
+
+// Gets the mean of one channel of an accumulator (rounded, the accumulator must not be empty)
+inline int32_t rollupMean(const RollupAccumulator& rollup, sampleChannels channel) {
+	int32_t sum = rollup.sum[channel];
+	int32_t halfCount = rollup.count / 2;
+	return (sum + ((sum < 0) ? -halfCount : halfCount)) / (int32_t)rollup.count;
+}
+
+// Converts an accumulator into the record stored in flash
+inline RollupRecord toRollupRecord(const RollupAccumulator& rollup) {
+	RollupRecord record;
+	record.epoch = rollup.bucketEpoch;
+	record.count = std::min(rollup.count, (uint32_t)UINT16_MAX);
+	record.co2Minimum = rollup.minimum[co2Channel];
+	record.co2Maximum = rollup.maximum[co2Channel];
+	record.co2Mean = rollupMean(rollup, co2Channel);
+	record.humidityMinimum = rollup.minimum[humidityChannel];
+	record.humidityMaximum = rollup.maximum[humidityChannel];
+	record.humidityMean = rollupMean(rollup, humidityChannel);
+	record.temperatureMinimum = rollup.minimum[temperatureChannel];
+	record.temperatureMaximum = rollup.maximum[temperatureChannel];
+	record.temperatureMean = rollupMean(rollup, temperatureChannel);
+	return record;
+}
+
+// Gets the record stored in the log for a one minute rollup (the log only keeps the mean)
+inline LogRecord toLogRecord(const RollupRecord& minute) {
+	LogRecord record;
+	record.epoch = minute.epoch;
+	record.co2 = minute.co2Mean;
+	record.humidity = minute.humidityMean;
+	record.temperature = minute.temperatureMean;
+	return record;
+}
+
+// Writes a log record as a CSV line in local time (D/M/Y,H:M,CO2,Humidity,Temperature)
+inline int formatCsvLine(char* buffer, const LogRecord& record) {
+	const char* time_format = "%d/%m/%Y,%H:%M";
+	time_t epoch = record.epoch;
+	struct tm timeInfo;
+	localtime_r(&epoch, &timeInfo);
+	char timeStamp[24];
+	strftime(timeStamp, sizeof(timeStamp), time_format, &timeInfo);
+
+	int length = sprintf(buffer, "%s,%3u,%2i,", timeStamp, record.co2, toGraphValue(humidityChannel, record.humidity));
+	length += formatGraphValue(buffer + length, temperatureChannel, toGraphValue(temperatureChannel, record.temperature));
+	length += sprintf(buffer + length, "\r\n");
+	return length;
+}
+
+#define LOG_BLOCK_BYTES 4096									// Flash sector (and LittleFS block) size
+#define LOG_TAIL_RECORDS (LOG_BLOCK_BYTES / sizeof(LogRecord))	// Records the newest segment can hold in RAM (a sector's worth)
+
+/**
+ * @brief An estimate of what one flush of the newest log segment costs the flash.
+ * LittleFS never programs a block twice, so appending to a file whose last block is part full first copies that
+ * part into a newly erased block. A flush erases every block the appended bytes end up in, and programs the
+ * copied part as well as the new bytes (the metadata commit is counted by the flush itself).
+ */
+struct LogFlushCost {
+	uint32_t erases;
+	uint32_t programmedBytes;
+};
+
+// Estimates the cost of appending bytes to a fileBytes long segment with one flush
+inline LogFlushCost estimateLogFlushCost(uint32_t fileBytes, uint32_t bytes) {
+	LogFlushCost cost;
+	cost.erases = (fileBytes + bytes + LOG_BLOCK_BYTES - 1) / LOG_BLOCK_BYTES - fileBytes / LOG_BLOCK_BYTES;
+	cost.programmedBytes = fileBytes % LOG_BLOCK_BYTES + bytes;
+	return cost;
+}
+
+// Checks if the records waiting in RAM reach the end of the sector the segment ends in (flushing then leaves the
+// smallest part full block to copy on the next flush)
+inline bool isLogSectorFilled(uint32_t fileBytes, uint32_t tailRecords) {
+	return tailRecords >= LOG_TAIL_RECORDS || fileBytes % LOG_BLOCK_BYTES + tailRecords * sizeof(LogRecord) >= LOG_BLOCK_BYTES;
+}
+
+// -----------------------------------------
+//
+//    Export Batches
+//
+// -----------------------------------------
+
+// Batches of log records sent to the collector ("kea-delta-1"). Each record is its epoch, CO2, humidity and temperature
+// as differences from the record before it (the first from zero), zigzag varint coded, so a minute that moved a little
+// is 4 bytes rather than the 10 it takes in the log.
+#define EXPORT_RECORD_MAX_BYTES 14	// a 5 byte epoch and three 3 byte values
+
+struct ExportEncoder {
+	LogRecord previous;
+	size_t length;	  // bytes written to the batch
+	uint16_t count;	  // records in the batch
+};
+
+// Empties an encoder for a new batch
+inline void startExportBatch(ExportEncoder& encoder) {
+	encoder.previous.epoch = 0;
+	encoder.previous.co2 = 0;
+	encoder.previous.humidity = 0;
+	encoder.previous.temperature = 0;
+	encoder.length = 0;
+	encoder.count = 0;
+}
+
+// Writes value 7 bits at a time (low bits first, the top bit says another byte follows), returns the bytes written
+inline size_t writeVarint(uint8_t* buffer, uint32_t value) {
+	size_t length = 0;
+	while (value >= 0x80) {
+		buffer[length++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buffer[length++] = (uint8_t)value;
+	return length;
+}
+
+// Maps small differences of either sign onto small unsigned numbers (0, -1, 1, -2 ... -> 0, 1, 2, 3 ...)
+inline uint32_t zigzag(int32_t value) {
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// Adds a record to the batch in buffer (which needs EXPORT_RECORD_MAX_BYTES free after encoder.length)
+inline void addToExportBatch(ExportEncoder& encoder, uint8_t* buffer, const LogRecord& record) {
+	uint8_t* out = buffer + encoder.length;
+	size_t length = writeVarint(out, record.epoch - encoder.previous.epoch);  // the log is sorted, so this never goes back
+	length += writeVarint(out + length, zigzag((int32_t)record.co2 - encoder.previous.co2));
+	length += writeVarint(out + length, zigzag((int32_t)record.humidity - encoder.previous.humidity));
+	length += writeVarint(out + length, zigzag((int32_t)record.temperature - encoder.previous.temperature));
+	encoder.length += length;
+	encoder.count++;
+	encoder.previous = record;
+}
+
+// -----------------------------------------
+//
+//    Fleet Packets
+//
+// -----------------------------------------
+
+#define FLEET_PACKET_MAGIC 0x464B  // "KF" (little endian)
+#define FLEET_PACKET_VERSION 1
+#define FLEET_ROOM_CHARS 16		   // Longest room name a leaf sends (it isn't null terminated when it is this long)
+
+/**
+ * @brief One sample broadcast by a leaf over ESP-NOW (36 bytes, in the units the sample ring stores).
+ */
+struct __attribute__((packed)) FleetPacket {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t status;		  // sampleStatusFlags of the sample
+	uint32_t sequence;	  // The leaf's sample sequence number (starts again from 1 when the leaf reboots)
+	uint32_t epoch;		  // Seconds since 1970 (UTC) by the leaf's clock
+	uint16_t co2;		  // CO2 (PPM)
+	int16_t humidity;	  // Relative humidity (centi %RH)
+	int16_t temperature;  // Temperature (centi DegC)
+	uint16_t lux;		  // Ambient light (lux)
+	char room[FLEET_ROOM_CHARS];
+};
+
+/**
+ * @brief The samples the gateway has heard from one leaf, a smaller sample ring (see SampleRing) plus the leaf's details.
+ */
+struct FleetLeaf {
+	bool isUsed;
+	uint8_t mac[6];
+	char room[FLEET_ROOM_CHARS + 1];
+	uint32_t lastHeard;		  // Gateway epoch the last packet arrived
+	uint32_t lastSequence;	  // The leaf's sequence number of the last packet
+	uint32_t received;		  // Packets received
+	uint32_t missed;		  // Packets the sequence numbers say were lost
+	uint16_t lux;
+	uint8_t status;
+
+	uint32_t epoch[FLEET_RING_POINTS];
+	uint16_t co2[FLEET_RING_POINTS];
+	int16_t humidity[FLEET_RING_POINTS];
+	int16_t temperature[FLEET_RING_POINTS];
+	uint16_t head;
+	uint16_t count;
+	uint32_t sequence;  // Points ever written to this ring (the newest is sequence - 1)
+};
+
+// Makes the packet a leaf broadcasts for a sample
+inline FleetPacket toFleetPacket(const Sample& sample, const char* room) {
+	FleetPacket packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.magic = FLEET_PACKET_MAGIC;
+	packet.version = FLEET_PACKET_VERSION;
+	packet.status = sample.status;
+	packet.sequence = sample.sequence;
+	packet.epoch = sample.epoch;
+	packet.co2 = sample.co2;
+	packet.humidity = sample.humidity;
+	packet.temperature = sample.temperature;
+	packet.lux = sample.lux;
+	strncpy(packet.room, room, FLEET_ROOM_CHARS);
+	return packet;
+}
+
+// Checks that an ESP-NOW packet is a FleetPacket of this version
+inline bool isFleetPacket(const uint8_t* data, int length) {
+	FleetPacket packet;
+	if (length != (int)sizeof(packet)) {
+		return false;
+	}
+	memcpy(&packet, data, sizeof(packet));
+	return packet.magic == FLEET_PACKET_MAGIC && packet.version == FLEET_PACKET_VERSION;
+}
+
+// Gets the slot of a point in a leaf's ring (the sequence must still be in it)
+inline uint16_t fleetSequenceToIndex(const FleetLeaf& leaf, uint32_t sequence) {
+	return (leaf.head + FLEET_RING_POINTS - (leaf.sequence - sequence)) % FLEET_RING_POINTS;
+}
+
+// Finds the oldest point of a leaf's ring newer than sinceEpoch, from the newest end (leaf.sequence if there are none)
+inline uint32_t findFirstFleetSequenceAfter(const FleetLeaf& leaf, uint32_t sinceEpoch) {
+	uint32_t oldestSequence = leaf.sequence - leaf.count;
+	uint32_t sequence = leaf.sequence;
+	while (sequence > oldestSequence && leaf.epoch[fleetSequenceToIndex(leaf, sequence - 1)] > sinceEpoch) {
+		sequence--;
+	}
+	return sequence;
+}
+
+/**
+ * @brief Finds the slot of the leaf with a MAC address, taking a free one (or the one heard from longest ago) for a new leaf.
+ * @return The index of the slot, the caller empties it (see startFleetLeaf) if its MAC doesn't match.
+ */
+inline uint8_t findFleetLeaf(const FleetLeaf* leaves, uint8_t leafCount, const uint8_t* mac) {
+	uint8_t oldest = 0;
+	for (uint8_t i = 0; i < leafCount; i++) {
+		if (leaves[i].isUsed && memcmp(leaves[i].mac, mac, sizeof(leaves[i].mac)) == 0) {
+			return i;
+		}
+		if (leaves[oldest].isUsed && (leaves[i].isUsed == false || leaves[i].lastHeard < leaves[oldest].lastHeard)) {
+			oldest = i;
+		}
+	}
+	return oldest;
+}
+
+// Empties a slot for a new leaf
+inline void startFleetLeaf(FleetLeaf& leaf, const uint8_t* mac) {
+	leaf.isUsed = true;
+	memcpy(leaf.mac, mac, sizeof(leaf.mac));
+	leaf.room[0] = '\0';
+	leaf.lastHeard = 0;
+	leaf.lastSequence = 0;
+	leaf.received = 0;
+	leaf.missed = 0;
+	leaf.head = 0;
+	leaf.count = 0;
+	leaf.sequence = 0;
+}
+
+/**
+ * @brief Adds a packet to its leaf's ring (O(1), the caller does any locking).
+ * The leaf's epoch is used when its clock is valid, otherwise the time the gateway heard it. A packet with a sequence
+ * number that isn't newer is a repeat (dropped) unless the leaf has rebooted (its sequence starts again from 1).
+ * @return False if the packet was a repeat
+ */
+inline bool addFleetPacket(FleetLeaf& leaf, const FleetPacket& packet, uint32_t arrivalEpoch) {
+	bool isReboot = packet.sequence == 1 || packet.sequence + 100 < leaf.lastSequence;
+	if (leaf.received > 0 && packet.sequence <= leaf.lastSequence && isReboot == false) {
+		return false;
+	}
+	if (leaf.received > 0 && isReboot == false) {
+		leaf.missed += packet.sequence - leaf.lastSequence - 1;
+	}
+	leaf.lastSequence = packet.sequence;
+	leaf.received++;
+	leaf.lastHeard = arrivalEpoch;
+	leaf.lux = packet.lux;
+	leaf.status = packet.status;
+	memcpy(leaf.room, packet.room, FLEET_ROOM_CHARS);
+	leaf.room[FLEET_ROOM_CHARS] = '\0';
+
+	uint16_t index = leaf.head;
+	leaf.epoch[index] = (packet.status & sampleClockValid) ? packet.epoch : arrivalEpoch;
+	leaf.co2[index] = packet.co2;
+	leaf.humidity[index] = packet.humidity;
+	leaf.temperature[index] = packet.temperature;
+	leaf.head = (index + 1 < FLEET_RING_POINTS) ? (index + 1) : 0;
+	if (leaf.count < FLEET_RING_POINTS) {
+		leaf.count++;
+	}
+	leaf.sequence++;
+	return true;
+}
+
+// -----------------------------------------
+//
+//    Sample Processing
+//
+// -----------------------------------------
+
+// Converts a raw SCD4x temperature word to centi DegC (T = -45 + 175 * raw / 2^16 - 1, rounded)
+inline int16_t scd4xToCentiDegrees(uint16_t raw) {
+	return (int16_t)((17500 * (int32_t)raw + 32767) / 65535 - 4500);
+}
+
+// Converts a raw SCD4x humidity word to centi %RH (RH = 100 * raw / 2^16 - 1, rounded)
+inline int16_t scd4xToCentiPercent(uint16_t raw) {
+	return (int16_t)((10000 * (int32_t)raw + 32767) / 65535);
+}
+
+#define SAMPLE_FILTER_FRACTION_BITS 8  // Extra bits of precision kept by a SampleFilter (so repeated steps don't drift)
+
+/**
+ * @brief An integer exponential moving average (new = old + (input - old) / 2^shift).
+ * The state keeps SAMPLE_FILTER_FRACTION_BITS below the units of the input, and starts at the first input.
+ */
+struct SampleFilter {
+	int32_t state;	// filtered value << SAMPLE_FILTER_FRACTION_BITS
+	bool primed;	// has had its first input
+};
+
+// Adds an input to a SampleFilter and returns the filtered value (in the input's units, rounded)
+inline int32_t updateSampleFilter(SampleFilter& filter, int32_t input, uint8_t shift) {
+	int32_t scaledInput = input * (1 << SAMPLE_FILTER_FRACTION_BITS);
+	if (filter.primed) {
+		filter.state += (scaledInput - filter.state) / (1 << shift);
+	} else {
+		filter.state = scaledInput;
+		filter.primed = true;
+	}
+	int32_t half = 1 << (SAMPLE_FILTER_FRACTION_BITS - 1);
+	return (filter.state + ((filter.state < 0) ? -half : half)) / (1 << SAMPLE_FILTER_FRACTION_BITS);
+}
+
+// -----------------------------------------
+//
+//    Light Bar Position
+//
+// -----------------------------------------
+
+/**
+ * @brief Convert CO2 level in parts per million to a position integer for a light bar display.
+ * This function maps the input CO2 level to a position integer between 0 and LIGHTBAR_MAX_POSITION (each pixel has a position range of 0-255).
+ * The mapping is linear and is based on the CO2_MIN, CO2_MAX, and LIGHTBAR_MAX_POSITION constants.
+ * @param inputCO2 CO2 level in parts per million (integer math, a position above LIGHTBAR_MAX_POSITION is capped at UINT16_MAX).
+ * @return uint16_t The position integer for the light bar display.
+ */
+inline uint16_t mapCO2toPosition(int32_t inputCO2) {
+	if (inputCO2 > CO2_MIN) {
+		int32_t position = (inputCO2 - CO2_MIN) * (LIGHTBAR_MAX_POSITION) / (CO2_MAX - CO2_MIN);
+		return (uint16_t)std::min(position, (int32_t)UINT16_MAX);
+	} else {
+		return (uint16_t)0;
+	}
+}
+
+// Fades the brightness one step towards the target brightness, returns true if it changed.
+inline bool updateBrightness(uint8_t& brightness, const uint8_t& targetBrightness) {
+	if (brightness > targetBrightness) {
+		brightness--;
+		return true;
+	} else if (brightness < targetBrightness) {
+		brightness++;
+		return true;
+	}
+	return false;
+}
+
+// Moves the position of the lighting effect on the LED strip one step towards a target position, returns true if it changed.
+// Targets below LIGHTBAR_MIN_POSITION pin the bar to the minimum, targets at or past LIGHTBAR_MAX_POSITION leave it where it is (the red flash takes over).
+inline bool updatePosition(uint16_t& position, const uint16_t& targetPosition) {
+	uint16_t prevPosition = position;
+	if (targetPosition < LIGHTBAR_MIN_POSITION) {
+		position = LIGHTBAR_MIN_POSITION;
+	} else if (targetPosition < LIGHTBAR_MAX_POSITION) {  // if position is in valid range
+		if (position > targetPosition) {
+			position--;
+		} else if (position < targetPosition) {
+			position += (targetPosition - position) / 32;
+			position++;
+		}
+	}
+	return position != prevPosition;
+}
@@ -29,22 +29,33 @@
 // 		for Wifi, Webserver and DNS
 //
 // -----------------------------------------
-#include <ArduinoJson.h>
-#include <DNSServer.h>
+#include <AsyncUDP.h>
 #include <WiFi.h>
 #include <esp_wifi.h>
 
-#include "AsyncJson.h"
 #include "AsyncTCP.h"
 #include "ESPAsyncWebServer.h"
 
 // Onboard Flash Storage
 #include <LittleFS.h>
 
+// Light sleep and the access point button (LOW_POWER builds)
+#include <driver/gpio.h>
+#include <esp_sleep.h>
+
 // NTP and Timezone headers
 #include "sntp.h"
 #include "time.h"
 
+#if defined(FLEET_LEAF) || defined(FLEET_GATEWAY)
+#include <esp_now.h>
+#endif
+
+#ifdef EXPORT_URL
+#include <HTTPClient.h>
+#include <Preferences.h>
+#endif
+
 #ifdef OTA
 #include <ArduinoOTA.h>
 #include <ESPTelnet.h>
@@ -68,12 +79,38 @@ ESPTelnet telnet;
 // #define WIRE_SCL_PIN 22
 // #define WIRE1_SDA_PIN 33
 // #define WIRE1_SCL_PIN 32
+#define WIRE_FREQUENCY 400000	// SCD4x and PCF8563 both run at 400khz (fast mode)
+#define WIRE1_FREQUENCY 500000	// LTR303, tested to be 380khz irl (400khz per data sheet)
+#define I2C_QUEUE_LENGTH 8		// Jobs that can wait for each I2C bus
 
 // Define the data pin for the WS2812B LED light bar, the number of pixels,
-// and an offset to adjust the temperature reading
+// and the calibration offsets added to each sensor reading
 // #define PIXEL_DATA_PIN 16  // GPIO -> LEVEL SHIFT -> Pixel 1 Data In Pin
-#define PIXEL_COUNT 11	   // Number of Addressable Pixels to write data to (starts at pixel 1)
-#define TEMP_OFFSET 10.6	   // The enclosure runs a bit hot, so reduce this to get a more accurate ambient temperature
+#define PIXEL_COUNT 11				 // Number of Addressable Pixels to write data to (starts at pixel 1)
+#define TEMPERATURE_OFFSET -1060	 // Centi DegC, the enclosure runs a bit hot, so this brings it back to the ambient temperature (-10.6 DegC)
+#define HUMIDITY_OFFSET 0			 // Centi %RH
+#define CO2_OFFSET 0				 // PPM
+#define SMOOTHING_SHIFT 1			 // Temperature, humidity and the CO2 trend are smoothed by 1/2^SMOOTHING_SHIFT of each new reading
+
+// -----------------------------------------
+//
+//    CO2 Sensor Config
+//
+// -----------------------------------------
+
+// How the SCD4x measures (see startScd4x)
+enum scd4xModes {
+	scd4xPeriodic,		   // a measurement every 5 s (SCD40 and SCD41)
+	scd4xLowPowerPeriodic,  // a measurement every 30 s (SCD40 and SCD41)
+	scd4xSingleShot		   // one measurement every SCD4X_SINGLE_SHOT_INTERVAL, the sensor idles in between (SCD41 only)
+};
+#ifndef SCD4X_MODE
+#define SCD4X_MODE scd4xPeriodic  // Override with -D SCD4X_MODE=scd4xLowPowerPeriodic or scd4xSingleShot to save power
+#endif
+#define SCD4X_SINGLE_SHOT_INTERVAL 60000  // Milliseconds between single shot measurements
+#define SCD4X_READY_MARGIN 50			   // Milliseconds after a measurement is due before it is read (the sensor clock is only about 1% accurate)
+#define SCD4X_RETRY_TIME 100			   // Milliseconds before reading again when a measurement was not ready
+#define SCD4X_MAX_RETRIES 50			   // Reads in a row that can fail before the sensor is restarted in scd4xPeriodic mode
 
 // -----------------------------------------
 //
@@ -88,6 +125,8 @@ ESPTelnet telnet;
 #define CO2_MAX 2000		 // Top of the CO2 light bar (when it transitions to warning flash)
 #define CO2_MIN 400			 // Bottom of the light bar (baseline CO2 level)
 #define FRAME_TIME 30		 // Milliseconds between frames (30ms = ~33.3fps maximum)
+#define LUX_INTERVAL 1000	 // Milliseconds between light sensor readings
+#define BRIGHTNESS_STEP_TIME 120  // Milliseconds between brightness steps while fading to a new light level
 #define BRIGHTNESS_FACTOR 6	 // Lux/BRIGHTNESS_FACTOR = LED brightness
 #define MAX_BRIGHTNESS 200	 // Maximum brightness setting for the WS2812B LEDs
 enum lightBarModes {
@@ -101,6 +140,112 @@ enum lightBarModes {
 	off
 };
 
+// The commands the light bar task takes (see sendLightBarCommand)
+enum lightBarCommandTypes {
+	setTargetCommand,		   // value: target position, 0 - LIGHTBAR_MAX_POSITION (above that flashes red)
+	setModeCommand,			   // value: lightBarModes (lightBarScale, errorRed or off)
+	setBrightnessCapCommand,   // value: maximum brightness, 0 - MAX_BRIGHTNESS
+	playEffectCommand		   // value: lightBarModes of the effect (flashRed, purplePulse, greenPulse or rgbTest)
+};
+
+struct LightBarCommand {
+	lightBarCommandTypes type;
+	uint16_t value;
+};
+
+#define LIGHTBAR_COMMAND_QUEUE_LENGTH 8	 // Commands waiting for the next frame (targets and brightness caps only take one each)
+
+// -----------------------------------------
+//
+//    Task Plan
+//
+// -----------------------------------------
+
+// The WiFi stack and lwIP already run on core 0, so the network and flash tasks (and AsyncTCP, see platformio.ini)
+// are pinned there too. Core 1 is left to the sensors and the light bar, so a CSV download or a log flush can't
+// hold up a frame. Single core chips (ESP32-S2) pin everything to core 0 and only the priorities decide.
+#if CONFIG_FREERTOS_UNICORE
+#define NETWORK_CORE 0
+#define REALTIME_CORE 0
+#else
+#define NETWORK_CORE 0	 // PRO_CPU
+#define REALTIME_CORE 1	 // APP_CPU
+#endif
+
+#define LIGHTBAR_TASK_CORE REALTIME_CORE
+#define LIGHTBAR_TASK_PRIORITY 5		   // Highest of ours, a frame is well under a millisecond of work
+#define I2C_TASK_CORE REALTIME_CORE
+#define I2C_TASK_PRIORITY 4				   // Callers always wait for their jobs, so these only run when someone needs them
+#define SENSOR_TASK_CORE REALTIME_CORE
+#define SENSOR_TASK_PRIORITY 2
+#define JSON_TASK_CORE NETWORK_CORE		   // Feeds the sample ring and /events
+#define JSON_TASK_PRIORITY 1
+#define WEBSERVER_TASK_CORE NETWORK_CORE
+#define WEBSERVER_TASK_PRIORITY 1
+#define CSV_TASK_CORE NETWORK_CORE		   // Flash writes (the flash cache is shared by both cores, but the work stays here)
+#define CSV_TASK_PRIORITY 0
+#define EXPORTER_TASK_CORE NETWORK_CORE	   // Only in builds with EXPORT_URL
+#define EXPORTER_TASK_PRIORITY 0
+#define FLEET_TASK_CORE NETWORK_CORE	   // Only in FLEET_LEAF and FLEET_GATEWAY builds
+#define FLEET_TASK_PRIORITY 1
+
+// -----------------------------------------
+//
+//    Power Config
+//
+// -----------------------------------------
+
+// Build with -D LOW_POWER (see [env:lowPower]) for sites on a battery or a tight PoE budget. The access point only comes up
+// at boot, when the button is pressed or on a schedule, the SoC light sleeps between SCD4x measurements while the radio
+// is off and the light bar is idle, and the minute records wait in RTC memory to be written to LittleFS in batches.
+#if defined(LOW_POWER) && defined(OTA)
+#error "LOW_POWER stops the radio, it can't be built with OTA"
+#endif
+#ifndef ACCESS_POINT_BUTTON_PIN
+#define ACCESS_POINT_BUTTON_PIN 0		   // BOOT button (pulled up, low while pressed), brings the access point up
+#endif
+#define ACCESS_POINT_AWAKE_SECONDS 300	   // The access point stays up this long after it comes up (and while a station is connected)
+#define ACCESS_POINT_SCHEDULE_SECONDS 0	   // Seconds between scheduled access point windows (0 = only at boot and on the button)
+#define ACCESS_POINT_CHECK_INTERVAL 1000   // Milliseconds between checks of the access point window
+#define LIGHT_SLEEP_MIN_TIME 200		   // Milliseconds, shorter waits are spent awake
+#define LIGHT_SLEEP_SETTLE_TIME 50		   // Milliseconds the other tasks get to take a new sample before the SoC sleeps
+#define LOG_BATCH_RECORDS 60			   // Minute records held in RTC memory before they are written to LittleFS (1 hour)
+
+// Supply current of each power state (microamps at 3.3V, from the ESP32, SCD41 and WS2812B datasheets). /metrics multiplies
+// these by the time spent in each state, so the averages are estimates, check them against a meter on the bench.
+#define RADIO_ON_MICROAMPS 100000		   // CPU running, access point up (the receiver listens between beacons)
+#define AWAKE_MICROAMPS 40000			   // CPU running at 240MHz, radio stopped
+#define LIGHT_SLEEP_MICROAMPS 800		   // Light sleep (RTC timer and GPIO wake up)
+#define SCD4X_PERIODIC_MICROAMPS 15000	   // Average of scd4xPeriodic
+#define SCD4X_LOW_POWER_MICROAMPS 3200	   // Average of scd4xLowPowerPeriodic
+#define SCD4X_SINGLE_SHOT_MICROAMPS 1500   // Average of scd4xSingleShot (one shot every SCD4X_SINGLE_SHOT_INTERVAL)
+#define PIXEL_IDLE_MICROAMPS 600		   // Each WS2812B pixel while it is black
+#define PIXEL_CHANNEL_MICROAMPS 12000	   // Each colour of a pixel at full brightness (scaled by the channel value)
+
+// -----------------------------------------
+//
+//    Fleet Config
+//
+// -----------------------------------------
+
+// Build with -D FLEET_LEAF (see [env:fleetLeaf]) for a unit that broadcasts each sample over ESP-NOW and has no access point,
+// DNS responder or webserver, and with -D FLEET_GATEWAY (see [env:fleetGateway]) for the one unit that hears them and serves
+// every room (fleet.html, /fleet.json and /fleet/history). Both stay on WIFI_CHANNEL, so neither can be built with
+// OTA (the station would follow the router's channel) or LOW_POWER (the radio is stopped).
+#if defined(FLEET_LEAF) && defined(FLEET_GATEWAY)
+#error "A unit is either a fleet leaf or the fleet gateway"
+#endif
+#if (defined(FLEET_LEAF) || defined(FLEET_GATEWAY)) && (defined(OTA) || defined(LOW_POWER))
+#error "The fleet modes keep the radio on WIFI_CHANNEL, they can't be built with OTA or LOW_POWER"
+#endif
+#ifndef FLEET_ROOM
+#define FLEET_ROOM ""					   // Room name a leaf sends, e.g. -D FLEET_ROOM='"Kitchen"' (the gateway shows the MAC when blank)
+#endif
+#define FLEET_MAX_LEAVES 8				   // Leaves the gateway keeps (a new leaf takes the slot of the one heard from longest ago)
+#define FLEET_RING_POINTS 360			   // Samples kept for each leaf (30 min at 5s/sample, 3 hours at 30s/sample)
+#define FLEET_QUEUE_LENGTH 8			   // Packets that can wait for the fleet gateway task
+#define FLEET_STREAM_BATCH 16			   // Points copied out of a leaf's ring at a time by /fleet/history
+
 // -----------------------------------------
 //
 //    Webserver Settings
@@ -114,15 +259,36 @@ const char* password = "";								// Password of the WiFi access point (leave bl
 #define CSV_RECORD_INTERVAL_SECONDS 60					// Record interval (in seconds) for the CSV file
 #define JSON_RECORD_INTERVAL_SECONDS 1					// Record interval (in seconds) for the JSON file
 
-// Define the filename, maximum size, and location for the CSV log file,
+// Define the filename, maximum size, and location for the log file,
 // as well as the IP and URL for the web server
-char CSVLogFilename[] = "/Kea-CO2-Data.csv";			// Location of the CSV file
-#define MAX_CSV_SIZE_BYTES 2000000						// Maximum size of the CSV file (2 MB)
+#define LOG_DIRECTORY "/log"							// Location of the log segment files (fixed size binary records, rendered as CSV when downloaded)
+#define LOG_SEGMENT_SECONDS 86400						// Each segment file holds the records of one UTC day (1440 records at 1 minute/record)
+#define LOG_SEGMENT_MAX_BYTES (LOG_SEGMENT_SECONDS / CSV_RECORD_INTERVAL_SECONDS * 10)  // Size of a full segment (10 bytes/record)
+#define MAX_LOG_SIZE_BYTES 2000000						// The oldest segments are evicted past this (2 MB, ~138 days at 1 minute/record)
+#define MAX_LOG_SEGMENTS 160							// Maximum number of segments in the log index
+#define LOG_MIN_FREE_BYTES 65536						// The oldest segments are also evicted when the filesystem has less free space than this
+#define LOG_CLOCK_STEP_SECONDS 3600						// Clock steps back further than this evict the newer segments (they had the wrong time)
+#define LOG_FLUSH_MAX_SECONDS 3600						// Longest a record waits in RAM before it is written to flash (what a reset or power cut can lose)
+#define LOG_PATH_MAX_CHARS 24							// Maximum size of a log segment path (/log/65535.bin)
+char unsegmentedLogFilename[] = "/Kea-CO2-Data.bin";	// Location of the single log file of older firmware (moved into segments at boot)
+char legacyCSVFilename[] = "/Kea-CO2-Data.csv";			// Location of the plain text CSV file written by older firmware
+char oldCSVFilename[] = "/Kea-CO2-Data-old.csv";		// Where that file is moved to so it can still be downloaded
 #define CSV_LINE_MAX_CHARS 64							// Maximum size of the csvLine character buffer
+#define WIFI_CHANNEL 6									// Channel of the access point (and of ESP-NOW in the fleet modes)
 const IPAddress localIP(4, 3, 2, 1);					// IP address of the web server (Samsung requires the IP to be in public space)
 const IPAddress gatewayIP(4, 3, 2, 1);					// IP address of the network (should be the same as the local IP in most cases)
 const String localIPURL = "http://4.3.2.1/index.html";	// URL to the web server (same as the local IP, but as a string with http and the landing page subdomain)
 
+// Build with -D EXPORT_URL="http://collector/kea" to send the log to a collector over the station connection (see exporterTask)
+#if defined(EXPORT_URL) && !defined(OTA)
+#error "EXPORT_URL needs the station connection of OTA builds"
+#endif
+#define EXPORT_INTERVAL_SECONDS 900	   // Seconds between batches (the records of the last 15 minutes go in one request)
+#define EXPORT_BATCH_RECORDS 240	   // Most records in one request, a backlog after an outage is sent a batch at a time
+#define EXPORT_CATCH_UP_SECONDS 2	   // Seconds between the batches of a backlog
+#define EXPORT_RETRY_SECONDS 30		   // Seconds before a failed batch is sent again (doubling up to EXPORT_INTERVAL_SECONDS)
+#define EXPORT_TIMEOUT 10000		   // Milliseconds the collector has to answer
+
 // -----------------------------------------
 //
 //    Helpful Defines (Don't Touch)
@@ -132,8 +298,6 @@ const String localIPURL = "http://4.3.2.1/index.html";	// URL to the web server
 #define LIGHTBAR_MAX_POSITION PIXEL_COUNT * 255
 #define LIGHTBAR_MIN_POSITION 255
 #define LAST_PIXEL PIXEL_COUNT - 1				 // last Addressable Pixel to write data to (starts at pixel 0)
-#define low8Bits(w) ((uint8_t)((w)))			 // returns bits 1 - 8 of a 32bit variable
-#define high16Bits(w) ((uint16_t)((w) >> 16))	 // returns bits 17 - 32 of a 32bit variable
 
 // -----------------------------------------
 //
@@ -141,387 +305,3383 @@ const String localIPURL = "http://4.3.2.1/index.html";	// URL to the web server
 //
 // -----------------------------------------
 
-// Allocate the JSON document size in RAM https://arduinojson.org/v6/assistant to compute the size.
-DynamicJsonDocument jsonDataDocument(23520);  // The size of the JSON document in bytes (about 23KB).
-// This is used to store the data that will be sent to the web server.
+#define SAMPLE_RING_POINTS 2048  // The number of samples kept in RAM for the webserver graphs (~2.8 hours at 5s/sample, 10 bytes per sample).
+
+#include "KeaPipeline.h"  // The samples, sample ring, log records and rollups (pure logic, also built by [env:native], see bench/)
+#include "staticAssets.h"  // The manifest of the gzipped page bundle in data/ (generated by tools/asset_manifest.py)
+
+SampleRing sampleRing;	// This is used to store the data that will be sent to the web server.
 
-#define JSON_DATA_POINTS_MAX 128  // The maximum number of data points to store in the JSON document.
+uint8_t* staticAssetCache[STATIC_ASSET_COUNT];	// RAM copies of the small assets (NULL for those streamed from LittleFS)
+bool staticAssetMatches[STATIC_ASSET_COUNT];	// The file on LittleFS matches the manifest (so its ETag can be trusted)
+uint8_t* pageTemplate = NULL;					// RAM copy of index.html, filled in for every page load (see processPagePlaceholder)
+size_t pageTemplateSize = 0;
+
+AsyncEventSource events("/events");	 // Server-Sent Events endpoint that pushes each new sample to the open pages the moment it is stored.
 
 TaskHandle_t lightBar = NULL;		  // A handle to the task that controls the light bar.
 TaskHandle_t csvFileManager = NULL;	  // A handle to the task that writes sensor data to a CSV file.
 TaskHandle_t sensorManager = NULL;	  // A handle to the task that reads sensor data.
 TaskHandle_t webserver = NULL;		  // A handle to the task that runs the web server.
 TaskHandle_t jsonFileManager = NULL;  // A handle to the task that writes JSON data to a file.
+TaskHandle_t exporter = NULL;		  // A handle to the task that sends the log to the collector (EXPORT_URL builds).
+TaskHandle_t fleet = NULL;			  // A handle to the task that sends or receives the ESP-NOW samples (fleet builds).
+
+EventGroupHandle_t bootEvents;		// Set as each part of the staged boot becomes ready (see setup).
+#define FILESYSTEM_READY_BIT (1 << 0)  // LittleFS is mounted (by csvFileManagerTask)
+
+// The stages of the boot, in the order they normally happen (see recordBootStage)
+enum bootStages {
+	bootSetupStarted,
+	bootLightBarStarted,
+	bootSensorsStarted,
+	bootWifiStarted,
+	bootFilesystemMounted,
+	bootWebserverStarted,
+	bootFirstCo2Reading,
+	bootFirstCo2OnLightBar,	 // the target metric, how long until the bar shows the CO2 level
+	BOOT_STAGE_COUNT
+};
+const char* bootStageNames[BOOT_STAGE_COUNT] = {"setupStarted", "lightBarStarted", "sensorsStarted", "wifiStarted",
+												"filesystemMounted", "webserverStarted", "firstCo2Reading", "firstCo2OnLightBar"};
+
+// The routes with timed responses in /metrics
+enum metricRoutes {
+	dataJsonRoute,
+	dataBinRoute,
+	csvRoute,
+	historyRoute,
+	METRIC_ROUTE_COUNT
+};
 
-QueueHandle_t charsForCSVFileQueue;	 // A queue of character arrays which contain human readable sensor data.
-// This is used to communicate between the sensor manager and the CSV file manager tasks.
-
-QueueHandle_t jsonDataQueue;  // A queue of data points in doubles.
-// This is used to communicate between the sensor manager and the JSON file manager tasks.
+// Requests and the time spent filling the responses of one route
+struct RouteMetrics {
+	const char* path;
+	uint32_t requests;
+	uint32_t fills;			 // chunks filled
+	uint32_t bytes;			 // bytes sent
+	uint64_t fillMicros;	 // total time spent filling chunks
+	uint32_t maxFillMicros;	 // longest chunk
+};
 
-SemaphoreHandle_t jsonDocMutex;	 // A semaphore used to ensure that only one task accesses the JSON document at a time.
-// This is used to prevent race conditions where two tasks try to access the document at the same time.
+#define FRAME_HISTOGRAM_BUCKETS 7
+const uint32_t frameHistogramBounds[FRAME_HISTOGRAM_BUCKETS] = {250, 500, 1000, 2000, 5000, 10000, 30000};  // Upper bound of each bucket (microseconds)
+const uint32_t jitterHistogramBounds[FRAME_HISTOGRAM_BUCKETS] = {100, 250, 500, 1000, 2000, 5000, 10000};  // Upper bound of each bucket (microseconds)
 
 /**
- * @brief Rounds a double to a float with x decimal places
- * @param decimalPlaces The number of decimal places to round to
- * - 0: Returns the integer part of the value
- * - 1: Returns the value rounded to 1 decimal place
- * - 2: Returns the value rounded to 2 decimal places
- * - and so on...
- * @param value The input double to be rounded
- * @return A float rounded to the specified number of decimal places
+ * @brief Counters served by /metrics.
+ * Each counter has one task writing it (so no lock), except lightBarCommandDrops, which every task that sends the light bar
+ * a command can bump (so it is only added to with __atomic_fetch_add). /metrics may read a value that is a moment out of date,
+ * and the 64 bit totals can be read torn (half before and half after a write) as they take two 32 bit stores.
  */
-float roundToXDP(uint8_t decimalPlaces, double value) {	 // rounds a number to x decimal place
-	return (float)(((int)(value * (10 * decimalPlaces) + 0.5)) / (10 * decimalPlaces));
+struct Metrics {
+	RouteMetrics routes[METRIC_ROUTE_COUNT];
+	uint32_t jsonMissedSamples;		  // samples the jsonFileManager task never saw (the mailbox was overwritten first)
+	uint32_t csvMissedSamples;		  // samples the csvFileManager task never saw
+	uint32_t sampleRingBusyDrops;	  // samples not added to the sample ring because a stream held it
+	uint32_t lightBarCommandDrops;	  // mode and effect commands dropped because the queue was full of them
+	uint32_t logFlushes;			  // flushes of the newest log segment
+	uint64_t logFlushMicros;		  // total time spent flushing
+	uint32_t maxLogFlushMicros;		  // longest flush
+	uint32_t logBytesWritten;		  // record bytes written to the log segments
+	uint32_t logBytesProgrammed;	  // estimated bytes programmed for them (see estimateLogFlushCost)
+	uint32_t logSectorErases;		  // estimated sectors erased for them
+	uint32_t frameCount;			  // light bar frames drawn
+	uint64_t frameMicros;			  // total time spent drawing and showing frames
+	uint32_t frameHistogram[FRAME_HISTOGRAM_BUCKETS + 1];  // frames per time bucket (the last is everything slower)
+	uint32_t jitterCount;			  // frames that followed another frame (so their start could be compared to when it was due)
+	uint64_t jitterMicros;			  // total time frames started away from FRAME_TIME after the last one
+	uint32_t maxJitterMicros;		  // furthest a frame has started from when it was due
+	uint32_t jitterHistogram[FRAME_HISTOGRAM_BUCKETS + 1];	// frames per jitter bucket (the last is everything worse)
+	uint32_t assetsNotModified;		  // static asset requests answered with a 304 (the client's copy was current)
+	uint32_t assetsFromRam;			  // static assets sent from their RAM copy
+	uint32_t assetsFromFlash;		  // static assets streamed from LittleFS
+	uint32_t bootStageMicros[BOOT_STAGE_COUNT];	 // time since reset each boot stage was reached (0 = not yet)
+	uint64_t radioOnMicros;			  // time the access point was up before it last went down
+	int64_t radioOnSince;			  // esp_timer time the access point came up (0 while it is down)
+	uint32_t accessPointWindows;	  // times the access point came up
+	uint64_t lightSleepMicros;		  // time spent in light sleep
+	uint32_t lightSleeps;			  // light sleeps
+	uint32_t lightBarMicroamps;		  // estimated current of the pixels last shown (see recordLightBarCurrent)
+	int64_t lightBarMicroampsSince;	  // esp_timer time they were shown
+	uint64_t lightBarCharge;		  // microamp microseconds drawn by the pixels before that
+	uint8_t scd4xMode;				  // scd4xModes the SCD4x is measuring in
+	uint32_t exportBatches;			  // batches the collector accepted
+	uint32_t exportFailures;		  // batches that failed (sent again later)
+	uint32_t exportRecords;			  // records the collector accepted
+	uint32_t exportBytes;			  // bytes of the accepted batches
+	uint32_t exportCursor;			  // epoch of the newest record the collector has accepted
+	uint32_t fleetQueueDrops;		  // ESP-NOW packets dropped because the fleet gateway task's queue was full
+	uint32_t fleetRepeats;			  // ESP-NOW packets heard twice
+	uint32_t fleetSendErrors;		  // samples a leaf could not broadcast
+};
+
+Metrics metrics = {{{"/data.json"}, {"/data.bin"}, {"/Kea-CO2-Data.csv"}, {"/history"}}};
+
+// Records the time since reset a boot stage was first reached
+void recordBootStage(bootStages stage) {
+	if (metrics.bootStageMicros[stage] == 0) {
+		metrics.bootStageMicros[stage] = (uint32_t)esp_timer_get_time();
+	}
 }
 
-/**
- * @brief Initializes the jsonDataDocument with default state, which includes graph colors but no data points.
- * This function clears the jsonDataDocument and creates three nested objects representing CO2, humidity, and temperature graphs.
- * Each object includes a "name", "color", and "y_title" field. Additionally, each object has a nested array called "data"
- * which initially has no elements.
- * @note This function assumes that the jsonDataDocument has already been initialized elsewhere in the program.
- * @see jsonDataDocument
- */
-void initializeJson() {
-	xSemaphoreTake(jsonDocMutex, portMAX_DELAY);  // ask for control of json doc
+// -----------------------------------------
+//
+//    Tracing
+//
+// -----------------------------------------
+
+// TRACE(event, arg) records the time of an event in the hot paths (sensor -> light bar -> web) without the cost of formatting a log
+// line. Build with -D TRACE_ENABLED to turn it on (verboseDebug does), otherwise the macro compiles to nothing.
+#ifdef TRACE_ENABLED
+#define TRACE(event, arg) traceRecord(event, arg)
+#else
+#define TRACE(event, arg) ((void)0)
+#endif
+
+#ifdef TRACE_ENABLED
+#define TRACE_RING_ENTRIES 256	// Newest events kept per core (12 bytes each)
+
+enum traceEvents {
+	traceSensorRead,		// arg: CO2 (PPM)
+	traceSamplePublished,	// arg: sample sequence
+	traceLightBarCommand,	// arg: command type << 16 | value
+	traceFrameShown,		// arg: microseconds to draw and show the frame
+	traceRingAdded,			// arg: sample sequence
+	traceEventSent,			// arg: sample sequence
+	traceLogFlush,			// arg: microseconds the flush took
+	traceI2cJob,			// arg: bus << 24 | microseconds the job took
+	traceHttpFill,			// arg: route << 24 | bytes
+	TRACE_EVENT_COUNT
+};
 
-	jsonDataDocument.clear();
+const char* traceEventNames[TRACE_EVENT_COUNT] = {"sensorRead", "samplePublished", "lightBarCommand", "frameShown", "ringAdded", "eventSent", "logFlush", "i2cJob", "httpFill"};
 
-	JsonObject co2_graph_object = jsonDataDocument.createNestedObject();
-	co2_graph_object["name"] = "CO2";
-	co2_graph_object["color"] = "#70AE6E";
-	co2_graph_object["y_title"] = "CO2 Parts Per Million (PPM)";
-	JsonArray co2_graph_data_array = co2_graph_object["data"].createNestedArray();
+struct TraceEntry {
+	uint32_t micros;  // esp_timer time (wraps every ~71 minutes)
+	uint32_t arg;
+	uint8_t event;
+};
 
-	JsonObject humidity_graph_object = jsonDataDocument.createNestedObject();
-	humidity_graph_object["name"] = "Humidity";
-	humidity_graph_object["color"] = "#333745";
-	humidity_graph_object["y_title"] = "Relative humidity (%RH)";
-	JsonArray humidity_graph_data_array = humidity_graph_object["data"].createNestedArray();
+/**
+ * @brief The newest events recorded on one core.
+ * A slot is claimed with an atomic increment of count so recording never takes a lock, even if a task is preempted part way
+ * through. The reader takes no lock either, so an entry being written while it is dumped can come out mixed up.
+ */
+struct TraceRing {
+	TraceEntry entries[TRACE_RING_ENTRIES];
+	uint32_t count;	 // events ever recorded, the next one goes in entries[count % TRACE_RING_ENTRIES]
+};
 
-	JsonObject temperature_graph_object = jsonDataDocument.createNestedObject();
-	temperature_graph_object["name"] = "Temperature";
-	temperature_graph_object["color"] = "#FE5F55";
-	temperature_graph_object["y_title"] = "Temperature (Deg C)";
-	JsonArray temperature_graph_data_array = temperature_graph_object["data"].createNestedArray();
+TraceRing traceRings[portNUM_PROCESSORS];
 
-	xSemaphoreGive(jsonDocMutex);  // release control of json doc
+// Records an event in the ring of the core it happened on
+inline void traceRecord(traceEvents event, uint32_t arg) {
+	TraceRing& ring = traceRings[xPortGetCoreID()];
+	uint32_t slot = __atomic_fetch_add(&ring.count, 1, __ATOMIC_RELAXED) % TRACE_RING_ENTRIES;
+	TraceEntry entry = {(uint32_t)esp_timer_get_time(), arg, (uint8_t)event};
+	ring.entries[slot] = entry;
 }
 
 /**
- * @brief Convert CO2 level in parts per million to a position integer for a light bar display.
- * This function maps the input CO2 level to a position integer between 0 and LIGHTBAR_MAX_POSITION (each pixel has a position range of 0-255).
- * The mapping is linear and is based on the CO2_MIN, CO2_MAX, and LIGHTBAR_MAX_POSITION constants.
- * @param inputCO2 CO2 level in parts per million.
- * @return uint16_t The position integer for the light bar display.
+ * @brief Prints every recorded event, oldest first with the cores merged, as CSV lines of micros,core,event,arg.
+ * Works with anything that is a Print (Serial, an AsyncResponseStream, ...).
  */
-uint16_t mapCO2toPosition(double inputCO2) {
-	if (inputCO2 > CO2_MIN) {
-		return (uint16_t)((inputCO2 - CO2_MIN) * (LIGHTBAR_MAX_POSITION) / (CO2_MAX - CO2_MIN));
-	} else {
-		return (uint16_t)0;
+void printTrace(Print& output) {
+	uint32_t next[portNUM_PROCESSORS];	// the next entry of each ring to print
+	uint32_t end[portNUM_PROCESSORS];
+	for (uint8_t core = 0; core < portNUM_PROCESSORS; core++) {
+		end[core] = __atomic_load_n(&traceRings[core].count, __ATOMIC_RELAXED);
+		next[core] = (end[core] > TRACE_RING_ENTRIES) ? end[core] - TRACE_RING_ENTRIES : 0;
 	}
-}
-
-// Initializes the LED strip to black.
-void initializeLightBar(NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod>& lightBar) {
-	lightBar.Begin();
-	lightBar.Show();
-}
 
-// Reads the light sensor and adjusts the brightness of the LED strip based on the light level.
-bool updateBrightness(LTR303& lightSensor, uint8_t& brightness, uint8_t& targetBrightness) {
-	double lux;
-	if (lightSensor.getApproximateLux(lux)) {
-		if (lux < (BRIGHTNESS_FACTOR * MAX_BRIGHTNESS)) {
-			targetBrightness = (uint8_t)(lux / BRIGHTNESS_FACTOR);
-		} else {
-			targetBrightness = MAX_BRIGHTNESS;
+	output.print("micros,core,event,arg\n");
+	while (true) {
+		int8_t oldestCore = -1;
+		uint32_t oldestMicros = 0;
+		for (uint8_t core = 0; core < portNUM_PROCESSORS; core++) {
+			if (next[core] == end[core]) {
+				continue;
+			}
+			uint32_t micros = traceRings[core].entries[next[core] % TRACE_RING_ENTRIES].micros;
+			if (oldestCore < 0 || (int32_t)(micros - oldestMicros) < 0) {
+				oldestCore = core;
+				oldestMicros = micros;
+			}
 		}
-		if (brightness > targetBrightness) {
-			brightness--;
-			return true;
-		} else if (brightness < targetBrightness) {
-			brightness++;
-			return true;
+		if (oldestCore < 0) {
+			break;
 		}
-	}
-	return false;
-}
 
-// Updates the position of the lighting effect on the LED strip based on a target position.
-void updatePosition(uint16_t& position, const uint16_t& targetPosition) {
-	if (targetPosition < LIGHTBAR_MIN_POSITION) {
-		position = LIGHTBAR_MIN_POSITION;
-	} else if (targetPosition < LIGHTBAR_MAX_POSITION) {  // if position is in valid range
-		if (position > targetPosition) {
-			position--;
-		} else if (position < targetPosition) {
-			position += (targetPosition - position) / 32;
-			position++;
-		}
+		const TraceEntry& entry = traceRings[oldestCore].entries[next[oldestCore] % TRACE_RING_ENTRIES];
+		const char* name = (entry.event < TRACE_EVENT_COUNT) ? traceEventNames[entry.event] : "?";
+		output.printf("%u,%i,%s,%u\n", entry.micros, oldestCore, name, entry.arg);
+		next[oldestCore]++;
 	}
 }
+#endif
 
-// Updates the lighting effect on the LED strip.
-void updateLightBar(NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod>& lightBar, const uint16_t& position, const uint8_t& brightness) {
-	uint8_t redGreenMix = position / PIXEL_COUNT;	 // 0 - 255 version of position
-	uint16_t mixingPixel = position / 255;			 // which pixel is the position at
-	uint8_t mixingPixelBrightness = position % 255;	 // what is the local position of the pixel
+QueueHandle_t sampleMailbox;  // A single slot queue holding the newest Sample (written with xQueueOverwrite, read with xQueuePeek).
+// This is used to communicate between the sensor manager and every task that consumes samples.
 
-	mixingPixel = LAST_PIXEL - mixingPixel;	 // reverse direction of lightbar (0th pixel is the top)
+volatile uint16_t ambientLux = 0;	   // The newest light sensor reading (lux), written by the light bar task.
+volatile bool ambientLuxValid = false;  // The light sensor has given a reading
 
-	RgbColor baseColor = RgbColor(redGreenMix, 255 - redGreenMix, 0).Dim(brightness);  // brew base color -> Green at bottom, Red at top
+volatile bool accessPointOn = false;  // The radio is up with the access point (LOW_POWER builds stop it between windows)
+volatile bool lightBarIdle = false;	  // The light bar task is waiting for a command (no frame to draw and no I2C read in flight)
 
-	lightBar.SetPixelColor(mixingPixel - 1, RgbColor(0));						// set one pixel above the mixing pixel to black
-	lightBar.SetPixelColor(mixingPixel, baseColor.Dim(mixingPixelBrightness));	// set mixing pixel
+// Notification bits of the csvFileManager task
+enum csvFileManagerNotifications {
+	clearDataNotification = 1 << 0,	// remove all the logged data
+	newSampleNotification = 1 << 1,	// a new Sample is in the sampleMailbox
+	flushLogNotification = 1 << 2	// write the records waiting in RAM (and RTC memory in LOW_POWER builds) to flash
+};
 
-	if (mixingPixel < LAST_PIXEL) {
-		lightBar.ClearTo(baseColor, mixingPixel + 1, LAST_PIXEL);  // fill solid color to the bottom of the bar
-	}
+QueueHandle_t lightBarCommandQueue;	 // LightBarCommands for the light bar task, applied at the start of each frame
 
-	lightBar.Show();
-}
+// The newest value of a command type that only its latest value matters for (targets and brightness caps).
+// The queue holds at most one command of that type, which takes the slot's value when the light bar task gets to it.
+struct LightBarCommandSlot {
+	uint16_t value;
+	bool isQueued;	// a command of this type is waiting in the lightBarCommandQueue
+};
 
-// Handles the target position notification and sets the local target position.
-void handleTargetPositionNotification(uint16_t& targetPosition, uint32_t rawNotification, lightBarModes& lightBarMode) {
-	uint16_t rawPosition = high16Bits(rawNotification);
-	if (rawPosition != 0) {
-		targetPosition = rawPosition;
-	}
+LightBarCommandSlot lightBarTargetSlot = {0, false};
+LightBarCommandSlot lightBarBrightnessCapSlot = {0, false};
+portMUX_TYPE lightBarCommandSlotLock = portMUX_INITIALIZER_UNLOCKED;  // guards both slots (they are written from several tasks)
 
-	lightBarModes rawMode = static_cast<lightBarModes>(low8Bits(rawNotification));
+SemaphoreHandle_t sampleRingMutex;  // A semaphore used to ensure that only one task accesses the sample ring at a time.
+// This is used to prevent race conditions where two tasks try to access the ring at the same time.
 
-	if (rawMode != 0) {
-		lightBarMode = rawMode;
-	} else if (targetPosition > LIGHTBAR_MAX_POSITION) {
-		lightBarMode = flashRed;
-	}
-	// Serial.printf("%i, %i, %i\n\r", lightBarMode, rawMode, rawPosition);
-	return;
+// Everything in a data.json series object before the data points (name, color and y axis title)
+const char* const seriesJsonHeaders[SAMPLE_CHANNEL_COUNT] = {
+	"{\"name\":\"CO2\",\"color\":\"#70AE6E\",\"y_title\":\"CO2 Parts Per Million (PPM)\",\"data\":[",
+	"{\"name\":\"Humidity\",\"color\":\"#333745\",\"y_title\":\"Relative humidity (%RH)\",\"data\":[",
+	"{\"name\":\"Temperature\",\"color\":\"#FE5F55\",\"y_title\":\"Temperature (Deg C)\",\"data\":["
+};
+
+// Empties the sample ring (the memory itself is static so nothing is freed, head and sequence keep counting)
+void clearSampleRing() {
+	xSemaphoreTake(sampleRingMutex, portMAX_DELAY);	 // ask for control of the sample ring
+	sampleRing.count = 0;
+	xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
 }
 
 /**
- * @brief Controls addressable LED pixels and uses the I2C ambient light sensor.
- * This task controls an LED strip based on readings from an ambient light sensor, adjusting the brightness and position of a color gradient on the strip.
- * The gradient blends from green to red, and the position is set using xTaskNotify(). If the target position is above the maximum position, the strip flashes
- * red to indicate high CO2 levels. The code initializes the light strip and enters a loop that reads the light sensor, updates the position and brightness,
- * and shows the effect. There are also modes for testing and flashing a purple pulse.
- *
- * @param[in] parameter The task parameter (unused).
+ * @brief Writes one sample over the oldest slot of the sample ring (O(1), no allocation).
+ * @param sample The measurement to add
+ * @return True if the sample was added, false if the ring could not be locked
  */
-void lightBarTask(void* parameter) {
-	// Create the the lightbar object
-	NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod> lightBar(PIXEL_COUNT + 1, PIXEL_DATA_PIN);  // uses i2s silicon remapped to any pin to drive led data
+bool addSampleToRing(const Sample& sample) {
+	if (xSemaphoreTake(sampleRingMutex, 1000 / portTICK_PERIOD_MS) == pdFALSE) {  // ask for control of the sample ring
+		return false;
+	}
 
-	//double lux;	 // The measured illumination level in lux.
+	pushSampleToRing(sampleRing, sample);
+	xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
+	return true;
+}
 
-	uint8_t targetBrightness = MAX_BRIGHTNESS;	// The target brightness value for the light bar, ranging from 0 to 255.
-	uint8_t brightness = 255;					// The current brightness value for the light bar, ranging from 0 to 255.
+#define JSON_STREAM_BATCH 32  // Number of points copied out of the sample ring each time a data.json stream takes the lock
 
-	uint32_t rawNotification;							  // The raw position value for the light bar, filled from task notification
-	uint16_t targetPosition = LIGHTBAR_MAX_POSITION / 3;  // The target position value for the light bar, ranging from 0 to LIGHTBAR_MAX_POSITION.
-	uint16_t position = 0;								  // The current position value for the light bar, ranging from 0 to LIGHTBAR_MAX_POSITION.
-	lightBarModes lightBarMode = lightBarScale;
+enum jsonStreamStages {
+	streamOpen,
+	streamSeriesHeader,
+	streamPoints,
+	streamSeriesClose,
+	streamClose,
+	streamDone
+};
 
-	initializeLightBar(lightBar);
+enum streamTokenResults {
+	tokenReady,
+	tokenTryAgain,
+	tokenDone
+};
 
-	LTR303 lightSensor;
-	Wire1.begin(WIRE1_SDA_PIN, WIRE1_SCL_PIN, 500000);	// tested to be 380khz irl (400khz per data sheet)
+/**
+ * @brief The state of one data.json response being streamed out of the sample ring.
+ * The response is produced as a series of small text tokens ("[", a series header, one [epoch,value] point, ...).
+ * Each series copies its points out of the ring JSON_STREAM_BATCH at a time, so the lock is only held for
+ * a few microseconds at a time and heap use doesn't depend on the amount of history.
+ */
+struct SampleRingJsonStream {
+	uint32_t firstSequence;	 // Oldest sample in the snapshot
+	uint32_t endSequence;	 // One past the newest sample in the snapshot
+	uint32_t nextSequence;	 // Next sample of the current series to copy out of the ring
+	uint8_t channel;		 // Current series
+	jsonStreamStages stage;
+	bool isFirstPoint;
+	bool hasPrevValue;
+	int32_t prevValue;
+	bool hasStartValues;							 // False if the snapshot starts at the oldest sample in the ring
+	int32_t startValues[SAMPLE_CHANNEL_COUNT];		 // Graphed values of the sample just before the snapshot (used to skip unchanged points)
+	uint32_t newestEpoch;							 // Epoch of the newest sample in the ring when the snapshot was taken (0 if empty)
+
+	uint32_t batchEpoch[JSON_STREAM_BATCH];
+	int32_t batchValue[JSON_STREAM_BATCH];
+	uint8_t batchCount;
+	uint8_t batchIndex;
+
+	char token[128];
+	uint8_t tokenLength;
+	uint8_t tokenOffset;
+};
 
-#ifdef PRODUCTION_TEST
-	if (!lightSensor.isConnected(Wire1, &Serial)) {
-		lightBarMode = errorRed;
-	} else {
-		lightBarMode = rgbTest;
+/**
+ * @brief Takes a snapshot of which samples are in the ring and resets the stream to the start of data.json.
+ * @param sinceEpoch Only stream samples newer than this (0 streams everything in the ring).
+ * The newest samples are searched for from the newest end of the ring, so polling with a recent epoch only
+ * touches the few samples that are actually sent.
+ * @return False if the ring could not be locked within a few ms (the caller should report the server is busy)
+ */
+bool startSampleRingJsonStream(SampleRingJsonStream& stream, uint32_t sinceEpoch) {
+	if (xSemaphoreTake(sampleRingMutex, 10 / portTICK_PERIOD_MS) == pdFALSE) {  // ask for control of the sample ring
+		return false;
 	}
-#endif
-
-	lightSensor.begin(GAIN_48X, EXPOSURE_100ms, true, Wire1);
-
-	while (true) {
-		if (updateBrightness(lightSensor, brightness, targetBrightness) == true) {
-			if (lightBarMode == idleFrame) {
-				lightBarMode = lightBarScale;
-			}
+	uint32_t oldestSequence = sampleRing.sequence - sampleRing.count;
+	stream.endSequence = sampleRing.sequence;
+	stream.firstSequence = findFirstSequenceAfter(sampleRing, sinceEpoch);
+
+	stream.hasStartValues = stream.firstSequence > oldestSequence;
+	if (stream.hasStartValues) {
+		uint16_t index = sequenceToIndex(sampleRing, stream.firstSequence - 1);
+		for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+			stream.startValues[channel] = getGraphValue(sampleRing, static_cast<sampleChannels>(channel), index);
 		}
-		//Serial.println(brightness);
+	}
+	stream.newestEpoch = (sampleRing.count > 0) ? sampleRing.epoch[sequenceToIndex(sampleRing, sampleRing.sequence - 1)] : 0;
+	xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
 
-		for (uint8_t i = 0; i < 4; i++) {	// get light reading every 4 frames
-			if (xTaskNotifyWait(0, 0xFFFF, &rawNotification, 0) == pdTRUE) {
-				handleTargetPositionNotification(targetPosition, rawNotification, lightBarMode);
-			}
+	stream.stage = streamOpen;
+	stream.channel = 0;
+	stream.tokenLength = 0;
+	stream.tokenOffset = 0;
+	return true;
+}
 
-			switch (lightBarMode) {
-			case idleFrame:
-				if (position != targetPosition) {
-					lightBarMode = lightBarScale;
-				}
-				vTaskDelay(pdMS_TO_TICKS(FRAME_TIME));  // time between frames
-				break;
+/**
+ * @brief Copies the next batch of points of the current series out of the sample ring.
+ * Samples that have been overwritten (or cleared) since the snapshot was taken are skipped.
+ * @return False if the ring is busy
+ */
+bool copySampleRingBatch(SampleRingJsonStream& stream) {
+	if (xSemaphoreTake(sampleRingMutex, 0) == pdFALSE) {  // ask for control of the sample ring
+		return false;
+	}
 
-			case lightBarScale:
-				updatePosition(position, targetPosition);
-				updateLightBar(lightBar, position, brightness);
-				if (position == targetPosition) {
-					lightBarMode = idleFrame;
-				}
-				vTaskDelay(pdMS_TO_TICKS(FRAME_TIME));  // time between frames
-				break;
+	uint32_t oldestSequence = sampleRing.sequence - sampleRing.count;
+	if (stream.nextSequence < oldestSequence) {
+		stream.nextSequence = oldestSequence;
+	}
 
-			case flashRed:
-				lightBar.ClearTo(RgbColor(0));
-				lightBar.Show();
-				vTaskDelay(500 / portTICK_PERIOD_MS);
+	stream.batchCount = 0;
+	stream.batchIndex = 0;
+	while (stream.batchCount < JSON_STREAM_BATCH && stream.nextSequence < stream.endSequence) {
+		uint16_t index = sequenceToIndex(sampleRing, stream.nextSequence);
+		stream.batchEpoch[stream.batchCount] = sampleRing.epoch[index];
+		stream.batchValue[stream.batchCount] = getGraphValue(sampleRing, static_cast<sampleChannels>(stream.channel), index);
+		stream.batchCount++;
+		stream.nextSequence++;
+	}
 
-				lightBar.ClearTo(RgbColor(255, 0, 0));
-				lightBar.Show();
-				vTaskDelay(500 / portTICK_PERIOD_MS);
+	xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
+	return true;
+}
 
-				if (targetPosition < LIGHTBAR_MAX_POSITION) {
-					lightBarMode = lightBarScale;
-					position = LIGHTBAR_MAX_POSITION;
-					brightness = MAX_BRIGHTNESS;
+/**
+ * @brief Produces the next text token of data.json into stream.token.
+ * Points are written oldest to newest. A point is only written when the graphed value changes, which keeps
+ * the file small when the air is stable.
+ */
+streamTokenResults nextSampleRingJsonToken(SampleRingJsonStream& stream) {
+	stream.tokenOffset = 0;
+	stream.tokenLength = 0;
+
+	while (stream.tokenLength == 0) {
+		switch (stream.stage) {
+		case streamOpen:
+			stream.tokenLength = sprintf(stream.token, "[");
+			stream.stage = streamSeriesHeader;
+			break;
+
+		case streamSeriesHeader:
+			stream.tokenLength = sprintf(stream.token, "%s", seriesJsonHeaders[stream.channel]);
+			stream.nextSequence = stream.firstSequence;
+			stream.isFirstPoint = true;
+			stream.hasPrevValue = stream.hasStartValues;
+			stream.prevValue = stream.startValues[stream.channel];
+			stream.batchCount = 0;
+			stream.batchIndex = 0;
+			stream.stage = streamPoints;
+			break;
+
+		case streamPoints:
+			if (stream.batchIndex == stream.batchCount) {
+				if (stream.nextSequence >= stream.endSequence) {
+					stream.stage = streamSeriesClose;
+					break;
 				}
-				break;
-
-			case purplePulse:
-				for (size_t i = 0; i < MAX_BRIGHTNESS; i += 2) {
-					lightBar.ClearTo(RgbColor(i, 0, i));
-					lightBar.Show();
-					vTaskDelay(pdMS_TO_TICKS(FRAME_TIME));  // time between frames
+				if (copySampleRingBatch(stream) == false) {
+					return tokenTryAgain;
 				}
-				lightBar.ClearTo(RgbColor(0));
-				lightBar.Show();
-				lightBarMode = lightBarScale;
-				break;
-
-			case greenPulse:
-				for (size_t i = 0; i < MAX_BRIGHTNESS; i += 2) {
-					lightBar.ClearTo(RgbColor(0, i, 0));
-					lightBar.Show();
-					vTaskDelay(pdMS_TO_TICKS(FRAME_TIME));  // time between frames
+				if (stream.batchCount == 0) {
+					stream.stage = streamSeriesClose;
+					break;
 				}
-				lightBar.ClearTo(RgbColor(0));
-				lightBar.Show();
-				lightBarMode = lightBarScale;
-				break;
+			}
 
-			case rgbTest:  // Flash all pixels red, green, blue to test wiring and config is correct
-				lightBar.ClearTo(RgbColor(255, 0, 0));
-				lightBar.Show();
-				vTaskDelay(1000 / portTICK_PERIOD_MS);
-				lightBar.ClearTo(RgbColor(0, 255, 0));
-				lightBar.Show();
-				vTaskDelay(1000 / portTICK_PERIOD_MS);
-				lightBar.ClearTo(RgbColor(0, 0, 255));
-				lightBar.Show();
-				vTaskDelay(1000 / portTICK_PERIOD_MS);
-				lightBar.ClearTo(RgbColor(0, 0, 0));
-				lightBar.Show();
-				lightBarMode = lightBarScale;
-				break;
+			{
+				uint32_t epoch = stream.batchEpoch[stream.batchIndex];
+				int32_t value = stream.batchValue[stream.batchIndex];
+				stream.batchIndex++;
 
-			case errorRed:
-				lightBar.ClearTo(RgbColor(MAX_BRIGHTNESS, 0, 0));
-				lightBar.Show();
-				vTaskSuspend(NULL);
-				break;
+				if (stream.hasPrevValue == false || value != stream.prevValue) {
+					stream.tokenLength = formatGraphPoint(stream.token, static_cast<sampleChannels>(stream.channel), epoch, value, stream.isFirstPoint);
+					stream.isFirstPoint = false;
+					stream.hasPrevValue = true;
+					stream.prevValue = value;
+				}
+			}
+			break;
+
+		case streamSeriesClose:
+			stream.channel++;
+			if (stream.channel < SAMPLE_CHANNEL_COUNT) {
+				stream.tokenLength = sprintf(stream.token, "]},");
+				stream.stage = streamSeriesHeader;
+			} else {
+				stream.tokenLength = sprintf(stream.token, "]}");
+				stream.stage = streamClose;
+			}
+			break;
 
-			case off:
-				lightBar.ClearTo(RgbColor(0));
-				lightBar.Show();
-				vTaskSuspend(NULL);
-				break;
+		case streamClose:
+			stream.tokenLength = sprintf(stream.token, "]");
+			stream.stage = streamDone;
+			break;
 
-			default:
+		default:
+			return tokenDone;
+		}
+	}
+	return tokenReady;
+}
+
+/**
+ * @brief Fills one chunk of a data.json response (AwsResponseFiller for beginChunkedResponse).
+ * @return The number of bytes written, 0 when the response is complete or RESPONSE_TRY_AGAIN if the ring is busy
+ */
+size_t fillSampleRingJson(SampleRingJsonStream& stream, uint8_t* buffer, size_t maxLen) {
+	size_t bytesWritten = 0;
+
+	while (bytesWritten < maxLen) {
+		if (stream.tokenOffset == stream.tokenLength) {
+			streamTokenResults result = nextSampleRingJsonToken(stream);
+			if (result == tokenTryAgain && bytesWritten == 0) {
+				return RESPONSE_TRY_AGAIN;
+			} else if (result != tokenReady) {
 				break;
 			}
 		}
+
+		size_t length = min((size_t)(stream.tokenLength - stream.tokenOffset), maxLen - bytesWritten);
+		memcpy(buffer + bytesWritten, stream.token + stream.tokenOffset, length);
+		stream.tokenOffset += length;
+		bytesWritten += length;
 	}
+	return bytesWritten;
 }
 
-// Callback function (get's called when time adjusts via NTP)
-void onTimeAvailable(struct timeval* t) {
-	vTaskResume(lightBar);
-	xTaskNotify(lightBar, greenPulse, eSetValueWithOverwrite);
-#ifndef OTA
-	WiFi.disconnect();
-#endif
+/**
+ * @brief Pushes the newest sample in the ring to every page listening on /events.
+ * The event is named "sample", its id is the sample's sequence number and its data is a compact
+ * [epoch,CO2,humidity,temperature] array of graphed values (e.g. [1679961858,1197,50,21.3]).
+ */
+void broadcastNewestSample() {
+	if (events.count() == 0) {
+		return;	 // nobody is listening
+	}
 
-	time_t epoch;
-	struct tm gmt;
-	time(&epoch);
-	gmtime_r(&epoch, &gmt);
-	Serial.println(&gmt, "\n\rGMT Time Set: %A, %B %d %Y %H:%M:%S\n\r");
+	char message[64];
+	uint32_t sequence;
+
+	if (xSemaphoreTake(sampleRingMutex, 10 / portTICK_PERIOD_MS) == pdFALSE) {  // ask for control of the sample ring
+		return;	 // pages catch up from data.json when they reconnect
+	}
+	if (sampleRing.count == 0) {
+		xSemaphoreGive(sampleRingMutex);
+		return;
+	}
+	sequence = sampleRing.sequence - 1;
+	uint16_t index = sequenceToIndex(sampleRing, sequence);
+	int length = sprintf(message, "[%u", sampleRing.epoch[index]);
+	for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+		length += sprintf(message + length, ",");
+		length += formatGraphValue(message + length, static_cast<sampleChannels>(channel), getGraphValue(sampleRing, static_cast<sampleChannels>(channel), index));
+	}
+	sprintf(message + length, "]");
+	xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
+
+	events.send(message, "sample", sequence);
+	TRACE(traceEventSent, sequence);
 }
 
-void initializeNTPClient() {
-	// Define the NTP servers to be used for time synchronization
-	const char* ntpServer1 = "pool.ntp.org";
-	const char* ntpServer2 = "time.nist.gov";
-	const char* ntpServer3 = "time.google.com";
+#define BINARY_STREAM_MAGIC 0x3141454B	// "KEA1" (little endian)
+#define BINARY_STREAM_MARGIN 64			// When the ring is full, data.bin leaves out this many of the oldest samples so they can't be overwritten mid-transfer (~5 min at 5s/sample)
 
-	sntp_set_time_sync_notification_cb(onTimeAvailable);
+enum binaryStreamStages {
+	binaryHeader,
+	binaryValues,
+	binaryEpochs,
+	binaryDone
+};
 
-	configTzTime(time_zone, ntpServer1, ntpServer2, ntpServer3);
-}
+/**
+ * @brief The state of one data.bin response being streamed out of the sample ring.
+ *
+ * data.bin is the compact (binary, little endian) form of the sample ring:
+ * - Header: uint32 magic "KEA1", uint16 sample count, uint8 channel count, uint8 reserved, uint32 epoch of the oldest sample
+ * - One descriptor byte per channel: bit 7 set if the values are signed, bits 0-6 the number of decimal places
+ * - For each channel, every value as a 16 bit integer (oldest to newest)
+ * - The epoch of every sample after the first as the zigzag varint of its difference to the previous epoch (usually 1 byte)
+ *
+ * The sample count is fixed in the header, so a sample that is overwritten or cleared mid-transfer ends the response early
+ * (the page sees a short file and asks again).
+ */
+struct SampleRingBinaryStream {
+	uint32_t firstSequence;	 // Oldest sample in the snapshot
+	uint32_t endSequence;	 // One past the newest sample in the snapshot
+	uint32_t nextSequence;	 // Next sample of the current section to copy out of the ring
+	uint32_t prevEpoch;
+	uint8_t channel;		 // Current channel of the values section
+	binaryStreamStages stage;
+
+	uint8_t token[192];
+	uint8_t tokenLength;
+	uint8_t tokenOffset;
+};
 
-void setUpDNSServer(DNSServer& dnsServer, const IPAddress& localIP) {
-	// Define the DNS interval in milliseconds between processing DNS requests
-#define DNS_INTERVAL 10
+// Channel descriptors for data.bin (CO2 is unsigned PPM, humidity and temperature are signed centi-units)
+const uint8_t binaryChannelDescriptors[SAMPLE_CHANNEL_COUNT] = { 0, 0x80 | 2, 0x80 | 2 };
 
-	// Set the TTL for DNS response and start the DNS server
-	dnsServer.setTTL(3600);
-	dnsServer.start(53, "*", localIP);
-}
+// Takes a snapshot of which samples are in the ring and resets the stream to the start of data.bin.
+// @return False if the ring could not be locked within a few ms
+bool startSampleRingBinaryStream(SampleRingBinaryStream& stream, uint32_t sinceEpoch) {
+	if (xSemaphoreTake(sampleRingMutex, 10 / portTICK_PERIOD_MS) == pdFALSE) {  // ask for control of the sample ring
+		return false;
+	}
+	stream.endSequence = sampleRing.sequence;
+	stream.firstSequence = findFirstSequenceAfter(sampleRing, sinceEpoch);
+	if (sampleRing.count == SAMPLE_RING_POINTS && stream.endSequence - stream.firstSequence > SAMPLE_RING_POINTS - BINARY_STREAM_MARGIN) {
+		stream.firstSequence = stream.endSequence - (SAMPLE_RING_POINTS - BINARY_STREAM_MARGIN);
+	}
+	stream.prevEpoch = (stream.firstSequence < stream.endSequence) ? sampleRing.epoch[sequenceToIndex(sampleRing, stream.firstSequence)] : 0;
+	xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
 
-void onClientConnected(WiFiEvent_t event) {
-	uint32_t notification = static_cast<uint8_t>(purplePulse);
-	xTaskNotify(lightBar, static_cast<uint8_t>(purplePulse), eSetValueWithOverwrite);
-	return;
+	stream.stage = binaryHeader;
+	stream.tokenLength = 0;
+	stream.tokenOffset = 0;
+	return true;
 }
 
-void startSoftAccessPoint(const char* password, const IPAddress& localIP, const IPAddress& gatewayIP) {
-	// Define the maximum number of clients that can connect to the server
-	const uint8_t MAX_CLIENTS = 4;
+/**
+ * @brief Produces the next block of data.bin into stream.token, copying up to 32 samples out of the ring at a time.
+ */
+streamTokenResults nextSampleRingBinaryToken(SampleRingBinaryStream& stream) {
+	stream.tokenOffset = 0;
+	stream.tokenLength = 0;
+	uint8_t* token = stream.token;
+
+	while (stream.tokenLength == 0) {
+		switch (stream.stage) {
+		case binaryHeader: {
+			uint32_t magic = BINARY_STREAM_MAGIC;
+			uint16_t count = stream.endSequence - stream.firstSequence;
+			memcpy(token, &magic, 4);
+			memcpy(token + 4, &count, 2);
+			token[6] = SAMPLE_CHANNEL_COUNT;
+			token[7] = 0;
+			memcpy(token + 8, &stream.prevEpoch, 4);
+			memcpy(token + 12, binaryChannelDescriptors, SAMPLE_CHANNEL_COUNT);
+			stream.tokenLength = 12 + SAMPLE_CHANNEL_COUNT;
+
+			stream.channel = 0;
+			stream.nextSequence = stream.firstSequence;
+			stream.stage = binaryValues;
+			break;
+		}
 
-	// Define the WiFi channel to be used (channel 6 in this case)
-	const uint8_t WIFI_CHANNEL = 6;
+		case binaryValues:
+		case binaryEpochs:
+			if (stream.nextSequence >= stream.endSequence) {
+				if (stream.stage == binaryValues && ++stream.channel < SAMPLE_CHANNEL_COUNT) {
+					stream.nextSequence = stream.firstSequence;
+				} else if (stream.stage == binaryValues) {
+					stream.nextSequence = stream.firstSequence + 1;	 // the first epoch is in the header
+					stream.stage = binaryEpochs;
+				} else {
+					stream.stage = binaryDone;
+				}
+				break;
+			}
 
-	// Set the WiFi mode to access point and station
-	WiFi.mode(WIFI_MODE_APSTA);
+			if (xSemaphoreTake(sampleRingMutex, 0) == pdFALSE) {  // ask for control of the sample ring
+				return tokenTryAgain;
+			}
+			if (stream.nextSequence < sampleRing.sequence - sampleRing.count) {
+				xSemaphoreGive(sampleRingMutex);
+				ESP_LOGW("", "data.bin sample overwritten mid-transfer, ending response early");
+				return tokenDone;
+			}
+			for (uint8_t i = 0; i < 32 && stream.nextSequence < stream.endSequence; i++) {
+				uint16_t index = sequenceToIndex(sampleRing, stream.nextSequence++);
+				if (stream.stage == binaryValues) {
+					int16_t value = (stream.channel == co2Channel) ? (int16_t)sampleRing.co2[index] : (stream.channel == humidityChannel) ? sampleRing.humidity[index] : sampleRing.temperature[index];
+					memcpy(token + stream.tokenLength, &value, 2);
+					stream.tokenLength += 2;
+				} else {
+					int32_t delta = (int32_t)(sampleRing.epoch[index] - stream.prevEpoch);
+					uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+					stream.prevEpoch = sampleRing.epoch[index];
+					do {
+						token[stream.tokenLength++] = (zigzag & 0x7F) | ((zigzag > 0x7F) ? 0x80 : 0);
+						zigzag >>= 7;
+					} while (zigzag > 0);
+				}
+			}
+			xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
+			break;
 
-	// Define the subnet mask for the WiFi network
-	const IPAddress subnetMask(255, 255, 255, 0);
+		default:
+			return tokenDone;
+		}
+	}
+	return tokenReady;
+}
 
-	// Configure the soft access point with a specific IP and subnet mask
-	WiFi.softAPConfig(localIP, gatewayIP, subnetMask);
+// Fills one chunk of a data.bin response (AwsResponseFiller for beginChunkedResponse)
+size_t fillSampleRingBinary(SampleRingBinaryStream& stream, uint8_t* buffer, size_t maxLen) {
+	size_t bytesWritten = 0;
 
-	// Generate a unique SSID based on the ESP32's MAC address
-	char uniqueSSID[18] = { 0 };
-	uint8_t mac[6];
+	while (bytesWritten < maxLen) {
+		if (stream.tokenOffset == stream.tokenLength) {
+			streamTokenResults result = nextSampleRingBinaryToken(stream);
+			if (result == tokenTryAgain && bytesWritten == 0) {
+				return RESPONSE_TRY_AGAIN;
+			} else if (result != tokenReady) {
+				break;
+			}
+		}
+
+		size_t length = min((size_t)(stream.tokenLength - stream.tokenOffset), maxLen - bytesWritten);
+		memcpy(buffer + bytesWritten, stream.token + stream.tokenOffset, length);
+		stream.tokenOffset += length;
+		bytesWritten += length;
+	}
+	return bytesWritten;
+}
+
+// -----------------------------------------
+//
+//    Flash Log
+//
+// -----------------------------------------
+
+/**
+ * @brief One file of the log, holding the records of one LOG_SEGMENT_SECONDS period (a UTC day).
+ * Segments are named after their period number (LOG_DIRECTORY/<epoch / LOG_SEGMENT_SECONDS>.bin), and records
+ * are always appended in epoch order, so the whole log is sorted by time from the oldest segment to the newest.
+ */
+struct LogSegment {
+	uint32_t firstEpoch;  // Epoch of the first record in the segment
+	uint32_t lastEpoch;	  // Epoch of the last record in the segment
+	uint32_t recordCount;
+	uint16_t period;	  // firstEpoch / LOG_SEGMENT_SECONDS (also the file name)
+};
+
+/**
+ * @brief The in RAM index of the segments in LOG_DIRECTORY, oldest first.
+ * Built from the directory at boot and only changed by the csvFileManagerTask (under logIndexMutex).
+ */
+struct LogIndex {
+	LogSegment segments[MAX_LOG_SEGMENTS];
+	uint16_t count;
+	uint32_t totalBytes;  // Sum of the size of all segments
+};
+
+LogIndex logIndex;
+
+SemaphoreHandle_t logIndexMutex;  // A semaphore used to ensure the log index isn't changed while a webserver task is reading it.
+
+// Writes the file name of the segment holding period into path (at least LOG_PATH_MAX_CHARS long)
+void logSegmentPath(char* path, uint16_t period) {
+	snprintf(path, LOG_PATH_MAX_CHARS, LOG_DIRECTORY "/%u.bin", period);
+}
+
+// Reads record n of an open segment file, returns false if it isn't there
+bool readLogRecord(File& file, uint32_t n, LogRecord& record) {
+	if (file.seek(n * sizeof(LogRecord)) == false) {
+		return false;
+	}
+	return file.read((uint8_t*)&record, sizeof(record)) == sizeof(record);
+}
+
+/**
+ * @brief Drops a partly written record (power loss mid-write) from the end of a segment.
+ * Otherwise every record appended after it would be shifted. Segments are small, so the whole
+ * records are just copied into a new file which replaces the old one.
+ * @return The size of the segment after the repair.
+ */
+size_t repairLogSegment(const char* path, size_t size) {
+	char tempPath[LOG_PATH_MAX_CHARS + 4];
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+	size_t wholeBytes = size - (size % sizeof(LogRecord));
+
+	File source = LittleFS.open(path, FILE_READ);
+	File destination = LittleFS.open(tempPath, FILE_WRITE);
+	if (!source || !destination) {
+		ESP_LOGE("", "Unable to repair %s", path);
+		return size;
+	}
+
+	uint8_t buffer[256];
+	size_t bytesCopied = 0;
+	while (bytesCopied < wholeBytes) {
+		size_t length = source.read(buffer, min(sizeof(buffer), wholeBytes - bytesCopied));
+		if (length == 0 || destination.write(buffer, length) != length) {
+			break;
+		}
+		bytesCopied += length;
+	}
+	source.close();
+	destination.close();
+
+	if (bytesCopied != wholeBytes) {
+		ESP_LOGE("", "Unable to repair %s", path);
+		LittleFS.remove(tempPath);
+		return size;
+	}
+
+	LittleFS.remove(path);
+	LittleFS.rename(tempPath, path);
+	ESP_LOGW("", "%s had a partial record at the end, removed it", path);
+	return wholeBytes;
+}
+
+/**
+ * @brief Adds one segment file to the index (keeping it sorted oldest first).
+ * Empty or unreadable segments are removed instead.
+ */
+void indexLogSegment(uint16_t period) {
+	char path[LOG_PATH_MAX_CHARS];
+	logSegmentPath(path, period);
+
+	File file = LittleFS.open(path, FILE_READ);
+	if (!file) {
+		return;
+	}
+	size_t size = file.size();
+	if (size % sizeof(LogRecord) != 0) {
+		file.close();
+		size = repairLogSegment(path, size);
+		file = LittleFS.open(path, FILE_READ);
+	}
+
+	LogSegment segment;
+	segment.period = period;
+	segment.recordCount = size / sizeof(LogRecord);
+
+	LogRecord first, last;
+	if (segment.recordCount == 0 || logIndex.count == MAX_LOG_SEGMENTS ||
+		readLogRecord(file, 0, first) == false || readLogRecord(file, segment.recordCount - 1, last) == false) {
+		file.close();
+		LittleFS.remove(path);
+		return;
+	}
+	file.close();
+	segment.firstEpoch = first.epoch;
+	segment.lastEpoch = last.epoch;
+
+	uint16_t i = logIndex.count;
+	while (i > 0 && logIndex.segments[i - 1].period > period) {
+		logIndex.segments[i] = logIndex.segments[i - 1];
+		i--;
+	}
+	logIndex.segments[i] = segment;
+	logIndex.count++;
+	logIndex.totalBytes += segment.recordCount * sizeof(LogRecord);
+}
+
+// Builds the log index from the segment files in LOG_DIRECTORY
+void loadLogIndex() {
+	logIndex.count = 0;
+	logIndex.totalBytes = 0;
+
+	if (LittleFS.exists(LOG_DIRECTORY) == false) {
+		LittleFS.mkdir(LOG_DIRECTORY);
+	}
+
+	// collect the names first, indexLogSegment might remove or replace files while we walk the directory
+	uint16_t periods[MAX_LOG_SEGMENTS];
+	uint16_t periodCount = 0;
+	File directory = LittleFS.open(LOG_DIRECTORY);
+	File file = directory.openNextFile();
+	while (file) {
+		char* end;
+		unsigned long period = strtoul(file.name(), &end, 10);
+		bool isSegment = (strcmp(end, ".bin") == 0 && period <= UINT16_MAX);
+		file.close();
+		if (isSegment && periodCount < MAX_LOG_SEGMENTS) {
+			periods[periodCount++] = period;
+		}
+		file = directory.openNextFile();
+	}
+	directory.close();
+
+	for (uint16_t i = 0; i < periodCount; i++) {
+		indexLogSegment(periods[i]);
+	}
+	ESP_LOGI("", "Log has %u segments (%u bytes)", logIndex.count, logIndex.totalBytes);
+}
+
+// Removes the oldest segment of the log (O(1), no other segment is touched)
+void evictOldestLogSegment() {
+	if (logIndex.count == 0) {
+		return;
+	}
+	char path[LOG_PATH_MAX_CHARS];
+	logSegmentPath(path, logIndex.segments[0].period);
+
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	logIndex.totalBytes -= logIndex.segments[0].recordCount * sizeof(LogRecord);
+	memmove(&logIndex.segments[0], &logIndex.segments[1], (logIndex.count - 1) * sizeof(LogSegment));
+	logIndex.count--;
+	xSemaphoreGive(logIndexMutex);
+
+	LittleFS.remove(path);
+	ESP_LOGI("", "Evicted %s", path);
+}
+
+// Removes the newest segment of the log
+void evictNewestLogSegment() {
+	if (logIndex.count == 0) {
+		return;
+	}
+	char path[LOG_PATH_MAX_CHARS];
+	logSegmentPath(path, logIndex.segments[logIndex.count - 1].period);
+
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	logIndex.count--;
+	logIndex.totalBytes -= logIndex.segments[logIndex.count].recordCount * sizeof(LogRecord);
+	xSemaphoreGive(logIndexMutex);
+
+	LittleFS.remove(path);
+	ESP_LOGI("", "Evicted %s", path);
+}
+
+// Removes every segment of the log
+void clearLog() {
+	while (logIndex.count > 0) {
+		evictOldestLogSegment();
+	}
+}
+
+// Gets the newest epoch in the log (0 when it is empty)
+uint32_t newestLogEpoch() {
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	uint32_t epoch = (logIndex.count > 0) ? logIndex.segments[logIndex.count - 1].lastEpoch : 0;
+	xSemaphoreGive(logIndexMutex);
+	return epoch;
+}
+
+/**
+ * @brief The segment file that new records are appended to (owned by the csvFileManagerTask).
+ */
+struct LogWriter {
+	File file;
+	bool isOpen;
+	uint32_t fileBytes;	 // size of the segment file (the records already in flash)
+};
+
+/**
+ * @brief The newest records of the log, waiting in RAM to be written to the newest segment (see appendLogRecord).
+ * Only the csvFileManagerTask changes it (under logIndexMutex), the log readers copy the records they haven't read
+ * out of it, so a download always has the newest minute.
+ */
+struct LogTail {
+	LogRecord records[LOG_TAIL_RECORDS];
+	uint16_t count;
+	uint16_t period;	   // the segment the records belong to
+	int64_t firstAddedAt;  // esp_timer time the oldest record was added
+	uint32_t flushes;	   // changes whenever records leave the tail (a reader of the tail opens its segment again)
+};
+
+LogTail logTail;
+
+/**
+ * @brief Writes the records waiting in RAM to the newest segment with one flush (counted in /metrics).
+ * Records that can't be written are dropped, the same as a record that couldn't be appended.
+ */
+void flushLogWriter(LogWriter& writer) {
+	if (logTail.count == 0) {
+		return;
+	}
+	uint32_t bytes = logTail.count * sizeof(LogRecord);
+	int64_t flushStart = esp_timer_get_time();
+	bool isWritten = writer.isOpen && writer.file.write((uint8_t*)logTail.records, bytes) == bytes;
+	if (writer.isOpen) {
+		writer.file.flush();
+	}
+	uint32_t flushMicros = (uint32_t)(esp_timer_get_time() - flushStart);
+	metrics.logFlushes++;
+	metrics.logFlushMicros += flushMicros;
+	metrics.maxLogFlushMicros = max(metrics.maxLogFlushMicros, flushMicros);
+	TRACE(traceLogFlush, flushMicros);
+
+	if (isWritten) {
+		LogFlushCost cost = estimateLogFlushCost(writer.fileBytes, bytes);
+		metrics.logBytesWritten += bytes;
+		metrics.logBytesProgrammed += cost.programmedBytes;
+		metrics.logSectorErases += cost.erases;
+		writer.fileBytes += bytes;
+	} else {
+		ESP_LOGE("", "Error writing %u records to segment %u", logTail.count, logTail.period);
+		if (writer.isOpen) {
+			writer.fileBytes = writer.file.size();	// a partial record is dropped by repairLogSegment at the next boot
+		}
+	}
+
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	logTail.count = 0;
+	logTail.flushes++;
+	xSemaphoreGive(logIndexMutex);
+}
+
+// Drops the records waiting in RAM (the segment they belong to is being removed)
+void discardLogTail() {
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	logTail.count = 0;
+	logTail.flushes++;
+	xSemaphoreGive(logIndexMutex);
+}
+
+// Closes the newest segment (writing out the records waiting in RAM)
+void closeLogWriter(LogWriter& writer) {
+	flushLogWriter(writer);
+	if (writer.isOpen) {
+		writer.file.close();
+		writer.isOpen = false;
+	}
+	writer.fileBytes = 0;
+}
+
+/**
+ * @brief Appends a record to the log, starting a new segment when the record is in a new period.
+ *
+ * Records are coalesced in RAM (see LogTail) and written to flash when they reach the end of the sector the segment
+ * ends in, when the oldest has waited LOG_FLUSH_MAX_SECONDS, or when the segment is closed. Each flush is a LittleFS
+ * metadata commit and a copy of the part full last block, so this is ~24 flushes a day rather than one every few records.
+ *
+ * Before a new segment is started the oldest segments are evicted until the log is under MAX_LOG_SIZE_BYTES,
+ * under MAX_LOG_SEGMENTS and the filesystem has at least LOG_MIN_FREE_BYTES free, so the log never stops recording.
+ *
+ * Records have to be newer than the newest record in the log (keeping the log sorted). If the clock steps back by
+ * more than LOG_CLOCK_STEP_SECONDS the newer segments are assumed to have the wrong time and are evicted, a smaller
+ * step back just drops the records until the clock catches up.
+ *
+ * @param[in] writer The newest segment file.
+ * @param[in] record The record to log.
+ * @return True if the record was added to the log, false otherwise.
+ */
+bool appendLogRecord(LogWriter& writer, const LogRecord& record) {
+	while (logIndex.count > 0 && record.epoch + LOG_CLOCK_STEP_SECONDS < logIndex.segments[logIndex.count - 1].lastEpoch) {
+		ESP_LOGW("", "Clock stepped back to %u, removing newer records", record.epoch);
+		discardLogTail();  // the tail is the end of the newest segment
+		closeLogWriter(writer);
+		evictNewestLogSegment();
+	}
+	if (logIndex.count > 0 && record.epoch <= logIndex.segments[logIndex.count - 1].lastEpoch) {
+		return false;
+	}
+
+	uint16_t period = record.epoch / LOG_SEGMENT_SECONDS;
+	char path[LOG_PATH_MAX_CHARS];
+	logSegmentPath(path, period);
+
+	if (logIndex.count == 0 || logIndex.segments[logIndex.count - 1].period != period) {
+		closeLogWriter(writer);
+
+		// make room for a full new segment
+		while (logIndex.count > 0 &&
+			   (logIndex.count == MAX_LOG_SEGMENTS ||
+				logIndex.totalBytes + LOG_SEGMENT_MAX_BYTES > MAX_LOG_SIZE_BYTES ||
+				LittleFS.totalBytes() - LittleFS.usedBytes() < LOG_MIN_FREE_BYTES)) {
+			evictOldestLogSegment();
+		}
+
+		LogSegment segment;
+		segment.period = period;
+		segment.firstEpoch = record.epoch;
+		segment.lastEpoch = record.epoch;
+		segment.recordCount = 0;
+
+		xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+		logIndex.segments[logIndex.count++] = segment;
+		xSemaphoreGive(logIndexMutex);
+	}
+
+	if (writer.isOpen == false) {
+		writer.file = LittleFS.open(path, FILE_APPEND, true);
+		if (!writer.file) {
+			ESP_LOGE("", "Unable to open %s", path);
+			return false;
+		}
+		writer.isOpen = true;
+		writer.fileBytes = writer.file.size();
+	}
+
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	if (logTail.count == 0) {
+		logTail.period = period;
+		logTail.firstAddedAt = esp_timer_get_time();
+	}
+	logTail.records[logTail.count++] = record;
+	LogSegment& newest = logIndex.segments[logIndex.count - 1];
+	newest.lastEpoch = record.epoch;
+	newest.recordCount++;
+	logIndex.totalBytes += sizeof(record);	// counted now, so the size cap never lags the flushes
+	xSemaphoreGive(logIndexMutex);
+
+	if (isLogSectorFilled(writer.fileBytes, logTail.count) || esp_timer_get_time() - logTail.firstAddedAt >= (int64_t)LOG_FLUSH_MAX_SECONDS * 1000000) {
+		flushLogWriter(writer);
+	}
+	return true;
+}
+
+#ifdef LOW_POWER
+#define LOG_BATCH_MAGIC 0x4B454142	// "KEAB", rtcLogBatch holds records (anything else is left over from a power cut)
+
+// Minute records waiting to be written to the log. RTC memory keeps them through light sleep and any reset except a power cut.
+struct LogBatch {
+	uint32_t magic;
+	uint32_t count;
+	LogRecord records[LOG_BATCH_RECORDS];
+};
+RTC_NOINIT_ATTR LogBatch rtcLogBatch;
+
+// Appends the records waiting in RTC memory to the log with one flush for the lot (they only survive a reset in RTC
+// memory, so they aren't left in the tail). Records that are already in the log (a reset part way through a batch) are
+// rejected by appendLogRecord, so a batch can safely be written twice.
+void writeLogBatch(LogWriter& writer) {
+	if (rtcLogBatch.count == 0) {
+		return;
+	}
+	for (uint32_t i = 0; i < rtcLogBatch.count; i++) {
+		appendLogRecord(writer, rtcLogBatch.records[i]);
+	}
+	flushLogWriter(writer);
+	ESP_LOGI("", "Wrote %u records from RTC memory", rtcLogBatch.count);
+	rtcLogBatch.count = 0;
+}
+
+// Keeps a batch from before a reset (it is written by initializeLog), or starts an empty one after a power cut
+void startLogBatch() {
+	if (esp_reset_reason() == ESP_RST_POWERON || rtcLogBatch.magic != LOG_BATCH_MAGIC || rtcLogBatch.count > LOG_BATCH_RECORDS) {
+		rtcLogBatch.magic = LOG_BATCH_MAGIC;
+		rtcLogBatch.count = 0;
+	}
+}
+#endif
+
+/**
+ * @brief Adds a minute record to the log.
+ * LOW_POWER builds hold the records in RTC memory while the access point is down and write LOG_BATCH_RECORDS at a time
+ * (so flash is woken once an hour rather than every minute). While it is up they go straight to the log, so a download
+ * has the newest minute.
+ */
+void logMinute(LogWriter& writer, const LogRecord& record) {
+#ifdef LOW_POWER
+	if (accessPointOn == false) {
+		rtcLogBatch.records[rtcLogBatch.count++] = record;
+		if (rtcLogBatch.count == LOG_BATCH_RECORDS) {
+			writeLogBatch(writer);
+		}
+		return;
+	}
+	writeLogBatch(writer);	// the older records first, the log stays sorted
+#endif
+	appendLogRecord(writer, record);
+}
+
+/**
+ * @brief A bounded ring of RollupRecords in flash, one per `seconds` long bucket.
+ * The ring is indexed by time (bucket n is in slot n % capacity), so reading or writing a bucket is one seek
+ * and old buckets are overwritten without a head pointer. A slot whose epoch doesn't match is an empty bucket.
+ */
+struct RollupTier {
+	uint32_t seconds;
+	uint32_t capacity;
+	const char* filename;
+};
+
+#define ROLLUP_TIER_COUNT 2
+
+// The tiers the one minute rollups (the log) are rolled up into, finest first
+const RollupTier rollupTiers[ROLLUP_TIER_COUNT] = {
+	{900, 2976, "/rollup-15m.bin"},	// 15 minutes for 31 days (71 KB)
+	{3600, 8784, "/rollup-1h.bin"}	// 1 hour for 366 days (211 KB)
+};
+
+// Writes a bucket into its slot of a rollup tier in flash
+bool writeRollupRecord(const RollupTier& tier, const RollupRecord& record) {
+	if (LittleFS.exists(tier.filename) == false) {
+		File file = LittleFS.open(tier.filename, FILE_WRITE, true);
+		file.close();
+	}
+	File file = LittleFS.open(tier.filename, "r+");
+	if (!file) {
+		ESP_LOGE("", "Unable to open %s", tier.filename);
+		return false;
+	}
+
+	uint32_t slot = (record.epoch / tier.seconds) % tier.capacity;
+	bool isWritten = file.seek(slot * sizeof(RollupRecord)) && file.write((uint8_t*)&record, sizeof(record)) == sizeof(record);
+	file.close();
+	if (isWritten == false) {
+		ESP_LOGE("", "Error writing to %s", tier.filename);
+	}
+	return isWritten;
+}
+
+// Reads the bucket starting at epoch from an open rollup tier, returns false if the tier doesn't hold that bucket
+bool readRollupRecord(File& file, const RollupTier& tier, uint32_t epoch, RollupRecord& record) {
+	uint32_t slot = (epoch / tier.seconds) % tier.capacity;
+	if (file.seek(slot * sizeof(RollupRecord)) == false || file.read((uint8_t*)&record, sizeof(record)) != sizeof(record)) {
+		return false;
+	}
+	return record.epoch == epoch && record.count > 0;
+}
+
+/**
+ * @brief The buckets of every rollup tier that are being filled by the one minute rollups (owned by the csvFileManagerTask).
+ */
+struct RollupWriter {
+	RollupAccumulator tiers[ROLLUP_TIER_COUNT];
+};
+
+// Starts every tier on an empty bucket
+void startRollupWriter(RollupWriter& writer) {
+	for (uint8_t i = 0; i < ROLLUP_TIER_COUNT; i++) {
+		resetRollup(writer.tiers[i], 0);
+	}
+}
+
+// Rolls a one minute bucket up into every tier, writing out the buckets it closes
+void addToRollupTiers(RollupWriter& writer, const RollupRecord& minute) {
+	for (uint8_t i = 0; i < ROLLUP_TIER_COUNT; i++) {
+		RollupAccumulator& rollup = writer.tiers[i];
+		uint32_t bucketEpoch = minute.epoch - (minute.epoch % rollupTiers[i].seconds);
+		if (rollup.bucketEpoch != bucketEpoch) {
+			if (rollup.count > 0) {
+				writeRollupRecord(rollupTiers[i], toRollupRecord(rollup));
+			}
+			resetRollup(rollup, bucketEpoch);
+		}
+		mergeRollup(rollup, minute);
+	}
+}
+
+// Removes the stored buckets of every tier
+void clearRollupTiers(RollupWriter& writer) {
+	startRollupWriter(writer);
+	for (uint8_t i = 0; i < ROLLUP_TIER_COUNT; i++) {
+		LittleFS.remove(rollupTiers[i].filename);
+	}
+}
+
+#define LOG_READ_BATCH 16  // Number of records read from flash at a time when streaming the log
+
+/**
+ * @brief Reads the records of the log in epoch order, one segment at a time (used by the log downloads).
+ * Only the segments in the log when the reader started are read, the newest one up to the records still waiting in
+ * RAM (see readLogTail). Segments evicted while reading are skipped.
+ */
+struct LogReader {
+	File file;
+	uint32_t fromEpoch;		// records older than this are skipped (found with a binary search in the first segment)
+	uint32_t lastEpoch;		// epoch of the last record read (fromEpoch - 1 before the first)
+	uint32_t tailFlushes;	// logTail.flushes when the open segment was opened
+	bool hasSegment;		// a segment has been opened (period is valid)
+	uint16_t period;		// the period of the segment being read
+	uint16_t lastPeriod;	// the newest segment when the reader started
+	uint32_t recordCount;	// records in the open segment
+	uint32_t nextRecord;
+	bool isDone;
+
+	LogRecord batch[LOG_READ_BATCH];
+	uint8_t batchCount;
+	uint8_t batchIndex;
+};
+
+// Sets up a reader of the records from fromEpoch (0 for the whole log) to the newest record
+void startLogReader(LogReader& reader, uint32_t fromEpoch) {
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	reader.isDone = (logIndex.count == 0);
+	reader.lastPeriod = (logIndex.count > 0) ? logIndex.segments[logIndex.count - 1].period : 0;
+	xSemaphoreGive(logIndexMutex);
+
+	reader.fromEpoch = fromEpoch;
+	reader.lastEpoch = (fromEpoch > 0) ? fromEpoch - 1 : 0;
+	reader.hasSegment = false;
+	reader.recordCount = 0;
+	reader.nextRecord = 0;
+	reader.batchCount = 0;
+	reader.batchIndex = 0;
+}
+
+// Finds the first record of the open segment at or after epoch (O(log n) seeks, records are sorted by epoch)
+uint32_t findFirstRecordFrom(File& file, uint32_t recordCount, uint32_t epoch) {
+	uint32_t low = 0;
+	uint32_t high = recordCount;
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		LogRecord record;
+		if (readLogRecord(file, middle, record) == false) {
+			break;
+		}
+		if (record.epoch < epoch) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+// Opens the next segment of the log (the first one holding fromEpoch, then the ones after it), returns false at the end
+bool openNextLogSegment(LogReader& reader) {
+	if (reader.file) {
+		reader.file.close();
+	}
+
+	bool found = false;
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	for (uint16_t i = 0; i < logIndex.count; i++) {
+		const LogSegment& segment = logIndex.segments[i];
+		bool isNext = reader.hasSegment ? (segment.period > reader.period) : (segment.lastEpoch >= reader.fromEpoch);
+		if (isNext && segment.period <= reader.lastPeriod) {
+			reader.period = segment.period;
+			found = true;
+			break;
+		}
+	}
+	reader.tailFlushes = logTail.flushes;
+	xSemaphoreGive(logIndexMutex);
+
+	if (found == false) {
+		return false;
+	}
+
+	char path[LOG_PATH_MAX_CHARS];
+	logSegmentPath(path, reader.period);
+	reader.file = LittleFS.open(path, FILE_READ);
+	reader.recordCount = reader.file ? reader.file.size() / sizeof(LogRecord) : 0;
+	reader.nextRecord = 0;
+	if (reader.hasSegment == false && reader.fromEpoch > 0) {
+		reader.nextRecord = findFirstRecordFrom(reader.file, reader.recordCount, reader.fromEpoch);
+		reader.file.seek(reader.nextRecord * sizeof(LogRecord));
+	}
+	reader.hasSegment = true;
+	return true;
+}
+
+/**
+ * @brief Copies up to LOG_READ_BATCH records of the open segment that are still waiting in RAM (newer than the last one
+ * read) into the batch. If records were written to flash since the segment was opened, it is opened again after the
+ * last record read instead (so no record is missed or read twice).
+ * @return False if the open segment has no more records
+ */
+bool readLogTail(LogReader& reader) {
+	while (true) {
+		xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+		uint32_t flushes = logTail.flushes;
+		if (flushes == reader.tailFlushes) {
+			reader.batchCount = 0;
+			reader.batchIndex = 0;
+			for (uint16_t i = 0; logTail.period == reader.period && i < logTail.count && reader.batchCount < LOG_READ_BATCH; i++) {
+				if (logTail.records[i].epoch > reader.lastEpoch) {
+					reader.batch[reader.batchCount++] = logTail.records[i];
+				}
+			}
+			xSemaphoreGive(logIndexMutex);
+			return reader.batchCount > 0;
+		}
+		xSemaphoreGive(logIndexMutex);
+
+		char path[LOG_PATH_MAX_CHARS];
+		logSegmentPath(path, reader.period);
+		reader.file.close();
+		reader.file = LittleFS.open(path, FILE_READ);
+		reader.recordCount = reader.file ? reader.file.size() / sizeof(LogRecord) : 0;
+		reader.nextRecord = findFirstRecordFrom(reader.file, reader.recordCount, reader.lastEpoch + 1);
+		reader.file.seek(reader.nextRecord * sizeof(LogRecord));
+		reader.tailFlushes = flushes;
+		if (reader.nextRecord < reader.recordCount) {
+			return true;
+		}
+	}
+}
+
+// Gets the next record of the log, reading from flash LOG_READ_BATCH records at a time. Returns false at the end of the log
+bool nextLogRecord(LogReader& reader, LogRecord& record) {
+	while (reader.batchIndex == reader.batchCount) {
+		if (reader.isDone) {
+			return false;
+		}
+		if (reader.nextRecord >= reader.recordCount) {
+			if (reader.hasSegment && readLogTail(reader)) {
+				continue;
+			}
+			if (openNextLogSegment(reader) == false) {
+				reader.file.close();
+				reader.isDone = true;
+				return false;
+			}
+			continue;
+		}
+
+		uint32_t recordsToRead = min((uint32_t)LOG_READ_BATCH, reader.recordCount - reader.nextRecord);
+		size_t bytesRead = reader.file.read((uint8_t*)reader.batch, recordsToRead * sizeof(LogRecord));
+		reader.batchCount = bytesRead / sizeof(LogRecord);
+		reader.batchIndex = 0;
+		reader.nextRecord += recordsToRead;
+		if (reader.batchCount == 0) {
+			ESP_LOGE("", "Error reading log segment %u", reader.period);
+			reader.nextRecord = reader.recordCount;	 // skip the rest of this segment
+		}
+	}
+
+	record = reader.batch[reader.batchIndex++];
+	reader.lastEpoch = record.epoch;
+	return true;
+}
+
+// Stops a reader part way through (closing the open segment)
+void stopLogReader(LogReader& reader) {
+	reader.file.close();
+	reader.isDone = true;
+}
+
+// Writes the CSV column titles (unique to this device, based on the ESP32's MAC address)
+int formatCsvHeader(char* buffer, size_t size) {
+	uint8_t mac[6];
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+	return snprintf(buffer, size, "Kea-CO2-%02X (D/M/Y), Time(H:M), CO2(PPM), Humidity(%%RH), Temperature(DegC)\r\n", mac[5]);
+}
+
+/**
+ * @brief The state of one Kea-CO2-Data.csv download being rendered from the log.
+ */
+struct LogCsvStream {
+	LogReader reader;
+	bool headerSent;
+
+	char token[128];
+	uint8_t tokenLength;
+	uint8_t tokenOffset;
+};
+
+// Sets up a download of the whole log, an empty log gives a CSV with just the header
+void startLogCsvStream(LogCsvStream& stream) {
+	startLogReader(stream.reader, 0);
+	stream.headerSent = false;
+	stream.tokenLength = 0;
+	stream.tokenOffset = 0;
+}
+
+// Produces the next CSV line into stream.token
+streamTokenResults nextLogCsvToken(LogCsvStream& stream) {
+	stream.tokenOffset = 0;
+	stream.tokenLength = 0;
+
+	if (stream.headerSent == false) {
+		stream.tokenLength = formatCsvHeader(stream.token, sizeof(stream.token));
+		stream.headerSent = true;
+		return tokenReady;
+	}
+
+	LogRecord record;
+	if (nextLogRecord(stream.reader, record) == false) {
+		return tokenDone;
+	}
+	stream.tokenLength = formatCsvLine(stream.token, record);
+	return tokenReady;
+}
+
+// Fills one chunk of a Kea-CO2-Data.csv response (AwsResponseFiller for beginChunkedResponse)
+size_t fillLogCsv(LogCsvStream& stream, uint8_t* buffer, size_t maxLen) {
+	size_t bytesWritten = 0;
+
+	while (bytesWritten < maxLen) {
+		if (stream.tokenOffset == stream.tokenLength) {
+			if (nextLogCsvToken(stream) != tokenReady) {
+				break;
+			}
+		}
+
+		size_t length = min((size_t)(stream.tokenLength - stream.tokenOffset), maxLen - bytesWritten);
+		memcpy(buffer + bytesWritten, stream.token + stream.tokenOffset, length);
+		stream.tokenOffset += length;
+		bytesWritten += length;
+	}
+	return bytesWritten;
+}
+
+#define HISTORY_MAX_POINTS 2000	 // Maximum number of points in one /history response (the step is made larger to fit)
+#define HISTORY_TIER_SLOTS_PER_FILL 512	 // Most rollup tier slots read in one chunk fill (a sparse tier is scanned over several fills)
+
+enum historyStreamStages {
+	historyOpen,
+	historyPoints,
+	historyClose,
+	historyDone
+};
+
+/**
+ * @brief The state of one /history response being streamed out of the log or a rollup tier.
+ * The response is {"step":<seconds>,"points":[[epoch,co2,humidity,temperature],...]}, with the same values as
+ * the /events samples. With a step, each point is the mean of one step long bucket (the epoch is the start of the
+ * bucket), so the response is at most HISTORY_MAX_POINTS points long. With minmax, each point also has the
+ * minimum and maximum of each channel ([epoch,co2,humidity,temperature,co2Min,co2Max,humMin,humMax,tempMin,tempMax]).
+ *
+ * When the step is a whole number of buckets of a rollup tier that holds the range, the points are made from the
+ * tier (one read per tier bucket) instead of from every record of the log.
+ */
+struct HistoryStream {
+	LogReader reader;
+	int8_t tier;  // the rollupTiers index the points are read from, -1 reads the log
+	File tierFile;
+	uint32_t fromEpoch;
+	uint32_t toEpoch;
+	uint32_t step;	// seconds per point (0 sends every record)
+	bool includeMinMax;
+	historyStreamStages stage;
+	bool isFirstPoint;
+
+	bool hasBucket;
+	RollupAccumulator bucket;  // the bucket being rolled up
+	uint32_t tierEpoch;		   // the next tier slot of the bucket to read (when hasBucket)
+	uint16_t tierSlotsLeft;	   // tier slots this fill can still read
+
+	char token[160];
+	uint8_t tokenLength;
+	uint8_t tokenOffset;
+};
+
+// Picks the coarsest rollup tier that a step is a whole number of buckets of, and that goes back to fromEpoch
+int8_t findRollupTier(uint32_t fromEpoch, uint32_t step, uint32_t newestEpoch) {
+	for (int8_t i = ROLLUP_TIER_COUNT - 1; i >= 0; i--) {
+		uint32_t tierSpan = rollupTiers[i].seconds * rollupTiers[i].capacity;
+		bool holdsRange = (newestEpoch < tierSpan || fromEpoch >= newestEpoch - tierSpan);
+		if (step != 0 && step % rollupTiers[i].seconds == 0 && holdsRange) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Sets up a /history response.
+ * @param fromEpoch Oldest epoch to send (0 starts at the oldest record of the log)
+ * @param toEpoch Newest epoch to send
+ * @param step Seconds per point, 0 sends every record (both are made larger if the range would be over HISTORY_MAX_POINTS points)
+ * @param includeMinMax Adds the minimum and maximum of each channel to every point
+ */
+void startHistoryStream(HistoryStream& stream, uint32_t fromEpoch, uint32_t toEpoch, uint32_t step, bool includeMinMax) {
+	uint32_t oldestEpoch = 0, newestEpoch = 0;
+	xSemaphoreTake(logIndexMutex, portMAX_DELAY);
+	if (logIndex.count > 0) {
+		oldestEpoch = logIndex.segments[0].firstEpoch;
+		newestEpoch = logIndex.segments[logIndex.count - 1].lastEpoch;
+	}
+	xSemaphoreGive(logIndexMutex);
+	time_t now;
+	time(&now);
+	newestEpoch = max(newestEpoch, (uint32_t)now);	// the rollup tiers can go back further than the log
+
+	// bound the size of the response by the range that could be stored
+	uint32_t rangeSeconds = 0;
+	uint32_t firstEpoch = (fromEpoch > 0) ? fromEpoch : oldestEpoch;
+	if (firstEpoch < min(toEpoch, newestEpoch)) {
+		rangeSeconds = min(toEpoch, newestEpoch) - firstEpoch;
+	}
+	if (step != 0 || rangeSeconds / CSV_RECORD_INTERVAL_SECONDS >= HISTORY_MAX_POINTS) {
+		step = max(step, max((uint32_t)CSV_RECORD_INTERVAL_SECONDS, rangeSeconds / HISTORY_MAX_POINTS + 1));
+		uint32_t stepUnit = CSV_RECORD_INTERVAL_SECONDS;  // whole records per bucket (or whole tier buckets, so a tier can be used)
+		for (uint8_t i = 0; i < ROLLUP_TIER_COUNT; i++) {
+			if (step > rollupTiers[i].seconds) {
+				stepUnit = rollupTiers[i].seconds;
+			}
+		}
+		step = ((step + stepUnit - 1) / stepUnit) * stepUnit;
+	}
+
+	stream.tier = findRollupTier(firstEpoch, step, newestEpoch);
+	if (stream.tier >= 0) {
+		stream.tierFile = LittleFS.open(rollupTiers[stream.tier].filename, FILE_READ);
+		if (!stream.tierFile) {
+			stream.tier = -1;  // nothing has been rolled up yet
+		}
+	}
+	if (stream.tier < 0) {
+		startLogReader(stream.reader, fromEpoch);
+	}
+
+	stream.fromEpoch = (stream.tier >= 0) ? (firstEpoch - (firstEpoch % step)) : fromEpoch;	// the tier is read one step at a time from here
+	stream.toEpoch = min(toEpoch, newestEpoch);
+	stream.step = step;
+	stream.includeMinMax = includeMinMax;
+	stream.stage = historyOpen;
+	stream.isFirstPoint = true;
+	stream.hasBucket = false;
+	stream.tierSlotsLeft = HISTORY_TIER_SLOTS_PER_FILL;
+	stream.tokenLength = 0;
+	stream.tokenOffset = 0;
+}
+
+// Writes the bucket as one [epoch,co2,humidity,temperature(,min,max...)] point into stream.token
+void formatHistoryPoint(HistoryStream& stream) {
+	const RollupAccumulator& bucket = stream.bucket;
+	int length = sprintf(stream.token, "%s[%u", stream.isFirstPoint ? "" : ",", bucket.bucketEpoch);
+	for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+		sampleChannels graphChannel = static_cast<sampleChannels>(channel);
+		length += sprintf(stream.token + length, ",");
+		length += formatGraphValue(stream.token + length, graphChannel, toGraphValue(graphChannel, rollupMean(bucket, graphChannel)));
+	}
+	if (stream.includeMinMax) {
+		for (uint8_t channel = 0; channel < SAMPLE_CHANNEL_COUNT; channel++) {
+			sampleChannels graphChannel = static_cast<sampleChannels>(channel);
+			length += sprintf(stream.token + length, ",");
+			length += formatGraphValue(stream.token + length, graphChannel, toGraphValue(graphChannel, bucket.minimum[channel]));
+			length += sprintf(stream.token + length, ",");
+			length += formatGraphValue(stream.token + length, graphChannel, toGraphValue(graphChannel, bucket.maximum[channel]));
+		}
+	}
+	length += sprintf(stream.token + length, "]");
+	stream.tokenLength = length;
+	stream.isFirstPoint = false;
+}
+
+// Rolls up the next non empty bucket of the log and writes it into stream.token, returns false at the end of the range
+bool nextHistoryBucketFromLog(HistoryStream& stream) {
+	LogRecord record;
+	while (true) {
+		bool hasRecord = nextLogRecord(stream.reader, record);
+		if (hasRecord && record.epoch > stream.toEpoch) {
+			stopLogReader(stream.reader);
+			hasRecord = false;
+		}
+		if (hasRecord == false) {
+			if (stream.hasBucket) {	 // the last bucket of the range
+				stream.hasBucket = false;
+				formatHistoryPoint(stream);
+				return true;
+			}
+			return false;
+		}
+
+		uint32_t bucketEpoch = (stream.step == 0) ? record.epoch : record.epoch - (record.epoch % stream.step);
+		const int32_t values[SAMPLE_CHANNEL_COUNT] = {record.co2, record.humidity, record.temperature};
+
+		if (stream.hasBucket && bucketEpoch != stream.bucket.bucketEpoch) {
+			// the record has started the next bucket, send the finished one
+			formatHistoryPoint(stream);
+			resetRollup(stream.bucket, bucketEpoch);
+			addToRollup(stream.bucket, values);
+			return true;
+		}
+		if (stream.hasBucket == false) {
+			stream.hasBucket = true;
+			resetRollup(stream.bucket, bucketEpoch);
+		}
+		addToRollup(stream.bucket, values);
+	}
+}
+
+/**
+ * @brief Rolls up the next non empty bucket of the rollup tier and writes it into stream.token.
+ * Each slot is a seek and a read on the async_tcp task, so only tierSlotsLeft slots are read per fill. When they run
+ * out the bucket is left part read (hasBucket, tierEpoch) and picked up again by the next fill.
+ * @return tokenReady with a point, tokenTryAgain when this fill has read its slots, tokenDone at the end of the range
+ */
+streamTokenResults nextHistoryBucketFromTier(HistoryStream& stream) {
+	const RollupTier& tier = rollupTiers[stream.tier];
+	while (stream.fromEpoch <= stream.toEpoch) {
+		if (stream.hasBucket == false) {
+			resetRollup(stream.bucket, stream.fromEpoch);
+			stream.tierEpoch = stream.fromEpoch;
+			stream.hasBucket = true;
+		}
+		for (; stream.tierEpoch < stream.fromEpoch + stream.step; stream.tierEpoch += tier.seconds) {
+			if (stream.tierSlotsLeft == 0) {
+				return tokenTryAgain;
+			}
+			stream.tierSlotsLeft--;
+			RollupRecord record;
+			if (readRollupRecord(stream.tierFile, tier, stream.tierEpoch, record)) {
+				mergeRollup(stream.bucket, record);
+			}
+		}
+		stream.hasBucket = false;
+		if (stream.fromEpoch > UINT32_MAX - stream.step) {
+			stream.toEpoch = 0;	 // stop (don't wrap the epoch)
+		}
+		stream.fromEpoch += stream.step;
+
+		if (stream.bucket.count > 0) {
+			formatHistoryPoint(stream);
+			return tokenReady;
+		}
+	}
+	stream.tierFile.close();
+	return tokenDone;
+}
+
+// Produces the next part of the response into stream.token
+streamTokenResults nextHistoryToken(HistoryStream& stream) {
+	stream.tokenOffset = 0;
+	stream.tokenLength = 0;
+
+	switch (stream.stage) {
+	case historyOpen:
+		stream.tokenLength = sprintf(stream.token, "{\"step\":%u,\"points\":[", stream.step);
+		stream.stage = historyPoints;
+		return tokenReady;
+
+	case historyPoints: {
+		streamTokenResults result = (stream.tier >= 0) ? nextHistoryBucketFromTier(stream) : (nextHistoryBucketFromLog(stream) ? tokenReady : tokenDone);
+		if (result != tokenDone) {
+			return result;
+		}
+		stream.stage = historyClose;
+		return nextHistoryToken(stream);
+	}
+
+	case historyClose:
+		stream.tokenLength = sprintf(stream.token, "]}");
+		stream.stage = historyDone;
+		return tokenReady;
+
+	default:
+		return tokenDone;
+	}
+}
+
+// Fills one chunk of a /history response (AwsResponseFiller for beginChunkedResponse)
+size_t fillHistory(HistoryStream& stream, uint8_t* buffer, size_t maxLen) {
+	size_t bytesWritten = 0;
+	stream.tierSlotsLeft = HISTORY_TIER_SLOTS_PER_FILL;
+
+	while (bytesWritten < maxLen) {
+		if (stream.tokenOffset == stream.tokenLength) {
+			streamTokenResults result = nextHistoryToken(stream);
+			if (result == tokenTryAgain && bytesWritten == 0) {
+				return RESPONSE_TRY_AGAIN;
+			} else if (result != tokenReady) {
+				break;
+			}
+		}
+
+		size_t length = min((size_t)(stream.tokenLength - stream.tokenOffset), maxLen - bytesWritten);
+		memcpy(buffer + bytesWritten, stream.token + stream.tokenOffset, length);
+		stream.tokenOffset += length;
+		bytesWritten += length;
+	}
+	return bytesWritten;
+}
+
+// -----------------------------------------
+//
+//    I2C Buses
+//
+// -----------------------------------------
+
+// A transaction (or a few back to back) run on a bus task with the bus's TwoWire, returns 0 on success
+typedef uint8_t (*I2cJob)(TwoWire& wire, void* context);
+
+// A job waiting in the queue of a bus
+struct I2cRequest {
+	I2cJob job;
+	void* context;			   // passed to the job (usually the device object and somewhere to put the reading)
+	TaskHandle_t requester;	   // given a task notification when the job has run
+	uint8_t* result;		   // where to put what the job returned
+	int64_t* completedMicros;  // where to put the esp_timer time the job finished (NULL if not needed)
+	int64_t queuedMicros;	   // when the job was queued (for the statistics)
+};
+
+/**
+ * @brief One I2C bus, its clock and the task that runs every transaction on it.
+ * Only the bus task touches the TwoWire, so tasks using different buses never wait for each other and jobs from tasks sharing a bus
+ * are run back to back in the order they were queued.
+ */
+struct I2cBus {
+	TwoWire* wire;
+	int sdaPin;
+	int sclPin;
+	uint32_t frequency;	 // the fastest clock every device on the bus supports
+	const char* name;
+	QueueHandle_t requests;
+	TaskHandle_t task;
+	// statistics
+	uint32_t jobCount;
+	uint32_t errorCount;
+	uint32_t maxWaitMicros;	 // longest a job has waited in the queue
+	uint32_t maxJobMicros;	 // longest a job has taken to run
+};
+
+enum i2cBusIds {
+	sensorBus,	// Wire: SCD4x and PCF8563
+	lightBus,	// Wire1: LTR303
+	I2C_BUS_COUNT
+};
+
+I2cBus i2cBuses[I2C_BUS_COUNT] = {
+	{&Wire, WIRE_SDA_PIN, WIRE_SCL_PIN, WIRE_FREQUENCY, "sensorBus"},
+	{&Wire1, WIRE1_SDA_PIN, WIRE1_SCL_PIN, WIRE1_FREQUENCY, "lightBus"}};
+
+// Runs one request and hands the result back to the task that queued it
+void runI2cRequest(I2cBus& bus, const I2cRequest& request) {
+	int64_t startMicros = esp_timer_get_time();
+	uint8_t result = request.job(*bus.wire, request.context);
+	int64_t endMicros = esp_timer_get_time();
+
+	bus.jobCount++;
+	if (result != 0) {
+		bus.errorCount++;
+	}
+	bus.maxWaitMicros = max(bus.maxWaitMicros, (uint32_t)(startMicros - request.queuedMicros));
+	bus.maxJobMicros = max(bus.maxJobMicros, (uint32_t)(endMicros - startMicros));
+	TRACE(traceI2cJob, ((uint32_t)(&bus - i2cBuses) << 24) | (uint32_t)(endMicros - startMicros));
+
+	*request.result = result;
+	if (request.completedMicros != NULL) {
+		*request.completedMicros = endMicros;
+	}
+	xTaskNotifyGive(request.requester);
+}
+
+/**
+ * @brief Owns one I2C bus and runs the jobs queued for it.
+ * Everything waiting when the task wakes is run in one batch before it sleeps again.
+ * @param[in] parameter The I2cBus to run.
+ */
+void i2cBusTask(void* parameter) {
+	I2cBus& bus = *static_cast<I2cBus*>(parameter);
+	bus.wire->begin(bus.sdaPin, bus.sclPin, bus.frequency);
+
+	I2cRequest request;
+	while (true) {
+		xQueueReceive(bus.requests, &request, portMAX_DELAY);
+		do {
+			runI2cRequest(bus, request);
+		} while (xQueueReceive(bus.requests, &request, 0) == pdTRUE);
+	}
+}
+
+// Creates the queue and task of every I2C bus (jobs can be queued straight away, they run once the bus has started)
+void startI2cBuses() {
+	for (uint8_t id = 0; id < I2C_BUS_COUNT; id++) {
+		i2cBuses[id].requests = xQueueCreate(I2C_QUEUE_LENGTH, sizeof(I2cRequest));
+		xTaskCreatePinnedToCore(i2cBusTask, i2cBuses[id].name, 3000, &i2cBuses[id], I2C_TASK_PRIORITY, &i2cBuses[id].task, I2C_TASK_CORE);
+	}
+}
+
+/**
+ * @brief Runs a job on an I2C bus and waits for it to finish.
+ * The calling task is woken with a task notification, so it must not be waiting on task notifications for anything else.
+ * @param completedMicros Set to the esp_timer time the job finished (when the reading was taken), can be NULL
+ * @return What the job returned (0 = success)
+ */
+uint8_t runOnI2cBus(i2cBusIds id, I2cJob job, void* context, int64_t* completedMicros = NULL) {
+	uint8_t result = UINT8_MAX;
+	I2cRequest request = {job, context, xTaskGetCurrentTaskHandle(), &result, completedMicros, esp_timer_get_time()};
+	xQueueSend(i2cBuses[id].requests, &request, portMAX_DELAY);
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	return result;
+}
+
+// Initializes the LED strip to black.
+void initializeLightBar(NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod>& lightBar) {
+	lightBar.Begin();
+	lightBar.Show();
+}
+
+// Starts the light sensor (I2cJob on the lightBus), in a production test it fails if the sensor does not answer
+uint8_t startLightSensorJob(TwoWire& wire, void* context) {
+	LTR303& lightSensor = *static_cast<LTR303*>(context);
+	uint8_t result = 0;
+#ifdef PRODUCTION_TEST
+	if (!lightSensor.isConnected(wire, &Serial)) {
+		result = 1;
+	}
+#endif
+	lightSensor.begin(GAIN_48X, EXPOSURE_100ms, true, wire);
+	return result;
+}
+
+struct LuxReading {
+	LTR303* lightSensor;
+	double lux;
+};
+
+// Reads the light level (I2cJob on the lightBus)
+uint8_t readLuxJob(TwoWire& wire, void* context) {
+	LuxReading& reading = *static_cast<LuxReading*>(context);
+	return reading.lightSensor->getApproximateLux(reading.lux) ? 0 : 1;
+}
+
+// Reads the light sensor and sets the target brightness of the LED strip based on the light level.
+bool updateTargetBrightness(LTR303& lightSensor, uint8_t& targetBrightness) {
+	LuxReading reading = {&lightSensor, 0};
+	if (runOnI2cBus(lightBus, readLuxJob, &reading) == 0) {
+		uint16_t lux = (uint16_t)min(reading.lux, (double)UINT16_MAX);	// the library only gives a double, everything after is integer
+		ambientLux = lux;
+		ambientLuxValid = true;
+		if (lux < (BRIGHTNESS_FACTOR * MAX_BRIGHTNESS)) {
+			targetBrightness = (uint8_t)(lux / BRIGHTNESS_FACTOR);
+		} else {
+			targetBrightness = MAX_BRIGHTNESS;
+		}
+		return true;
+	}
+	return false;
+}
+
+// Ticks until a deadline (0 if it has passed)
+TickType_t ticksUntil(TickType_t deadline) {
+	TickType_t now = xTaskGetTickCount();
+	return ((int32_t)(deadline - now) > 0) ? (deadline - now) : 0;
+}
+
+// Compile time index list (std::index_sequence is C++14), used to fill the light bar lookup tables
+template <size_t... I>
+struct indexSequence {};
+template <size_t N, size_t... I>
+struct makeIndexSequence : makeIndexSequence<N - 1, N - 1, I...> {};
+template <size_t... I>
+struct makeIndexSequence<0, I...> : indexSequence<I...> {};
+
+// A 256 entry lookup table built at compile time (stored in flash, nothing is computed at boot)
+struct ByteTable {
+	uint8_t value[256];
+};
+
+// Green at the bottom of the bar, red at the top (redGreenMix 0 - 255)
+constexpr uint8_t gradientRed(size_t redGreenMix) { return (uint8_t)redGreenMix; }
+constexpr uint8_t gradientGreen(size_t redGreenMix) { return (uint8_t)(255 - redGreenMix); }
+
+// Approximately gamma 2.4, so the pixel the bar is moving through fades evenly to the eye (linear values fade fast at the bright end)
+constexpr uint8_t fadeGamma(size_t value) { return (uint8_t)((value * value * value / (255 * 255) + value * value / 255) / 2); }
+
+template <size_t... I>
+constexpr ByteTable makeGradientRedTable(indexSequence<I...>) { return {{gradientRed(I)...}}; }
+template <size_t... I>
+constexpr ByteTable makeGradientGreenTable(indexSequence<I...>) { return {{gradientGreen(I)...}}; }
+template <size_t... I>
+constexpr ByteTable makeFadeTable(indexSequence<I...>) { return {{fadeGamma(I)...}}; }
+
+constexpr ByteTable gradientRedTable = makeGradientRedTable(makeIndexSequence<256>{});		 // Red of the bar color, indexed by redGreenMix
+constexpr ByteTable gradientGreenTable = makeGradientGreenTable(makeIndexSequence<256>{});	 // Green of the bar color, indexed by redGreenMix
+constexpr ByteTable fadeTable = makeFadeTable(makeIndexSequence<256>{});					 // Gamma corrected brightness of the mixing pixel, indexed by its local position
+
+// Scales one color channel by ratio (same as RgbColor::Dim, 255 = full brightness)
+inline uint8_t dimChannel(uint8_t value, uint8_t ratio) {
+	return ((uint16_t)value * ((uint16_t)ratio + 1)) >> 8;
+}
+
+// Estimates the current the pixels now draw from their channel values, adding what the last frame drew to the total in /metrics
+void recordLightBarCurrent(const uint8_t* frame, size_t frameBytes) {
+	uint32_t channelSum = 0;
+	for (size_t i = 0; i < frameBytes; i++) {
+		channelSum += frame[i];
+	}
+	int64_t now = esp_timer_get_time();
+	if (metrics.lightBarMicroampsSince != 0) {
+		metrics.lightBarCharge += (uint64_t)metrics.lightBarMicroamps * (uint64_t)(now - metrics.lightBarMicroampsSince);
+	}
+	metrics.lightBarMicroamps = (frameBytes / 3) * PIXEL_IDLE_MICROAMPS + channelSum * (PIXEL_CHANNEL_MICROAMPS / 255);
+	metrics.lightBarMicroampsSince = now;
+}
+
+/**
+ * @brief Sends the pixel buffer to the LEDs, only if it has changed since the last time it was sent.
+ * @param lastFrame A copy of the pixels that were last sent (PixelsSize() bytes)
+ * @return True if the LEDs were updated
+ */
+bool showIfChanged(NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod>& lightBar, uint8_t* lastFrame) {
+	if (memcmp(lastFrame, lightBar.Pixels(), lightBar.PixelsSize()) == 0) {
+		lightBar.ResetDirty();
+		return false;
+	}
+	memcpy(lastFrame, lightBar.Pixels(), lightBar.PixelsSize());
+	lightBar.Show();
+	recordLightBarCurrent(lastFrame, lightBar.PixelsSize());
+	return true;
+}
+
+// Sends the pixel buffer to the LEDs, keeping lastFrame in step with the LEDs
+void showFrame(NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod>& lightBar, uint8_t* lastFrame) {
+	memcpy(lastFrame, lightBar.Pixels(), lightBar.PixelsSize());
+	lightBar.Show();
+	recordLightBarCurrent(lastFrame, lightBar.PixelsSize());
+}
+
+// Draws the scale into the pixel buffer (send it with showIfChanged, so the LEDs are only written when a pixel has actually changed).
+void drawLightBar(NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod>& lightBar, const uint16_t& position, const uint8_t& brightness) {
+	uint8_t redGreenMix = position / PIXEL_COUNT;	 // 0 - 255 version of position
+	uint16_t mixingPixel = position / 255;			 // which pixel is the position at
+	uint8_t mixingPixelBrightness = position % 255;	 // what is the local position of the pixel
+
+	mixingPixel = LAST_PIXEL - mixingPixel;	 // reverse direction of lightbar (0th pixel is the top)
+
+	// brew base color -> Green at bottom, Red at top
+	RgbColor baseColor = RgbColor(dimChannel(gradientRedTable.value[redGreenMix], brightness), dimChannel(gradientGreenTable.value[redGreenMix], brightness), 0);
+	uint8_t fade = fadeTable.value[mixingPixelBrightness];
+
+	lightBar.SetPixelColor(mixingPixel - 1, RgbColor(0));														// set one pixel above the mixing pixel to black
+	lightBar.SetPixelColor(mixingPixel, RgbColor(dimChannel(baseColor.R, fade), dimChannel(baseColor.G, fade), 0));	// set mixing pixel
+
+	if (mixingPixel < LAST_PIXEL) {
+		lightBar.ClearTo(baseColor, mixingPixel + 1, LAST_PIXEL);  // fill solid color to the bottom of the bar
+	}
+}
+
+// The slot a command type is coalesced into, NULL for the types that are queued as they are (modes and effects)
+LightBarCommandSlot* findLightBarCommandSlot(lightBarCommandTypes type) {
+	switch (type) {
+		case setTargetCommand:
+			return &lightBarTargetSlot;
+		case setBrightnessCapCommand:
+			return &lightBarBrightnessCapSlot;
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * @brief Queues a command for the light bar task, it is carried out at the start of the next frame.
+ * Never blocks. A target or brightness cap overwrites one that is still waiting (only the newest matters), so those
+ * never fill the queue, even while the light bar task is suspended. Mode and effect commands are never dropped to make room.
+ * @return False if the command could not be queued (the queue is full of mode and effect commands)
+ */
+bool sendLightBarCommand(lightBarCommandTypes type, uint16_t value) {
+	LightBarCommand command = {type, value};
+	LightBarCommandSlot* slot = findLightBarCommandSlot(type);
+	if (slot != NULL) {
+		portENTER_CRITICAL(&lightBarCommandSlotLock);
+		bool isQueued = slot->isQueued;
+		slot->value = value;
+		slot->isQueued = true;
+		portEXIT_CRITICAL(&lightBarCommandSlotLock);
+		if (isQueued) {
+			return true;  // the waiting command picks up the new value
+		}
+	}
+	if (xQueueSend(lightBarCommandQueue, &command, 0) == pdTRUE) {
+		return true;
+	}
+	if (slot != NULL) {
+		portENTER_CRITICAL(&lightBarCommandSlotLock);
+		slot->isQueued = false;
+		portEXIT_CRITICAL(&lightBarCommandSlotLock);
+	}
+	__atomic_fetch_add(&metrics.lightBarCommandDrops, 1, __ATOMIC_RELAXED);  // sent from several tasks
+	ESP_LOGW("", "Light bar command queue full, dropped command %i", type);
+	return false;
+}
+
+// Gives a command just taken off the queue the newest value of its slot (if it has one), freeing the slot for the next command
+void takeLightBarCommandSlot(LightBarCommand& command) {
+	LightBarCommandSlot* slot = findLightBarCommandSlot(command.type);
+	if (slot == NULL) {
+		return;
+	}
+	portENTER_CRITICAL(&lightBarCommandSlotLock);
+	command.value = slot->value;
+	slot->isQueued = false;
+	portEXIT_CRITICAL(&lightBarCommandSlotLock);
+}
+
+/**
+ * @brief One step of a light bar effect: the whole bar shows (or fades to) a color for a duration.
+ */
+struct LightBarKeyframe {
+	uint8_t red, green, blue;
+	uint16_t duration;	// Milliseconds
+	bool fade;			// Blend from the previous keyframe's color over the duration (the first keyframe fades from black), otherwise hold the color
+};
+
+/**
+ * @brief A timeline of keyframes played one frame at a time by the lightBarTask (so the bar keeps reacting while it plays).
+ * An overlay effect is drawn over the scale (the brighter of the two for each color), otherwise it replaces the scale.
+ */
+struct LightBarEffect {
+	const LightBarKeyframe* keyframes;
+	uint8_t keyframeCount;
+	bool isLooping;	 // Starts again after the last keyframe, until it is stopped
+	bool isOverlay;
+};
+
+const LightBarKeyframe flashRedKeyframes[] = {
+	{0, 0, 0, 500, false},
+	{255, 0, 0, 500, false}
+};
+const LightBarKeyframe purplePulseKeyframes[] = {
+	{MAX_BRIGHTNESS, 0, MAX_BRIGHTNESS, MAX_BRIGHTNESS / 2 * FRAME_TIME, true}
+};
+const LightBarKeyframe greenPulseKeyframes[] = {
+	{0, MAX_BRIGHTNESS, 0, MAX_BRIGHTNESS / 2 * FRAME_TIME, true}
+};
+const LightBarKeyframe rgbTestKeyframes[] = {	// Flash all pixels red, green, blue to test wiring and config is correct
+	{255, 0, 0, 1000, false},
+	{0, 255, 0, 1000, false},
+	{0, 0, 255, 1000, false}
+};
+
+const LightBarEffect flashRedEffect = {flashRedKeyframes, 2, true, false};			 // CO2 is above CO2_MAX (until it drops below)
+const LightBarEffect purplePulseEffect = {purplePulseKeyframes, 1, false, true};	 // A device has connected
+const LightBarEffect greenPulseEffect = {greenPulseKeyframes, 1, false, true};	 // The time has been set via NTP
+const LightBarEffect rgbTestEffect = {rgbTestKeyframes, 3, false, false};
+
+/**
+ * @brief The effect being played and how far through it is.
+ */
+struct LightBarEffectPlayer {
+	const LightBarEffect* effect;  // NULL when no effect is playing
+	uint8_t keyframe;
+	TickType_t keyframeStart;
+	RgbColor fromColor;	 // The color at the end of the previous keyframe
+};
+
+// Starts an effect from its first keyframe (replacing any effect that is playing)
+void playEffect(LightBarEffectPlayer& player, const LightBarEffect& effect) {
+	player.effect = &effect;
+	player.keyframe = 0;
+	player.keyframeStart = xTaskGetTickCount();
+	player.fromColor = RgbColor(0);
+}
+
+// Stops the effect that is playing
+void stopEffect(LightBarEffectPlayer& player) {
+	player.effect = NULL;
+}
+
+/**
+ * @brief Works out the color of the effect for this frame, moving on to the next keyframe when one is finished.
+ * @return False if no effect is playing (or it has just finished)
+ */
+bool getEffectColor(LightBarEffectPlayer& player, RgbColor& color) {
+	while (player.effect != NULL) {
+		const LightBarKeyframe& keyframe = player.effect->keyframes[player.keyframe];
+		RgbColor keyframeColor = RgbColor(keyframe.red, keyframe.green, keyframe.blue);
+		TickType_t elapsed = xTaskGetTickCount() - player.keyframeStart;
+		TickType_t duration = pdMS_TO_TICKS(keyframe.duration);
+
+		if (elapsed < duration) {
+			if (keyframe.fade) {
+				uint8_t progress = (uint8_t)((elapsed * 255) / duration);
+				color = RgbColor(player.fromColor.R + (((int16_t)keyframeColor.R - player.fromColor.R) * progress) / 255,
+								 player.fromColor.G + (((int16_t)keyframeColor.G - player.fromColor.G) * progress) / 255,
+								 player.fromColor.B + (((int16_t)keyframeColor.B - player.fromColor.B) * progress) / 255);
+			} else {
+				color = keyframeColor;
+			}
+			return true;
+		}
+
+		// on to the next keyframe
+		player.fromColor = keyframeColor;
+		player.keyframeStart += duration;
+		player.keyframe++;
+		if (player.keyframe == player.effect->keyframeCount) {
+			if (player.effect->isLooping == false) {
+				player.effect = NULL;
+				return false;
+			}
+			player.keyframe = 0;
+			player.fromColor = RgbColor(0);
+		}
+		if (elapsed > duration + pdMS_TO_TICKS(1000)) {
+			player.keyframeStart = xTaskGetTickCount();	 // the task was held up, don't race through the missed keyframes
+		}
+	}
+	return false;
+}
+
+// Draws the effect color over the pixel buffer (replacing the scale, or keeping the brighter of the two for an overlay)
+void drawEffect(NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod>& lightBar, const LightBarEffect& effect, const RgbColor& color) {
+	if (effect.isOverlay == false) {
+		lightBar.ClearTo(color);
+		return;
+	}
+	for (uint16_t pixel = 0; pixel < lightBar.PixelCount(); pixel++) {
+		RgbColor scaleColor = lightBar.GetPixelColor(pixel);
+		lightBar.SetPixelColor(pixel, RgbColor(max(scaleColor.R, color.R), max(scaleColor.G, color.G), max(scaleColor.B, color.B)));
+	}
+}
+
+// Counts a frame in the frame time histogram of /metrics
+void recordFrameTime(uint32_t frameMicros) {
+	uint8_t bucket = 0;
+	while (bucket < FRAME_HISTOGRAM_BUCKETS && frameMicros > frameHistogramBounds[bucket]) {
+		bucket++;
+	}
+	metrics.frameHistogram[bucket]++;
+	metrics.frameCount++;
+	metrics.frameMicros += frameMicros;
+}
+
+// Counts how far a frame started from FRAME_TIME after the one before it in the jitter histogram
+void recordFrameJitter(int64_t frameIntervalMicros) {
+	uint32_t jitterMicros = (uint32_t)abs(frameIntervalMicros - (int64_t)FRAME_TIME * 1000);
+	uint8_t bucket = 0;
+	while (bucket < FRAME_HISTOGRAM_BUCKETS && jitterMicros > jitterHistogramBounds[bucket]) {
+		bucket++;
+	}
+	metrics.jitterHistogram[bucket]++;
+	metrics.jitterCount++;
+	metrics.jitterMicros += jitterMicros;
+	metrics.maxJitterMicros = max(metrics.maxJitterMicros, jitterMicros);
+}
+
+/**
+ * @brief Carries out one LightBarCommand in the light bar task.
+ * A target above LIGHTBAR_MAX_POSITION flashes red, setting the mode or playing an effect leaves the target alone.
+ */
+void applyLightBarCommand(const LightBarCommand& command, uint16_t& targetPosition, lightBarModes& lightBarMode, uint8_t& brightnessCap) {
+	TRACE(traceLightBarCommand, ((uint32_t)command.type << 16) | command.value);
+	switch (command.type) {
+	case setTargetCommand:
+		recordBootStage(bootFirstCo2OnLightBar);
+		targetPosition = command.value;
+		if (targetPosition > LIGHTBAR_MAX_POSITION) {
+			lightBarMode = flashRed;
+		} else if (lightBarMode == idleFrame) {
+			lightBarMode = lightBarScale;
+		}
+		break;
+
+	case setModeCommand:
+		if (command.value == lightBarScale || command.value == errorRed || command.value == off) {
+			lightBarMode = static_cast<lightBarModes>(command.value);
+		}
+		break;
+
+	case setBrightnessCapCommand:
+		brightnessCap = min(command.value, static_cast<uint16_t>(MAX_BRIGHTNESS));
+		if (lightBarMode == idleFrame) {
+			lightBarMode = lightBarScale;
+		}
+		break;
+
+	case playEffectCommand:
+		if (command.value == flashRed || command.value == purplePulse || command.value == greenPulse || command.value == rgbTest) {
+			lightBarMode = static_cast<lightBarModes>(command.value);
+		}
+		break;
+
+	default:
+		ESP_LOGW("", "Unknown light bar command %i", command.type);
+		break;
+	}
+}
+
+/**
+ * @brief Controls addressable LED pixels and uses the I2C ambient light sensor.
+ * This task controls an LED strip based on readings from an ambient light sensor, adjusting the brightness and position of a color gradient on the strip.
+ * The gradient blends from green to red, and the position is set with a setTargetCommand (see sendLightBarCommand). If the target position is above the maximum position, the strip flashes
+ * red to indicate high CO2 levels. The code initializes the light strip and enters a loop that reads the light sensor, updates the position and brightness,
+ * and shows the effect. There are also modes for testing and flashing a purple pulse.
+ *
+ * The flashes and pulses are keyframe effects (see LightBarEffect) that advance one frame per loop, so a new position, brightness or mode is
+ * picked up within a frame while they play. The pulses are drawn over the scale.
+ *
+ * Other tasks never touch the task's state directly: they queue typed LightBarCommands, which are drained once per frame. Nothing is packed
+ * into bits, so a position of 0 gets through and a mode change can't overwrite a pending position.
+ *
+ * The task only wakes when it has something to do: it blocks on the command queue with a timeout of the next deadline, which is the
+ * next frame while the bar is moving, fading or playing an effect, otherwise the next light sensor reading (every LUX_INTERVAL).
+ *
+ * @param[in] parameter The task parameter (unused).
+ */
+void lightBarTask(void* parameter) {
+	// Create the the lightbar object
+	NeoPixelBus<NeoGrbFeature, NeoEsp32I2s0Ws2812xMethod> lightBar(PIXEL_COUNT + 1, PIXEL_DATA_PIN);  // uses i2s silicon remapped to any pin to drive led data
+
+	//double lux;	 // The measured illumination level in lux.
+
+	uint8_t targetBrightness = MAX_BRIGHTNESS;	// The target brightness value for the light bar, ranging from 0 to 255.
+	uint8_t brightnessCap = MAX_BRIGHTNESS;		// The highest brightness the light bar is allowed, set with setBrightnessCapCommand.
+	uint8_t brightness = 255;					// The current brightness value for the light bar, ranging from 0 to 255.
+
+	uint16_t targetPosition = LIGHTBAR_MAX_POSITION / 3;  // The target position value for the light bar, ranging from 0 to LIGHTBAR_MAX_POSITION.
+	uint16_t position = 0;								  // The current position value for the light bar, ranging from 0 to LIGHTBAR_MAX_POSITION.
+	lightBarModes lightBarMode = lightBarScale;
+
+	LightBarEffectPlayer effectPlayer;	// The effect playing on top of (or instead of) the scale
+	stopEffect(effectPlayer);
+
+	initializeLightBar(lightBar);
+	recordBootStage(bootLightBarStarted);
+	uint8_t lastFrame[(PIXEL_COUNT + 1) * 3] = {0};	 // The pixels last sent to the light bar (3 bytes per pixel, starts black)
+
+	LTR303 lightSensor;
+	uint8_t lightSensorResult = runOnI2cBus(lightBus, startLightSensorJob, &lightSensor);
+
+#ifdef PRODUCTION_TEST
+	if (lightSensorResult != 0) {
+		lightBarMode = errorRed;
+	} else {
+		lightBarMode = rgbTest;
+	}
+#endif
+
+	TickType_t nextLuxTick = xTaskGetTickCount();
+	TickType_t nextBrightnessTick = xTaskGetTickCount();
+	TickType_t nextFrameTick = xTaskGetTickCount();
+	int64_t lastFrameStart = 0;	 // esp_timer time the last frame started (0 after idling, so the wait isn't counted as jitter)
+
+	while (true) {
+		// carry out everything sent since the last frame, in order (so the newest target or mode wins)
+		LightBarCommand command;
+		while (xQueueReceive(lightBarCommandQueue, &command, 0) == pdTRUE) {
+			takeLightBarCommandSlot(command);
+			applyLightBarCommand(command, targetPosition, lightBarMode, brightnessCap);
+		}
+
+		if (ticksUntil(nextLuxTick) == 0) {
+			updateTargetBrightness(lightSensor, targetBrightness);
+			nextLuxTick = xTaskGetTickCount() + pdMS_TO_TICKS(LUX_INTERVAL);
+		}
+		targetBrightness = min(targetBrightness, brightnessCap);
+		if (brightness != targetBrightness && ticksUntil(nextBrightnessTick) == 0) {
+			updateBrightness(brightness, targetBrightness);
+			nextBrightnessTick = xTaskGetTickCount() + pdMS_TO_TICKS(BRIGHTNESS_STEP_TIME);
+			if (lightBarMode == idleFrame) {
+				lightBarMode = lightBarScale;
+			}
+		}
+		//Serial.println(brightness);
+
+		// the modes that start an effect, the scale carries on underneath it
+		switch (lightBarMode) {
+		case flashRed:
+			if (effectPlayer.effect != &flashRedEffect) {
+				playEffect(effectPlayer, flashRedEffect);
+			}
+			lightBarMode = lightBarScale;
+			break;
+
+		case purplePulse:
+			playEffect(effectPlayer, purplePulseEffect);
+			lightBarMode = lightBarScale;
+			break;
+
+		case greenPulse:
+			playEffect(effectPlayer, greenPulseEffect);
+			lightBarMode = lightBarScale;
+			break;
+
+		case rgbTest:
+			playEffect(effectPlayer, rgbTestEffect);
+			lightBarMode = lightBarScale;
+			break;
+
+		default:
+			break;
+		}
+
+		if (effectPlayer.effect == &flashRedEffect && targetPosition < LIGHTBAR_MAX_POSITION) {
+			stopEffect(effectPlayer);
+			position = LIGHTBAR_MAX_POSITION;
+			brightness = MAX_BRIGHTNESS;
+			lightBarMode = lightBarScale;
+		}
+
+		switch (lightBarMode) {
+		case idleFrame: {
+			// nothing is changing, sleep until told otherwise (or it is time to check the light level)
+			TickType_t timeout = ticksUntil(nextLuxTick);
+			if (brightness != targetBrightness) {
+				timeout = min(timeout, ticksUntil(nextBrightnessTick));
+			}
+			lightBarIdle = true;
+			xQueuePeek(lightBarCommandQueue, &command, timeout);  // left on the queue for the top of the loop
+			lightBarIdle = false;
+			lastFrameStart = 0;
+			continue;
+		}
+
+		case lightBarScale: {
+			int64_t frameStart = esp_timer_get_time();
+			if (lastFrameStart != 0) {
+				recordFrameJitter(frameStart - lastFrameStart);
+			}
+			lastFrameStart = frameStart;
+			bool isMoving = false;
+			if (effectPlayer.effect != &flashRedEffect) {
+				isMoving = updatePosition(position, targetPosition);
+			}
+			drawLightBar(lightBar, position, brightness);
+
+			RgbColor effectColor;
+			const LightBarEffect* effect = effectPlayer.effect;
+			if (effect != NULL && getEffectColor(effectPlayer, effectColor)) {
+				drawEffect(lightBar, *effect, effectColor);
+			}
+			bool isShown = showIfChanged(lightBar, lastFrame);
+			uint32_t frameMicros = (uint32_t)(esp_timer_get_time() - frameStart);
+			recordFrameTime(frameMicros);
+			if (isShown) {
+				TRACE(traceFrameShown, frameMicros);
+			}
+
+			if (isMoving == false && effectPlayer.effect == NULL) {  // also covers targets outside the bar, which position never equals
+				lightBarMode = idleFrame;
+			}
+			break;
+		}
+
+		case errorRed:
+			stopEffect(effectPlayer);
+			lightBar.ClearTo(RgbColor(MAX_BRIGHTNESS, 0, 0));
+			showFrame(lightBar, lastFrame);
+			lightBarIdle = true;
+			vTaskSuspend(NULL);
+			lightBarIdle = false;
+			lastFrameStart = 0;
+			break;
+
+		case off:
+			stopEffect(effectPlayer);
+			lightBar.ClearTo(RgbColor(0));
+			showFrame(lightBar, lastFrame);
+			lightBarIdle = true;
+			vTaskSuspend(NULL);
+			lightBarIdle = false;
+			lastFrameStart = 0;
+			break;
+
+		default:
+			break;
+		}
+
+		// frames start every FRAME_TIME however long they took, commands sent during the frame are picked up at the start of the next one
+		nextFrameTick += pdMS_TO_TICKS(FRAME_TIME);
+		TickType_t frameWait = ticksUntil(nextFrameTick);
+		if (frameWait == 0) {
+			// behind (after idling, being suspended or a slow frame), start counting again from now
+			frameWait = pdMS_TO_TICKS(FRAME_TIME);
+			nextFrameTick = xTaskGetTickCount() + frameWait;
+		}
+		vTaskDelay(frameWait);
+	}
+}
+
+// Callback function (get's called when time adjusts via NTP)
+void onTimeAvailable(struct timeval* t) {
+	vTaskResume(lightBar);
+	sendLightBarCommand(playEffectCommand, greenPulse);
+#ifndef OTA
+	WiFi.disconnect();
+#endif
+
+	time_t epoch;
+	struct tm gmt;
+	time(&epoch);
+	gmtime_r(&epoch, &gmt);
+	Serial.println(&gmt, "\n\rGMT Time Set: %A, %B %d %Y %H:%M:%S\n\r");
+}
+
+void initializeNTPClient() {
+	// Define the NTP servers to be used for time synchronization
+	const char* ntpServer1 = "pool.ntp.org";
+	const char* ntpServer2 = "time.nist.gov";
+	const char* ntpServer3 = "time.google.com";
+
+	sntp_set_time_sync_notification_cb(onTimeAvailable);
+
+	configTzTime(time_zone, ntpServer1, ntpServer2, ntpServer3);
+}
+
+#define DNS_PORT 53
+#define DNS_TTL 3600			  // Seconds a client may cache an answer
+#define DNS_HEADER_BYTES 12
+#define DNS_MAX_PACKET_BYTES 512  // Largest DNS message over plain UDP
+#define DNS_TYPE_A 1
+#define DNS_TYPE_ANY 255
+
+AsyncUDP dnsResponder;	// Answers every DNS query with localIP (the captive portal), only listening while a station is connected
+uint8_t dnsAnswer[16];	// The answer record at the end of every reply, see startDnsResponder
+
+/**
+ * @brief Answers one DNS query as it arrives (runs in the AsyncUDP task, nothing polls for packets).
+ * The reply is the query's header and question followed by the dnsAnswer template, so every name resolves to localIP.
+ * Questions for other record types (AAAA, ...) get an empty answer rather than a wrong one.
+ */
+void answerDnsQuery(AsyncUDPPacket& packet) {
+	const uint8_t* query = packet.data();
+	size_t length = packet.length();
+	if (length < DNS_HEADER_BYTES || (query[2] & 0xF8) != 0 || query[4] != 0 || query[5] != 1) {
+		return;	 // not a standard query with one question
+	}
+
+	// the question is the name's labels, then the root label, type and class
+	size_t offset = DNS_HEADER_BYTES;
+	while (offset < length && query[offset] != 0) {
+		if ((query[offset] & 0xC0) != 0) {
+			return;	 // questions don't use compressed names
+		}
+		offset += query[offset] + 1;
+	}
+	offset += 1 + 4;
+	if (offset > length || offset + sizeof(dnsAnswer) > DNS_MAX_PACKET_BYTES) {
+		return;
+	}
+	uint16_t type = (query[offset - 4] << 8) | query[offset - 3];
+
+	static uint8_t reply[DNS_MAX_PACKET_BYTES];	 // only the AsyncUDP task uses it (one packet at a time)
+	memcpy(reply, query, offset);
+	reply[2] = 0x84 | (query[2] & 0x01);  // a response, authoritative, recursion desired copied from the query
+	reply[3] = 0x00;					  // recursion not available, no error
+	memset(reply + 6, 0, 6);			  // no answer, authority or additional records (any EDNS record is left off)
+	size_t replyLength = offset;
+	if (type == DNS_TYPE_A || type == DNS_TYPE_ANY) {
+		reply[7] = 1;
+		memcpy(reply + offset, dnsAnswer, sizeof(dnsAnswer));
+		replyLength += sizeof(dnsAnswer);
+	}
+	packet.write(reply, replyLength);
+}
+
+// Builds the answer template and sets up the DNS responder (it starts listening when the first station connects)
+void startDnsResponder(const IPAddress& localIP) {
+	const uint8_t answer[sizeof(dnsAnswer)] = {
+		0xC0, DNS_HEADER_BYTES,																	  // name: a pointer to the question's name
+		0x00, DNS_TYPE_A,																		  // type
+		0x00, 0x01,																				  // class IN
+		(uint8_t)(DNS_TTL >> 24), (uint8_t)(DNS_TTL >> 16), (uint8_t)(DNS_TTL >> 8), (uint8_t)DNS_TTL,	  // ttl
+		0x00, 0x04,																				  // 4 byte address
+		localIP[0], localIP[1], localIP[2], localIP[3]};
+	memcpy(dnsAnswer, answer, sizeof(dnsAnswer));
+	dnsResponder.onPacket(answerDnsQuery);
+}
+
+// A station joined the access point, the first one starts the DNS responder
+void onClientConnected(WiFiEvent_t event) {
+	sendLightBarCommand(playEffectCommand, purplePulse);
+	if (dnsResponder.connected() == false && dnsResponder.listen(DNS_PORT) == false) {
+		ESP_LOGE("", "DNS responder could not listen on port %u", DNS_PORT);
+	}
+}
+
+// A station left the access point, the DNS responder goes quiet once there are none left
+void onClientDisconnected(WiFiEvent_t event) {
+	if (WiFi.softAPgetStationNum() == 0) {
+		dnsResponder.close();
+	}
+}
+
+void startSoftAccessPoint(const char* password, const IPAddress& localIP, const IPAddress& gatewayIP) {
+	// Define the maximum number of clients that can connect to the server
+	const uint8_t MAX_CLIENTS = 4;
+
+	// Set the WiFi mode to access point and station (this initializes the WiFi driver)
+	WiFi.mode(WIFI_MODE_APSTA);
+
+	// Disable AMPDU RX on the ESP32 WiFi to fix a bug on Android. The Arduino core always initializes the driver with the
+	// default config, so it is initialized again with AMPDU RX off before the access point is configured and started
+	// (the access point only comes up once, so there is no need to wait for it to settle).
+	esp_wifi_stop();
+	esp_wifi_deinit();
+	wifi_init_config_t wifiConfig = WIFI_INIT_CONFIG_DEFAULT();
+	wifiConfig.ampdu_rx_enable = false;
+	esp_wifi_init(&wifiConfig);
+	esp_wifi_set_mode(WIFI_MODE_APSTA);
+	esp_wifi_start();
+
+	// Define the subnet mask for the WiFi network
+	const IPAddress subnetMask(255, 255, 255, 0);
+
+	// Configure the soft access point with a specific IP and subnet mask
+	WiFi.softAPConfig(localIP, gatewayIP, subnetMask);
+
+	// Generate a unique SSID based on the ESP32's MAC address
+	char uniqueSSID[18] = { 0 };
+	uint8_t mac[6];
 	esp_read_mac(mac, ESP_MAC_WIFI_STA);
 	snprintf(uniqueSSID, sizeof(uniqueSSID), "Kea-CO2-%02X", mac[5]);
 
 	// Start the soft access point with the generated SSID, password, channel, and max number of clients
 	WiFi.softAP(uniqueSSID, password, WIFI_CHANNEL, 0, MAX_CLIENTS);
+	metrics.radioOnSince = esp_timer_get_time();
+	metrics.accessPointWindows++;
+	accessPointOn = true;
 
-	// Disable AMPDU RX on the ESP32 WiFi to fix a bug on Android
-	esp_wifi_stop();
-	esp_wifi_deinit();
-	wifi_init_config_t my_config = WIFI_INIT_CONFIG_DEFAULT();
-	my_config.ampdu_rx_enable = false;
-	esp_wifi_init(&my_config);
+	// Register event handlers for when a station connects to or leaves the soft AP
+	WiFi.onEvent(onClientConnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STACONNECTED);
+	WiFi.onEvent(onClientDisconnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STADISCONNECTED);
+}
+
+// -----------------------------------------
+//
+//    Power Management
+//
+// -----------------------------------------
+
+#ifdef LOW_POWER
+// When the access point is up for (see dutyCycleAccessPoint), times are esp_timer seconds as the tick count stops in light sleep
+struct AccessPointSchedule {
+	uint32_t downAt;		// the window ends (the access point stays up while a station is still connected)
+	uint32_t nextWindowAt;	// the next scheduled window starts (unused when ACCESS_POINT_SCHEDULE_SECONDS is 0)
+};
+
+// Seconds since boot, carried on through light sleep
+uint32_t uptimeSeconds() {
+	return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+// The button was pressed, the webserver task brings the access point up
+void IRAM_ATTR onAccessPointButton() {
+	BaseType_t higherPriorityTaskWoken = pdFALSE;
+	vTaskNotifyGiveFromISR(webserver, &higherPriorityTaskWoken);
+	if (higherPriorityTaskWoken == pdTRUE) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+// Starts the radio again (the driver keeps the access point config while it is stopped)
+void resumeAccessPoint() {
+	if (accessPointOn == true) {
+		return;
+	}
 	esp_wifi_start();
-	vTaskDelay(pdMS_TO_TICKS(100));  // Add a small delay
+	metrics.radioOnSince = esp_timer_get_time();
+	metrics.accessPointWindows++;
+	accessPointOn = true;
+	xTaskNotify(csvFileManager, flushLogNotification, eSetBits);  // so a download has the records waiting in RTC memory
+	ESP_LOGI("", "Access point up");
+}
 
-	// Register an event handler for when a station connects to the soft AP
-	WiFi.onEvent(onClientConnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STACONNECTED);
+// Stops the radio, the SoC can light sleep again
+void suspendAccessPoint() {
+	if (accessPointOn == false) {
+		return;
+	}
+	dnsResponder.close();
+	esp_wifi_stop();
+	accessPointOn = false;
+	metrics.radioOnMicros += (uint64_t)(esp_timer_get_time() - metrics.radioOnSince);
+	metrics.radioOnSince = 0;
+	ESP_LOGI("", "Access point down");
+}
+
+// Opens the first window (the access point comes up at boot) and sets up the button
+void startAccessPointSchedule(AccessPointSchedule& schedule) {
+	schedule.downAt = uptimeSeconds() + ACCESS_POINT_AWAKE_SECONDS;
+	schedule.nextWindowAt = uptimeSeconds() + ACCESS_POINT_SCHEDULE_SECONDS;
+	pinMode(ACCESS_POINT_BUTTON_PIN, INPUT_PULLUP);
+	attachInterrupt(digitalPinToInterrupt(ACCESS_POINT_BUTTON_PIN), onAccessPointButton, FALLING);
+}
+
+/**
+ * @brief Waits up to ACCESS_POINT_CHECK_INTERVAL for the button, then brings the access point up or takes it down.
+ * A button press or a scheduled window keeps the access point up for ACCESS_POINT_AWAKE_SECONDS, after that the radio is
+ * stopped once no station is connected.
+ */
+void dutyCycleAccessPoint(AccessPointSchedule& schedule) {
+	bool isPressed = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ACCESS_POINT_CHECK_INTERVAL)) > 0;
+	uint32_t now = uptimeSeconds();
+	bool isScheduled = ACCESS_POINT_SCHEDULE_SECONDS > 0 && (int32_t)(now - schedule.nextWindowAt) >= 0;
+
+	if (isPressed || isScheduled) {
+		resumeAccessPoint();
+		schedule.downAt = now + ACCESS_POINT_AWAKE_SECONDS;
+		if (isScheduled) {
+			schedule.nextWindowAt = now + ACCESS_POINT_SCHEDULE_SECONDS;
+		}
+	} else if (accessPointOn == true && (int32_t)(now - schedule.downAt) >= 0 && WiFi.softAPgetStationNum() == 0) {
+		suspendAccessPoint();
+	}
+}
+
+// Nothing needs the SoC awake: the radio is stopped and the light bar is waiting for a command
+bool canLightSleep() {
+	return accessPointOn == false && lightBarIdle == true;
+}
+
+// Light sleeps for up to sleepMicros (the button wakes the SoC early and brings the access point up)
+void lightSleep(int64_t sleepMicros) {
+	const gpio_num_t buttonPin = (gpio_num_t)ACCESS_POINT_BUTTON_PIN;
+	esp_sleep_enable_timer_wakeup((uint64_t)sleepMicros);
+	gpio_wakeup_enable(buttonPin, GPIO_INTR_LOW_LEVEL);
+	esp_sleep_enable_gpio_wakeup();
+
+	int64_t sleepStart = esp_timer_get_time();
+	esp_light_sleep_start();
+	metrics.lightSleepMicros += (uint64_t)(esp_timer_get_time() - sleepStart);
+	metrics.lightSleeps++;
+
+	gpio_wakeup_disable(buttonPin);	 // the wake up takes over the pin's interrupt, put the button's back
+	gpio_set_intr_type(buttonPin, GPIO_INTR_NEGEDGE);
+	if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+		xTaskNotifyGive(webserver);
+	}
+}
+#endif
+
+/**
+ * @brief Waits until deadline, light sleeping through the wait in LOW_POWER builds whenever canLightSleep.
+ * The tick count doesn't move while the SoC sleeps, so the wait is timed with esp_timer (which does). Deadlines in ticks
+ * stay consistent with each other, they are all just later by the time spent asleep.
+ */
+void sleepUntilTick(TickType_t deadline) {
+#ifdef LOW_POWER
+	int64_t wakeTime = esp_timer_get_time() + (int64_t)ticksUntil(deadline) * portTICK_PERIOD_MS * 1000;
+	if (wakeTime - esp_timer_get_time() > (int64_t)(LIGHT_SLEEP_MIN_TIME + LIGHT_SLEEP_SETTLE_TIME) * 1000) {
+		vTaskDelay(pdMS_TO_TICKS(LIGHT_SLEEP_SETTLE_TIME));	 // the other tasks finish with the sample that was just published
+	}
+
+	int64_t remainingMicros;
+	while ((remainingMicros = wakeTime - esp_timer_get_time()) > 0) {
+		if (remainingMicros > (int64_t)LIGHT_SLEEP_MIN_TIME * 1000 && canLightSleep()) {
+			lightSleep(remainingMicros);
+		} else {
+			uint32_t waitMillis = min((uint32_t)(remainingMicros / 1000) + 1, (uint32_t)ACCESS_POINT_CHECK_INTERVAL);
+			vTaskDelay(max(pdMS_TO_TICKS(waitMillis), (TickType_t)1));	// checked again in case the radio has gone down
+		}
+	}
+#else
+	vTaskDelay(ticksUntil(deadline));
+#endif
+}
+
+// -----------------------------------------
+//
+//    Fleet
+//
+// -----------------------------------------
+
+#ifdef FLEET_LEAF
+const uint8_t fleetBroadcastAddress[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// Starts the radio on WIFI_CHANNEL for ESP-NOW only (the station never joins a network), returns false if it didn't start
+bool startFleetRadio() {
+	WiFi.mode(WIFI_STA);
+	esp_wifi_set_channel(WIFI_CHANNEL, WIFI_SECOND_CHAN_NONE);
+	if (esp_now_init() != ESP_OK) {
+		return false;
+	}
+
+	esp_now_peer_info_t peer;
+	memset(&peer, 0, sizeof(peer));
+	memcpy(peer.peer_addr, fleetBroadcastAddress, sizeof(fleetBroadcastAddress));
+	peer.channel = WIFI_CHANNEL;
+	peer.ifidx = WIFI_IF_STA;
+	peer.encrypt = false;
+	return esp_now_add_peer(&peer) == ESP_OK;
+}
+
+/**
+ * @brief Broadcasts each new sample to the gateway as a FleetPacket (FLEET_LEAF builds run this instead of the webserver
+ * and sample ring tasks, the log in flash is still kept).
+ * @param[in] parameter The task parameter (unused).
+ */
+void fleetLeafTask(void* parameter) {
+	if (startFleetRadio() == false) {
+		ESP_LOGE("", "ESP-NOW did not start");
+		sendLightBarCommand(setModeCommand, errorRed);
+		vTaskSuspend(NULL);
+	}
+	recordBootStage(bootWifiStarted);
+
+	uint32_t prevSequence = 0;
+	Sample sample;
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (xQueuePeek(sampleMailbox, &sample, 0) == pdTRUE && sample.sequence != prevSequence) {
+			prevSequence = sample.sequence;
+			FleetPacket packet = toFleetPacket(sample, FLEET_ROOM);
+			if (esp_now_send(fleetBroadcastAddress, (const uint8_t*)&packet, sizeof(packet)) != ESP_OK) {
+				metrics.fleetSendErrors++;
+				ESP_LOGW("", "Sample %u was not broadcast", sample.sequence);
+			}
+		}
+	}
+}
+#endif
+
+#ifdef FLEET_GATEWAY
+FleetLeaf fleetLeaves[FLEET_MAX_LEAVES];  // The samples heard from each leaf (only written by fleetGatewayTask)
+SemaphoreHandle_t fleetMutex;			  // Held while a leaf's ring is written or read
+QueueHandle_t fleetPacketQueue;			  // FleetArrivals from the ESP-NOW callback for fleetGatewayTask
+
+struct FleetArrival {
+	uint8_t mac[6];
+	FleetPacket packet;
+};
+
+// Runs in the WiFi task for every ESP-NOW packet, so it only checks the packet and queues it for fleetGatewayTask
+void onFleetPacket(const uint8_t* mac, const uint8_t* data, int length) {
+	if (isFleetPacket(data, length) == false) {
+		return;
+	}
+	FleetArrival arrival;
+	memcpy(arrival.mac, mac, sizeof(arrival.mac));
+	memcpy(&arrival.packet, data, sizeof(arrival.packet));
+	if (xQueueSend(fleetPacketQueue, &arrival, 0) != pdTRUE) {
+		metrics.fleetQueueDrops++;
+	}
+}
+
+// Starts listening for the leaves (on the access point's channel, so after startSoftAccessPoint)
+void startFleetGateway() {
+	if (esp_now_init() != ESP_OK || esp_now_register_recv_cb(onFleetPacket) != ESP_OK) {
+		ESP_LOGE("", "ESP-NOW did not start, no leaves will be heard");
+	}
+}
+
+/**
+ * @brief Adds each packet heard from a leaf to that leaf's ring (FLEET_GATEWAY builds).
+ * @param[in] parameter The task parameter (unused).
+ */
+void fleetGatewayTask(void* parameter) {
+	FleetArrival arrival;
+	while (true) {
+		xQueueReceive(fleetPacketQueue, &arrival, portMAX_DELAY);
+		time_t now;
+		time(&now);
+
+		xSemaphoreTake(fleetMutex, portMAX_DELAY);
+		uint8_t id = findFleetLeaf(fleetLeaves, FLEET_MAX_LEAVES, arrival.mac);
+		FleetLeaf& leaf = fleetLeaves[id];
+		if (leaf.isUsed == false || memcmp(leaf.mac, arrival.mac, sizeof(leaf.mac)) != 0) {
+			startFleetLeaf(leaf, arrival.mac);
+			ESP_LOGI("", "Leaf %02X%02X%02X%02X%02X%02X joined", arrival.mac[0], arrival.mac[1], arrival.mac[2], arrival.mac[3], arrival.mac[4], arrival.mac[5]);
+		}
+		if (addFleetPacket(leaf, arrival.packet, (uint32_t)now) == false) {
+			metrics.fleetRepeats++;
+		}
+		xSemaphoreGive(fleetMutex);
+	}
+}
+
+// Writes a leaf's MAC address as 12 hex digits (its device id in /fleet.json)
+void formatFleetDevice(char* buffer, const uint8_t* mac) {
+	sprintf(buffer, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+// Parses a device id back into a MAC address, returns false if it isn't 12 hex digits
+bool parseFleetDevice(const char* text, uint8_t* mac) {
+	if (strlen(text) != 12) {
+		return false;
+	}
+	for (uint8_t i = 0; i < 6; i++) {
+		char byteText[3] = {text[i * 2], text[i * 2 + 1], '\0'};
+		char* end;
+		mac[i] = (uint8_t)strtoul(byteText, &end, 16);
+		if (*end != '\0') {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief The state of one /fleet/history response being streamed out of a leaf's ring ([[epoch,co2,humidity,temperature],...]
+ * oldest first, as graphed). Like SampleRingJsonStream the points are copied out FLEET_STREAM_BATCH at a time, and
+ * the response ends early if the leaf's slot is given to another leaf part way through.
+ */
+struct FleetHistoryStream {
+	uint8_t id;						// slot of the leaf in fleetLeaves
+	uint8_t mac[6];					// the leaf (so a slot that changes hands is noticed)
+	uint32_t nextSequence;
+	uint32_t endSequence;
+	bool isFirstPoint;
+	bool isDone;
+
+	uint32_t batchEpoch[FLEET_STREAM_BATCH];
+	uint16_t batchCo2[FLEET_STREAM_BATCH];
+	int16_t batchHumidity[FLEET_STREAM_BATCH];
+	int16_t batchTemperature[FLEET_STREAM_BATCH];
+	uint8_t batchCount;
+	uint8_t batchIndex;
+
+	char token[64];
+	uint8_t tokenLength;
+	uint8_t tokenOffset;
+};
+
+// Takes a snapshot of the points of a leaf newer than sinceEpoch, returns false if there is no such leaf or it is busy
+bool startFleetHistoryStream(FleetHistoryStream& stream, const uint8_t* mac, uint32_t sinceEpoch) {
+	if (xSemaphoreTake(fleetMutex, 10 / portTICK_PERIOD_MS) == pdFALSE) {
+		return false;
+	}
+	uint8_t id = findFleetLeaf(fleetLeaves, FLEET_MAX_LEAVES, mac);
+	const FleetLeaf& leaf = fleetLeaves[id];
+	bool isFound = leaf.isUsed && memcmp(leaf.mac, mac, sizeof(leaf.mac)) == 0;
+	if (isFound) {
+		stream.nextSequence = findFirstFleetSequenceAfter(leaf, sinceEpoch);
+		stream.endSequence = leaf.sequence;
+	}
+	xSemaphoreGive(fleetMutex);
+
+	stream.id = id;
+	memcpy(stream.mac, mac, sizeof(stream.mac));
+	stream.isFirstPoint = true;
+	stream.isDone = false;
+	stream.batchCount = 0;
+	stream.batchIndex = 0;
+	stream.tokenLength = sprintf(stream.token, "[");
+	stream.tokenOffset = 0;
+	return isFound;
+}
+
+// Copies the next batch of points out of the leaf's ring, returns false if it is busy
+bool copyFleetHistoryBatch(FleetHistoryStream& stream) {
+	if (xSemaphoreTake(fleetMutex, 0) == pdFALSE) {
+		return false;
+	}
+	const FleetLeaf& leaf = fleetLeaves[stream.id];
+	stream.batchCount = 0;
+	stream.batchIndex = 0;
+	if (leaf.isUsed && memcmp(leaf.mac, stream.mac, sizeof(stream.mac)) == 0) {
+		uint32_t oldestSequence = leaf.sequence - leaf.count;
+		if (stream.nextSequence < oldestSequence) {
+			stream.nextSequence = oldestSequence;
+		}
+		while (stream.batchCount < FLEET_STREAM_BATCH && stream.nextSequence < stream.endSequence) {
+			uint16_t index = fleetSequenceToIndex(leaf, stream.nextSequence);
+			stream.batchEpoch[stream.batchCount] = leaf.epoch[index];
+			stream.batchCo2[stream.batchCount] = leaf.co2[index];
+			stream.batchHumidity[stream.batchCount] = leaf.humidity[index];
+			stream.batchTemperature[stream.batchCount] = leaf.temperature[index];
+			stream.batchCount++;
+			stream.nextSequence++;
+		}
+	}
+	xSemaphoreGive(fleetMutex);
+	return true;
+}
+
+// Produces the next point (or the closing bracket) of a /fleet/history response into stream.token
+streamTokenResults nextFleetHistoryToken(FleetHistoryStream& stream) {
+	stream.tokenOffset = 0;
+	stream.tokenLength = 0;
+	if (stream.isDone) {
+		return tokenDone;
+	}
+	if (stream.batchIndex == stream.batchCount) {
+		if (stream.nextSequence < stream.endSequence && copyFleetHistoryBatch(stream) == false) {
+			return tokenTryAgain;
+		}
+		if (stream.batchCount == 0) {
+			stream.tokenLength = sprintf(stream.token, "]");
+			stream.isDone = true;
+			return tokenReady;
+		}
+	}
+
+	uint8_t i = stream.batchIndex++;
+	int length = sprintf(stream.token, "%s[%u,%u,", stream.isFirstPoint ? "" : ",", stream.batchEpoch[i], stream.batchCo2[i]);
+	length += formatGraphValue(stream.token + length, humidityChannel, toGraphValue(humidityChannel, stream.batchHumidity[i]));
+	length += sprintf(stream.token + length, ",");
+	length += formatGraphValue(stream.token + length, temperatureChannel, toGraphValue(temperatureChannel, stream.batchTemperature[i]));
+	length += sprintf(stream.token + length, "]");
+	stream.tokenLength = length;
+	stream.isFirstPoint = false;
+	return tokenReady;
+}
+
+// Fills one chunk of a /fleet/history response (AwsResponseFiller for beginChunkedResponse)
+size_t fillFleetHistory(FleetHistoryStream& stream, uint8_t* buffer, size_t maxLen) {
+	size_t bytesWritten = 0;
+
+	while (bytesWritten < maxLen) {
+		if (stream.tokenOffset == stream.tokenLength) {
+			streamTokenResults result = nextFleetHistoryToken(stream);
+			if (result == tokenTryAgain && bytesWritten == 0) {
+				return RESPONSE_TRY_AGAIN;
+			} else if (result != tokenReady) {
+				break;
+			}
+		}
+
+		size_t length = min((size_t)(stream.tokenLength - stream.tokenOffset), maxLen - bytesWritten);
+		memcpy(buffer + bytesWritten, stream.token + stream.tokenOffset, length);
+		stream.tokenOffset += length;
+		bytesWritten += length;
+	}
+	return bytesWritten;
+}
+#endif
+
+// Counts a filled chunk of a route's response in the metrics, returns bytes so it can wrap the filler
+size_t recordRouteFill(metricRoutes route, int64_t fillStart, size_t bytes) {
+	RouteMetrics& routeMetrics = metrics.routes[route];
+	uint32_t fillMicros = (uint32_t)(esp_timer_get_time() - fillStart);
+	routeMetrics.fills++;
+	if (bytes != RESPONSE_TRY_AGAIN) {
+		routeMetrics.bytes += bytes;
+	}
+	routeMetrics.fillMicros += fillMicros;
+	routeMetrics.maxFillMicros = max(routeMetrics.maxFillMicros, fillMicros);
+	TRACE(traceHttpFill, ((uint32_t)route << 24) | bytes);
+	return bytes;
+}
+
+// Prints the unused stack of a task (NULL for the calling task)
+void printTaskStack(Print& output, TaskHandle_t task) {
+	output.printf("kea_task_stack_free_bytes{task=\"%s\"} %u\n", pcTaskGetName(task), uxTaskGetStackHighWaterMark(task));
+}
+
+// Prints the core a task is pinned to (-1 if it can run on either, see Task Plan)
+void printTaskCore(Print& output, TaskHandle_t task) {
+	BaseType_t core = xTaskGetAffinity(task);
+	output.printf("kea_task_core{task=\"%s\"} %i\n", pcTaskGetName(task), (core == tskNO_AFFINITY) ? -1 : (int)core);
+}
+
+// Prints the priority of a task
+void printTaskPriority(Print& output, TaskHandle_t task) {
+	output.printf("kea_task_priority{task=\"%s\"} %u\n", pcTaskGetName(task), uxTaskPriorityGet(task));
+}
+
+// Prints one line for each of our tasks, the I2C bus tasks and the task running the webserver callbacks (async_tcp)
+void printTaskMetric(Print& output, void (*printTask)(Print&, TaskHandle_t)) {
+	TaskHandle_t tasks[] = {lightBar, sensorManager, jsonFileManager, csvFileManager, webserver, exporter, fleet};
+	for (uint8_t i = 0; i < sizeof(tasks) / sizeof(tasks[0]); i++) {
+		if (tasks[i] != NULL) {
+			printTask(output, tasks[i]);
+		}
+	}
+	for (uint8_t id = 0; id < I2C_BUS_COUNT; id++) {
+		if (i2cBuses[id].task != NULL) {
+			printTask(output, i2cBuses[id].task);
+		}
+	}
+	printTask(output, NULL);
+}
+
+// Average current of the SCD4x in a measurement mode (see Power Config)
+uint32_t scd4xMicroamps(uint8_t mode) {
+	switch (mode) {
+	case scd4xLowPowerPeriodic:
+		return SCD4X_LOW_POWER_MICROAMPS;
+	case scd4xSingleShot:
+		return SCD4X_SINGLE_SHOT_MICROAMPS;
+	default:
+		return SCD4X_PERIODIC_MICROAMPS;
+	}
+}
+
+/**
+ * @brief Prints the time in each power state and the average current since boot estimated from it (see Power Config).
+ * The SoC is radioOn while the access point is up, lightSleep while sleeping and awake the rest of the time. The mode
+ * info says which configuration the averages belong to, so units built differently can be compared.
+ */
+void printPowerMetrics(Print& output) {
+	const char* scd4xModeNames[] = {"periodic", "lowPowerPeriodic", "singleShot"};
+	int64_t now = esp_timer_get_time();
+	int64_t radioOnSince = metrics.radioOnSince;
+	uint64_t radioOnMicros = metrics.radioOnMicros + (radioOnSince != 0 ? (uint64_t)(now - radioOnSince) : 0);
+	uint64_t sleepMicros = metrics.lightSleepMicros;
+	uint64_t awakeMicros = (uint64_t)now > radioOnMicros + sleepMicros ? (uint64_t)now - radioOnMicros - sleepMicros : 0;
+	uint64_t lightBarCharge = metrics.lightBarCharge;
+	if (metrics.lightBarMicroampsSince != 0) {
+		lightBarCharge += (uint64_t)metrics.lightBarMicroamps * (uint64_t)(now - metrics.lightBarMicroampsSince);
+	}
+
+	uint64_t socCharge = radioOnMicros * RADIO_ON_MICROAMPS + awakeMicros * AWAKE_MICROAMPS + sleepMicros * LIGHT_SLEEP_MICROAMPS;
+	uint32_t socMicroamps = (uint32_t)(socCharge / (uint64_t)now);
+	uint32_t lightBarMicroamps = (uint32_t)(lightBarCharge / (uint64_t)now);
+	uint32_t sensorMicroamps = scd4xMicroamps(metrics.scd4xMode);
+
+#ifdef LOW_POWER
+	const char* powerMode = "lowPower";
+#else
+	const char* powerMode = "alwaysOn";
+#endif
+	output.printf("# TYPE kea_power_mode_info gauge\nkea_power_mode_info{mode=\"%s\",scd4x=\"%s\"} 1\n", powerMode,
+				  scd4xModeNames[metrics.scd4xMode]);
+
+	output.print("# TYPE kea_power_state_seconds_total counter\n");
+	output.printf("kea_power_state_seconds_total{state=\"radioOn\"} %.3f\n", radioOnMicros / 1e6);
+	output.printf("kea_power_state_seconds_total{state=\"awake\"} %.3f\n", awakeMicros / 1e6);
+	output.printf("kea_power_state_seconds_total{state=\"lightSleep\"} %.3f\n", sleepMicros / 1e6);
+	output.printf("# TYPE kea_light_sleeps_total counter\nkea_light_sleeps_total %u\n", metrics.lightSleeps);
+	output.printf("# TYPE kea_access_point_windows_total counter\nkea_access_point_windows_total %u\n", metrics.accessPointWindows);
+#ifdef LOW_POWER
+	output.printf("# TYPE kea_log_batch_records gauge\nkea_log_batch_records %u\n", rtcLogBatch.count);
+#endif
+
+	output.print("# TYPE kea_power_estimated_average_milliamps gauge\n");
+	output.printf("kea_power_estimated_average_milliamps{part=\"soc\"} %.2f\n", socMicroamps / 1000.0);
+	output.printf("kea_power_estimated_average_milliamps{part=\"lightBar\"} %.2f\n", lightBarMicroamps / 1000.0);
+	output.printf("kea_power_estimated_average_milliamps{part=\"co2Sensor\"} %.2f\n", sensorMicroamps / 1000.0);
+	output.printf("kea_power_estimated_average_milliamps{part=\"total\"} %.2f\n", (socMicroamps + lightBarMicroamps + sensorMicroamps) / 1000.0);
+}
+
+/**
+ * @brief Prints every counter in the Prometheus text format.
+ * Times are in microseconds (kept as integers), the stack of each task is the least it has had free since it started.
+ */
+void printMetrics(Print& output) {
+	output.printf("# TYPE kea_uptime_seconds counter\nkea_uptime_seconds %lu\n", millis() / 1000);
+
+	output.print("# TYPE kea_boot_stage_microseconds gauge\n");
+	for (uint8_t stage = 0; stage < BOOT_STAGE_COUNT; stage++) {
+		if (metrics.bootStageMicros[stage] != 0) {
+			output.printf("kea_boot_stage_microseconds{stage=\"%s\"} %u\n", bootStageNames[stage], metrics.bootStageMicros[stage]);
+		}
+	}
+
+	output.print("# TYPE kea_task_stack_free_bytes gauge\n");
+	printTaskMetric(output, printTaskStack);
+	output.print("# TYPE kea_task_core gauge\n");
+	printTaskMetric(output, printTaskCore);
+	output.print("# TYPE kea_task_priority gauge\n");
+	printTaskMetric(output, printTaskPriority);
+
+#if configGENERATE_RUN_TIME_STATS == 1
+	// CPU time per task, only if the FreeRTOS config keeps run time stats
+	UBaseType_t taskCount = uxTaskGetNumberOfTasks();
+	TaskStatus_t* taskStatus = (TaskStatus_t*)malloc(taskCount * sizeof(TaskStatus_t));
+	if (taskStatus != NULL) {
+		taskCount = uxTaskGetSystemState(taskStatus, taskCount, NULL);
+		output.print("# TYPE kea_task_runtime_total counter\n");
+		for (UBaseType_t i = 0; i < taskCount; i++) {
+			output.printf("kea_task_runtime_total{task=\"%s\"} %u\n", taskStatus[i].pcTaskName, taskStatus[i].ulRunTimeCounter);
+		}
+		free(taskStatus);
+	}
+#endif
+
+	output.printf("# TYPE kea_heap_free_bytes gauge\nkea_heap_free_bytes %u\n", ESP.getFreeHeap());
+	output.printf("# TYPE kea_heap_min_free_bytes gauge\nkea_heap_min_free_bytes %u\n", ESP.getMinFreeHeap());
+	output.printf("# TYPE kea_heap_largest_free_block_bytes gauge\nkea_heap_largest_free_block_bytes %u\n", ESP.getMaxAllocHeap());
+
+	output.print("# TYPE kea_http_requests_total counter\n");
+	for (uint8_t route = 0; route < METRIC_ROUTE_COUNT; route++) {
+		output.printf("kea_http_requests_total{route=\"%s\"} %u\n", metrics.routes[route].path, metrics.routes[route].requests);
+	}
+	output.print("# TYPE kea_http_sent_bytes_total counter\n");
+	for (uint8_t route = 0; route < METRIC_ROUTE_COUNT; route++) {
+		output.printf("kea_http_sent_bytes_total{route=\"%s\"} %u\n", metrics.routes[route].path, metrics.routes[route].bytes);
+	}
+	output.print("# TYPE kea_http_fill_microseconds_total counter\n");
+	for (uint8_t route = 0; route < METRIC_ROUTE_COUNT; route++) {
+		output.printf("kea_http_fill_microseconds_total{route=\"%s\"} %llu\n", metrics.routes[route].path, (unsigned long long)metrics.routes[route].fillMicros);
+	}
+	output.print("# TYPE kea_http_fill_max_microseconds gauge\n");
+	for (uint8_t route = 0; route < METRIC_ROUTE_COUNT; route++) {
+		output.printf("kea_http_fill_max_microseconds{route=\"%s\"} %u\n", metrics.routes[route].path, metrics.routes[route].maxFillMicros);
+	}
+	output.printf("# TYPE kea_events_clients gauge\nkea_events_clients %u\n", events.count());
+
+	output.print("# TYPE kea_dropped_total counter\n");
+	output.printf("kea_dropped_total{queue=\"sampleMailbox\",consumer=\"jsonFileManager\"} %u\n", metrics.jsonMissedSamples);
+	output.printf("kea_dropped_total{queue=\"sampleMailbox\",consumer=\"csvFileManager\"} %u\n", metrics.csvMissedSamples);
+	output.printf("kea_dropped_total{queue=\"sampleRing\",consumer=\"jsonFileManager\"} %u\n", metrics.sampleRingBusyDrops);
+	output.printf("kea_dropped_total{queue=\"lightBarCommandQueue\",consumer=\"lightBar\"} %u\n", metrics.lightBarCommandDrops);
+
+	output.print("# TYPE kea_static_responses_total counter\n");
+	output.printf("kea_static_responses_total{source=\"notModified\"} %u\n", metrics.assetsNotModified);
+	output.printf("kea_static_responses_total{source=\"ram\"} %u\n", metrics.assetsFromRam);
+	output.printf("kea_static_responses_total{source=\"flash\"} %u\n", metrics.assetsFromFlash);
+
+	output.printf("# TYPE kea_log_flushes_total counter\nkea_log_flushes_total %u\n", metrics.logFlushes);
+	output.printf("# TYPE kea_log_flush_microseconds_total counter\nkea_log_flush_microseconds_total %llu\n", (unsigned long long)metrics.logFlushMicros);
+	output.printf("# TYPE kea_log_flush_max_microseconds gauge\nkea_log_flush_max_microseconds %u\n", metrics.maxLogFlushMicros);
+	output.printf("# TYPE kea_log_written_bytes_total counter\nkea_log_written_bytes_total %u\n", metrics.logBytesWritten);
+	output.printf("# TYPE kea_log_programmed_bytes_estimate_total counter\nkea_log_programmed_bytes_estimate_total %u\n", metrics.logBytesProgrammed);
+	output.printf("# TYPE kea_log_sector_erases_estimate_total counter\nkea_log_sector_erases_estimate_total %u\n", metrics.logSectorErases);
+	uint16_t pendingRecords = logTail.count;
+	output.printf("# TYPE kea_log_pending_records gauge\nkea_log_pending_records %u\n", pendingRecords);
+	output.printf("# TYPE kea_log_pending_seconds gauge\nkea_log_pending_seconds %u\n",
+				  pendingRecords > 0 ? (uint32_t)((esp_timer_get_time() - logTail.firstAddedAt) / 1000000) : 0);
+
+	output.print("# TYPE kea_lightbar_frame_microseconds histogram\n");
+	uint32_t cumulativeFrames = 0;
+	for (uint8_t bucket = 0; bucket < FRAME_HISTOGRAM_BUCKETS; bucket++) {
+		cumulativeFrames += metrics.frameHistogram[bucket];
+		output.printf("kea_lightbar_frame_microseconds_bucket{le=\"%u\"} %u\n", frameHistogramBounds[bucket], cumulativeFrames);
+	}
+	output.printf("kea_lightbar_frame_microseconds_bucket{le=\"+Inf\"} %u\n", metrics.frameCount);
+	output.printf("kea_lightbar_frame_microseconds_sum %llu\n", (unsigned long long)metrics.frameMicros);
+	output.printf("kea_lightbar_frame_microseconds_count %u\n", metrics.frameCount);
+
+	output.print("# TYPE kea_lightbar_frame_jitter_microseconds histogram\n");
+	uint32_t cumulativeJitter = 0;
+	for (uint8_t bucket = 0; bucket < FRAME_HISTOGRAM_BUCKETS; bucket++) {
+		cumulativeJitter += metrics.jitterHistogram[bucket];
+		output.printf("kea_lightbar_frame_jitter_microseconds_bucket{le=\"%u\"} %u\n", jitterHistogramBounds[bucket], cumulativeJitter);
+	}
+	output.printf("kea_lightbar_frame_jitter_microseconds_bucket{le=\"+Inf\"} %u\n", metrics.jitterCount);
+	output.printf("kea_lightbar_frame_jitter_microseconds_sum %llu\n", (unsigned long long)metrics.jitterMicros);
+	output.printf("kea_lightbar_frame_jitter_microseconds_count %u\n", metrics.jitterCount);
+	output.printf("# TYPE kea_lightbar_frame_jitter_max_microseconds gauge\nkea_lightbar_frame_jitter_max_microseconds %u\n", metrics.maxJitterMicros);
+
+	output.print("# TYPE kea_i2c_jobs_total counter\n");
+	for (uint8_t id = 0; id < I2C_BUS_COUNT; id++) {
+		output.printf("kea_i2c_jobs_total{bus=\"%s\"} %u\n", i2cBuses[id].name, i2cBuses[id].jobCount);
+	}
+	output.print("# TYPE kea_i2c_errors_total counter\n");
+	for (uint8_t id = 0; id < I2C_BUS_COUNT; id++) {
+		output.printf("kea_i2c_errors_total{bus=\"%s\"} %u\n", i2cBuses[id].name, i2cBuses[id].errorCount);
+	}
+	output.print("# TYPE kea_i2c_max_wait_microseconds gauge\n");
+	for (uint8_t id = 0; id < I2C_BUS_COUNT; id++) {
+		output.printf("kea_i2c_max_wait_microseconds{bus=\"%s\"} %u\n", i2cBuses[id].name, i2cBuses[id].maxWaitMicros);
+	}
+	output.print("# TYPE kea_i2c_max_job_microseconds gauge\n");
+	for (uint8_t id = 0; id < I2C_BUS_COUNT; id++) {
+		output.printf("kea_i2c_max_job_microseconds{bus=\"%s\"} %u\n", i2cBuses[id].name, i2cBuses[id].maxJobMicros);
+	}
+
+#ifdef EXPORT_URL
+	output.printf("# TYPE kea_export_batches_total counter\nkea_export_batches_total %u\n", metrics.exportBatches);
+	output.printf("# TYPE kea_export_failures_total counter\nkea_export_failures_total %u\n", metrics.exportFailures);
+	output.printf("# TYPE kea_export_records_total counter\nkea_export_records_total %u\n", metrics.exportRecords);
+	output.printf("# TYPE kea_export_bytes_total counter\nkea_export_bytes_total %u\n", metrics.exportBytes);
+	uint32_t newestEpoch = newestLogEpoch();
+	output.printf("# TYPE kea_export_lag_seconds gauge\nkea_export_lag_seconds %u\n", newestEpoch > metrics.exportCursor ? newestEpoch - metrics.exportCursor : 0);
+#endif
+
+#ifdef FLEET_GATEWAY
+	output.printf("# TYPE kea_fleet_dropped_total counter\nkea_fleet_dropped_total %u\n", metrics.fleetQueueDrops);
+	output.printf("# TYPE kea_fleet_repeats_total counter\nkea_fleet_repeats_total %u\n", metrics.fleetRepeats);
+	if (xSemaphoreTake(fleetMutex, 10 / portTICK_PERIOD_MS) == pdTRUE) {
+		uint8_t leaves = 0;
+		output.print("# TYPE kea_fleet_packets_total counter\n");
+		for (uint8_t id = 0; id < FLEET_MAX_LEAVES; id++) {
+			const FleetLeaf& leaf = fleetLeaves[id];
+			if (leaf.isUsed) {
+				char device[13];
+				formatFleetDevice(device, leaf.mac);
+				output.printf("kea_fleet_packets_total{device=\"%s\",result=\"received\"} %u\n", device, leaf.received);
+				output.printf("kea_fleet_packets_total{device=\"%s\",result=\"missed\"} %u\n", device, leaf.missed);
+				leaves++;
+			}
+		}
+		xSemaphoreGive(fleetMutex);
+		output.printf("# TYPE kea_fleet_leaves gauge\nkea_fleet_leaves %u\n", leaves);
+	}
+#endif
+
+	printPowerMetrics(output);
+}
+
+/**
+ * @brief Checks each file of the page bundle against the manifest and copies the small ones into RAM.
+ * A file that doesn't match (data/ was changed and uploaded without rebuilding the firmware) is left to serveStatic,
+ * so it is never sent with an ETag that belongs to different content.
+ */
+void loadStaticAssets() {
+	uint32_t cachedBytes = 0;
+	for (uint8_t id = 0; id < STATIC_ASSET_COUNT; id++) {
+		const StaticAsset& asset = staticAssets[id];
+		staticAssetCache[id] = NULL;
+		staticAssetMatches[id] = false;
+
+		String path = String(asset.path) + ".gz";
+		File file = LittleFS.open(path, FILE_READ);
+		if (!file || file.size() != asset.size) {
+			ESP_LOGW("", "%s doesn't match the asset manifest (rebuild the firmware with the uploaded data/)", path.c_str());
+			continue;
+		}
+		staticAssetMatches[id] = true;
+
+		if (asset.cacheInRam) {
+			uint8_t* copy = (uint8_t*)malloc(asset.size);
+			if (copy != NULL && file.read(copy, asset.size) == asset.size) {
+				staticAssetCache[id] = copy;
+				cachedBytes += asset.size;
+			} else {
+				free(copy);	 // streamed from LittleFS instead
+			}
+		}
+		file.close();
+	}
+
+	File page = LittleFS.open("/index.html", FILE_READ);
+	if (page) {
+		pageTemplate = (uint8_t*)malloc(page.size());
+		if (pageTemplate != NULL && page.read(pageTemplate, page.size()) == page.size()) {
+			pageTemplateSize = page.size();
+			cachedBytes += pageTemplateSize;
+		} else {
+			free(pageTemplate);	 // filled in from LittleFS instead
+			pageTemplate = NULL;
+		}
+		page.close();
+	}
+	ESP_LOGI("", "%u bytes of static assets cached in RAM", cachedBytes);
+}
+
+/**
+ * @brief Serves one file of the page bundle with its ETag.
+ * A client that already has this version (If-None-Match) gets an empty 304, otherwise the gzipped file is sent from
+ * its RAM copy (no filesystem lock, so it never waits on csvFileManagerTask) or streamed from LittleFS.
+ */
+void serveStaticAsset(AsyncWebServerRequest* request, uint8_t id) {
+	const StaticAsset& asset = staticAssets[id];
+	AsyncWebServerResponse* response;
+	if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value().indexOf(asset.etag) >= 0) {
+		response = request->beginResponse(304);
+		metrics.assetsNotModified++;
+	} else if (staticAssetCache[id] != NULL) {
+		response = request->beginResponse_P(200, asset.contentType, staticAssetCache[id], asset.size);
+		response->addHeader("Content-Encoding", "gzip");
+		metrics.assetsFromRam++;
+	} else {
+		response = request->beginResponse(LittleFS, asset.path, asset.contentType);	 // finds the .gz and adds the Content-Encoding itself
+		metrics.assetsFromFlash++;
+	}
+	response->addHeader("ETag", asset.etag);
+	response->addHeader("Cache-Control", "max-age=86400");
+	request->send(response);
+}
+
+#define SPARKLINE_POINTS 96	 // Points in each sparkline drawn into index.html
+#define SPARKLINE_WIDTH 240	 // Size of the sparkline's viewBox (index.css stretches it to the width of the card)
+#define SPARKLINE_HEIGHT 60
+const char* sparklineColors[SAMPLE_CHANNEL_COUNT] = {"#70AE6E", "#333745", "#FE5F55"};	 // Same as seriesInfo in index.js
+
+// Formats the newest value of a channel of the sample ring as it is graphed ("--" before the first sample)
+String formatNewestReading(sampleChannels channel) {
+	char text[16] = "--";
+	if (xSemaphoreTake(sampleRingMutex, 10 / portTICK_PERIOD_MS) == pdTRUE) {  // ask for control of the sample ring
+		if (sampleRing.count > 0) {
+			uint16_t index = sequenceToIndex(sampleRing, sampleRing.sequence - 1);
+			formatGraphValue(text, channel, getGraphValue(sampleRing, channel, index));
+		}
+		xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
+	}
+	return String(text);
 }
 
+/**
+ * @brief Draws one channel of the sample ring as an inline SVG sparkline.
+ * The ring is split into (up to) SPARKLINE_POINTS equal parts, each drawn at its mean and scaled between the lowest
+ * and highest of those means. Returns an empty string until there are 2 samples.
+ */
+String drawSparkline(sampleChannels channel) {
+	int32_t values[SPARKLINE_POINTS];
+	uint16_t points = 0;
+	if (xSemaphoreTake(sampleRingMutex, 10 / portTICK_PERIOD_MS) == pdTRUE) {  // ask for control of the sample ring
+		uint32_t oldestSequence = sampleRing.sequence - sampleRing.count;
+		points = min((uint16_t)SPARKLINE_POINTS, sampleRing.count);
+		for (uint16_t point = 0; point < points; point++) {
+			uint32_t first = oldestSequence + (uint32_t)point * sampleRing.count / points;
+			uint32_t last = oldestSequence + (uint32_t)(point + 1) * sampleRing.count / points;
+			int32_t sum = 0;
+			for (uint32_t sequence = first; sequence < last; sequence++) {
+				sum += getGraphValue(sampleRing, channel, sequenceToIndex(sampleRing, sequence));
+			}
+			values[point] = sum / (int32_t)(last - first);
+		}
+		xSemaphoreGive(sampleRingMutex);  // release control of the sample ring
+	}
+	if (points < 2) {
+		return String();
+	}
+
+	int32_t lowest = *std::min_element(values, values + points);
+	int32_t range = max(*std::max_element(values, values + points) - lowest, (int32_t)1);
+
+	String svg;
+	svg.reserve(192 + points * 8);
+	svg += "<svg class=\"sparkline\" viewBox=\"0 0 " + String(SPARKLINE_WIDTH) + " " + String(SPARKLINE_HEIGHT) + "\" preserveAspectRatio=\"none\">";
+	svg += "<polyline fill=\"none\" stroke-width=\"2\" vector-effect=\"non-scaling-stroke\" stroke=\"" + String(sparklineColors[channel]) + "\" points=\"";
+	char point[24];
+	for (uint16_t i = 0; i < points; i++) {
+		// 2 units of margin top and bottom so the line isn't cut off
+		sprintf(point, "%s%u,%i", (i == 0) ? "" : " ", (uint32_t)i * SPARKLINE_WIDTH / (points - 1),
+				SPARKLINE_HEIGHT - 2 - (values[i] - lowest) * (SPARKLINE_HEIGHT - 4) / range);
+		svg += point;
+	}
+	svg += "\"/></svg>";
+	return svg;
+}
+
+// Fills in the %PLACEHOLDERS% of index.html (the ESPAsyncWebServer template processor, %% is a plain %)
+String processPagePlaceholder(const String& placeholder) {
+	if (placeholder == "CO2") {
+		return formatNewestReading(co2Channel);
+	} else if (placeholder == "HUMIDITY") {
+		return formatNewestReading(humidityChannel);
+	} else if (placeholder == "TEMPERATURE") {
+		return formatNewestReading(temperatureChannel);
+	} else if (placeholder == "CO2_SPARKLINE") {
+		return drawSparkline(co2Channel);
+	} else if (placeholder == "HUMIDITY_SPARKLINE") {
+		return drawSparkline(humidityChannel);
+	} else if (placeholder == "TEMPERATURE_SPARKLINE") {
+		return drawSparkline(temperatureChannel);
+	} else if (placeholder == "FLEET_LINK") {
+#ifdef FLEET_GATEWAY
+		return "<div class=\"flex-box\"><a href=\"fleet.html\"><div class=\"cardButton\" style=\"background:#333745;\">All Rooms</div></a></div>";
+#endif
+	}
+	return String();
+}
+
+#ifdef FLEET_GATEWAY
+/**
+ * @brief Prints every room as a JSON array, this unit first ("device":"local") then each leaf, newest readings as graphed:
+ * [{"device":"AABBCCDDEEFF","room":"Kitchen","age":12,"co2":612,"humidity":45,"temperature":21.3,"received":100,"missed":2},...]
+ * age is seconds since the leaf was last heard.
+ * @return False if the leaves couldn't be locked within a few ms
+ */
+bool printFleet(Print& output) {
+	output.printf("[{\"device\":\"local\",\"room\":\"%s\",\"age\":0,\"co2\":%s,\"humidity\":%s,\"temperature\":%s}", FLEET_ROOM,
+				  formatNewestReading(co2Channel).c_str(), formatNewestReading(humidityChannel).c_str(), formatNewestReading(temperatureChannel).c_str());
+
+	if (xSemaphoreTake(fleetMutex, 10 / portTICK_PERIOD_MS) == pdFALSE) {
+		return false;
+	}
+	time_t now;
+	time(&now);
+	for (uint8_t id = 0; id < FLEET_MAX_LEAVES; id++) {
+		const FleetLeaf& leaf = fleetLeaves[id];
+		if (leaf.isUsed == false || leaf.count == 0) {
+			continue;
+		}
+		char device[13];
+		formatFleetDevice(device, leaf.mac);
+		char room[FLEET_ROOM_CHARS + 1];  // only letters, digits and a few marks, so it can go into JSON as is
+		uint8_t length = 0;
+		for (const char* c = leaf.room; *c != '\0'; c++) {
+			if (isalnum((unsigned char)*c) || strchr(" -_.'()", *c) != NULL) {
+				room[length++] = *c;
+			}
+		}
+		room[length] = '\0';
+
+		uint16_t index = fleetSequenceToIndex(leaf, leaf.sequence - 1);
+		char humidity[16], temperature[16];
+		formatGraphValue(humidity, humidityChannel, toGraphValue(humidityChannel, leaf.humidity[index]));
+		formatGraphValue(temperature, temperatureChannel, toGraphValue(temperatureChannel, leaf.temperature[index]));
+		output.printf(",{\"device\":\"%s\",\"room\":\"%s\",\"age\":%u,\"co2\":%u,\"humidity\":%s,\"temperature\":%s,\"received\":%u,\"missed\":%u}",
+					  device, room, (uint32_t)now - leaf.lastHeard, leaf.co2[index], humidity, temperature, leaf.received, leaf.missed);
+	}
+	xSemaphoreGive(fleetMutex);
+	output.print("]");
+	return true;
+}
+#endif
+
 void setUpWebserver(AsyncWebServer& server, const IPAddress& localIP) {
 	//======================== Webserver ========================
 	// WARNING IOS (and maybe macos) WILL NOT POP UP IF IT CONTAINS THE WORD "Success" https://www.esp8266.com/viewtopic.php?f=34&t=4398
@@ -533,41 +3693,180 @@ void setUpWebserver(AsyncWebServer& server, const IPAddress& localIP) {
 		request->redirect(localIPURL);
 		});
 
-	server.on("/data.json", HTTP_GET, [](AsyncWebServerRequest* request) {	// when client asks for the json data preview file..
-		AsyncResponseStream* response = request->beginResponseStream("application/json");
-		response->addHeader("Cache-Control:", "max-age=5");
-		xSemaphoreTake(jsonDocMutex, 1);			 // ask for control of json doc
-		serializeJson(jsonDataDocument, *response);	 // turn the json document in ram into a normal json file (as a stream of data)
-		xSemaphoreGive(jsonDocMutex);				 // release control of json doc
+	server.on("/data.json", HTTP_GET, [](AsyncWebServerRequest* request) {	// when client asks for the json data preview file..
+		// data.json?since=<epoch> only returns the points newer than epoch (the page sends the X-Newest-Epoch of its last update)
+		uint32_t sinceEpoch = 0;
+		if (request->hasParam("since")) {
+			sinceEpoch = strtoul(request->getParam("since")->value().c_str(), NULL, 10);
+		}
+
+		metrics.routes[dataJsonRoute].requests++;
+		std::shared_ptr<SampleRingJsonStream> stream = std::make_shared<SampleRingJsonStream>();
+		if (startSampleRingJsonStream(*stream, sinceEpoch) == false) {
+			request->send(503);	 // sample ring is busy, the page will ask again on the next update
+			return;
+		}
+
+		// turn the sample ring in ram into a normal json file (one chunk at a time, as the client is ready for it)
+		AsyncWebServerResponse* response = request->beginChunkedResponse("application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+			int64_t fillStart = esp_timer_get_time();
+			return recordRouteFill(dataJsonRoute, fillStart, fillSampleRingJson(*stream, buffer, maxLen));
+			});
+		response->addHeader("Cache-Control", "max-age=5");
+		response->addHeader("X-Newest-Epoch", String(stream->newestEpoch));
 		request->send(response);
 		});
 
 	server.on("/Kea-CO2-Data.csv", HTTP_GET, [](AsyncWebServerRequest* request) {
-		AsyncWebServerResponse* response = request->beginResponse(LittleFS, "/Kea-CO2-Data.csv", String(), true);
+		metrics.routes[csvRoute].requests++;
+		std::shared_ptr<LogCsvStream> stream = std::make_shared<LogCsvStream>();
+		startLogCsvStream(*stream);
+
+		// render the binary log as CSV text one chunk at a time, as the client is ready for it
+		AsyncWebServerResponse* response = request->beginChunkedResponse("text/csv", [stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+			int64_t fillStart = esp_timer_get_time();
+			return recordRouteFill(csvRoute, fillStart, fillLogCsv(*stream, buffer, maxLen));
+			});
+		response->addHeader("Content-Disposition", "attachment; filename=\"Kea-CO2-Data.csv\"");
 		request->send(response);
 		});
 
 	server.on("/yesclear.html", HTTP_GET, [](AsyncWebServerRequest* request) {
 		request->redirect(localIPURL);	// return the user back to the home page
 
-		initializeJson();  // clears the data file
+		clearSampleRing();	// clears the graph data
 
-		xTaskNotify(jsonFileManager, 1, eSetValueWithOverwrite);  // notification value of 1 instructs jsonFileManager to clear data
-		vTaskResume(jsonFileManager);							  // jsonFileManager is usually left in paused state until needed, resuming it here.
-
-		xTaskNotify(csvFileManager, 1, eSetValueWithOverwrite);	 // notification value of 1 instructs csvFileManager to clear data
-		vTaskResume(csvFileManager);							 // csvFileManager is usually left in paused state until needed, resuming it here.
+		xTaskNotify(csvFileManager, clearDataNotification, eSetBits);  // instructs csvFileManager to clear data
 
 		ESP_LOGI("", "data clear Requested");
 		});
 
 	server.on("/off", HTTP_GET, [](AsyncWebServerRequest* request) {
 		request->redirect(localIPURL);
-		uint32_t notification = static_cast<uint32_t>(off);
-		xTaskNotify(lightBar, notification, eSetValueWithOverwrite);
+		sendLightBarCommand(setModeCommand, off);
 		ESP_LOGI("", "led off Requested");
 		});
 
+	server.on("/brightness", HTTP_GET, [](AsyncWebServerRequest* request) {  // /brightness?max=<0-255> limits the light bar brightness
+		if (!request->hasParam("max")) {
+			request->send(400, "text/plain", "max missing");
+			return;
+		}
+		long maximum = constrain(request->getParam("max")->value().toInt(), 0L, 255L);
+		sendLightBarCommand(setBrightnessCapCommand, maximum);
+		request->send(200, "text/plain", String(maximum));
+		ESP_LOGI("", "led brightness cap %li Requested", maximum);
+		});
+
+	server.on("/data.bin", HTTP_GET, [](AsyncWebServerRequest* request) {  // compact binary form of data.json (see SampleRingBinaryStream)
+		uint32_t sinceEpoch = 0;
+		if (request->hasParam("since")) {
+			sinceEpoch = strtoul(request->getParam("since")->value().c_str(), NULL, 10);
+		}
+
+		metrics.routes[dataBinRoute].requests++;
+		std::shared_ptr<SampleRingBinaryStream> stream = std::make_shared<SampleRingBinaryStream>();
+		if (startSampleRingBinaryStream(*stream, sinceEpoch) == false) {
+			request->send(503);
+			return;
+		}
+
+		AsyncWebServerResponse* response = request->beginChunkedResponse("application/octet-stream", [stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+			int64_t fillStart = esp_timer_get_time();
+			return recordRouteFill(dataBinRoute, fillStart, fillSampleRingBinary(*stream, buffer, maxLen));
+			});
+		response->addHeader("Cache-Control", "max-age=5");
+		request->send(response);
+		});
+
+	server.on("/history", HTTP_GET, [](AsyncWebServerRequest* request) {  // /history?from=<epoch>&to=<epoch>&step=<seconds>(&minmax) reads a time range of the flash log
+		uint32_t fromEpoch = 0, toEpoch = UINT32_MAX, step = 0;
+		bool includeMinMax = request->hasParam("minmax");
+		if (request->hasParam("from")) {
+			fromEpoch = strtoul(request->getParam("from")->value().c_str(), NULL, 10);
+		}
+		if (request->hasParam("to")) {
+			toEpoch = strtoul(request->getParam("to")->value().c_str(), NULL, 10);
+		}
+		if (request->hasParam("step")) {
+			step = strtoul(request->getParam("step")->value().c_str(), NULL, 10);
+		}
+		if (fromEpoch > toEpoch) {
+			request->send(400);
+			return;
+		}
+
+		metrics.routes[historyRoute].requests++;
+		std::shared_ptr<HistoryStream> stream = std::make_shared<HistoryStream>();
+		startHistoryStream(*stream, fromEpoch, toEpoch, step, includeMinMax);
+
+		AsyncWebServerResponse* response = request->beginChunkedResponse("application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+			int64_t fillStart = esp_timer_get_time();
+			return recordRouteFill(historyRoute, fillStart, fillHistory(*stream, buffer, maxLen));
+			});
+		response->addHeader("Cache-Control", "max-age=60");
+		request->send(response);
+		});
+
+	server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest* request) {  // counters for right sizing the stacks and heap (Prometheus text format)
+		AsyncResponseStream* response = request->beginResponseStream("text/plain; version=0.0.4");
+		printMetrics(*response);
+		request->send(response);
+		});
+
+#ifdef FLEET_GATEWAY
+	server.on("/fleet.json", HTTP_GET, [](AsyncWebServerRequest* request) {  // the newest readings of every room (see printFleet)
+		AsyncResponseStream* response = request->beginResponseStream("application/json");
+		if (printFleet(*response) == false) {
+			delete response;
+			request->send(503);
+			return;
+		}
+		response->addHeader("Cache-Control", "no-store");
+		request->send(response);
+		});
+
+	server.on("/fleet/history", HTTP_GET, [](AsyncWebServerRequest* request) {  // /fleet/history?device=<mac>(&since=<epoch>) the points heard from one leaf
+		uint8_t mac[6];
+		if (request->hasParam("device") == false || parseFleetDevice(request->getParam("device")->value().c_str(), mac) == false) {
+			request->send(400);
+			return;
+		}
+		uint32_t sinceEpoch = 0;
+		if (request->hasParam("since")) {
+			sinceEpoch = strtoul(request->getParam("since")->value().c_str(), NULL, 10);
+		}
+
+		std::shared_ptr<FleetHistoryStream> stream = std::make_shared<FleetHistoryStream>();
+		if (startFleetHistoryStream(*stream, mac, sinceEpoch) == false) {
+			request->send(404);
+			return;
+		}
+		AsyncWebServerResponse* response = request->beginChunkedResponse("application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+			return fillFleetHistory(*stream, buffer, maxLen);
+			});
+		response->addHeader("Cache-Control", "no-store");
+		request->send(response);
+		});
+#else
+	// only a gateway hears the other rooms, a 404 rather than the not found handler's redirect to the page
+	server.on("/fleet.json", HTTP_GET, [](AsyncWebServerRequest* request) { request->send(404); });
+	server.on("/fleet/history", HTTP_GET, [](AsyncWebServerRequest* request) { request->send(404); });
+#endif
+
+#ifdef TRACE_ENABLED
+	server.on("/trace", HTTP_GET, [](AsyncWebServerRequest* request) {	// the newest trace events as CSV (see printTrace)
+		AsyncResponseStream* response = request->beginResponseStream("text/csv");
+		printTrace(*response);
+		request->send(response);
+		});
+#endif
+
+	events.onConnect([](AsyncEventSourceClient* client) {
+		client->send("hello", NULL, millis(), 5000);  // ask the browser to retry after 5s if the connection drops
+		});
+	server.addHandler(&events);
+
 	server.on("/favicon.ico", [](AsyncWebServerRequest* request) { request->send(404); });
 
 	// Required for captive portal redirects
@@ -589,7 +3888,27 @@ void setUpWebserver(AsyncWebServer& server, const IPAddress& localIP) {
 	// server.on("/chat",                   [](AsyncWebServerRequest *request) { request->send(404); }); // No stop asking Whatsapp, there is no internet connection
 	// server.on("/startpage",              [](AsyncWebServerRequest *request) { request->redirect(localIPURL); });
 
-	server.serveStatic("/", LittleFS, "/").setCacheControl("max-age=86400");  // serve any file on the device when requested (24hr cache limit)
+	// the page, rendered with the current readings and a sparkline of each series so it is useful before (or without) any
+	// javascript, index.js then loads apexcharts and swaps the sparklines for charts
+	server.on("/index.html", HTTP_GET, [](AsyncWebServerRequest* request) {
+		AsyncWebServerResponse* response;
+		if (pageTemplate != NULL) {
+			response = request->beginResponse_P(200, "text/html", pageTemplate, pageTemplateSize, processPagePlaceholder);
+		} else {
+			response = request->beginResponse(LittleFS, "/index.html", "text/html", false, processPagePlaceholder);
+		}
+		response->addHeader("Cache-Control", "no-cache");  // the readings are different every time
+		request->send(response);
+		});
+
+	// the page bundle in the asset manifest (ETag, 304 and RAM copies, see serveStaticAsset)
+	for (uint8_t id = 0; id < STATIC_ASSET_COUNT; id++) {
+		if (staticAssetMatches[id]) {
+			server.on(staticAssets[id].path, HTTP_GET, [id](AsyncWebServerRequest* request) { serveStaticAsset(request, id); });
+		}
+	}
+
+	server.serveStatic("/", LittleFS, "/").setCacheControl("max-age=86400");  // serve any other file on the device when requested (24hr cache limit)
 
 	server.onNotFound([](AsyncWebServerRequest* request) {
 		request->redirect(localIPURL);
@@ -613,32 +3932,49 @@ void setUpWebserver(AsyncWebServer& server, const IPAddress& localIP) {
  *  - sets up SNTP client for NTP time synchronization
  *
  * It configures the WiFi mode as an access point and sets the IP address, gateway and subnet mask.
- * It also sets up a DNSServer to handle DNS requests and initializes the SNTP client to use the
- * specified NTP servers.
+ * It also sets up the captive portal DNS responder (see answerDnsQuery, it only listens while a station is
+ * connected) and initializes the SNTP client to use the specified NTP servers. LOW_POWER builds then keep the access
+ * point to its windows (see dutyCycleAccessPoint).
  *
  * The webserver serves the following routes:
  * - "/" redirects to the local IP address.
- * - "/data.json" returns a JSON representation of the sensor data.
- * - "/Kea-CO2-Data.csv" returns the Kea-CO2 data file.
+ * - "/index.html" returns the page with the current readings and sparklines filled in (see processPagePlaceholder).
+ * - "/data.json" returns a JSON representation of the sensor data ("/data.json?since=<epoch>" returns only newer data).
+ * - "/data.bin" returns the same data in a compact binary form (see SampleRingBinaryStream).
+ * - "/events" pushes each new sample to the page as a Server-Sent Event.
+ * - "/Kea-CO2-Data.csv" returns the Kea-CO2 data log as a CSV file.
+ * - "/history?from=&to=&step=" returns a time range of the data log as JSON (see HistoryStream).
  * - "/yesclear.html" clears the sensor data.
  * - "/off" turns off the light bar.
+ * - "/brightness?max=" limits the light bar brightness (0 - 255).
+ * - "/trace" returns the newest trace events as CSV (only built with TRACE_ENABLED).
+ * - "/fleet.json" and "/fleet/history?device=&since=" return the rooms heard over ESP-NOW (only built with FLEET_GATEWAY, 404 otherwise).
+ * - "/metrics" returns the stack, heap, queue, flash, light bar, power and route counters (see printMetrics).
  *
  * @param[in] parameter The task parameter (unused).
  */
+#define SERVICE_INTERVAL 10	// Milliseconds between OTA, telnet and serial trace checks (only in builds that have them)
+
 void webserverTask(void* parameter) {
-	// Create a DNS server instance
-	DNSServer dnsServer;
 	// Create an AsyncWebServer instance listening on port 80
 	AsyncWebServer server(80);
 
 	initializeNTPClient();
 
 	startSoftAccessPoint(password, localIP, gatewayIP);
+	recordBootStage(bootWifiStarted);
+#ifdef FLEET_GATEWAY
+	startFleetGateway();
+#endif
 
-	setUpDNSServer(dnsServer, localIP);
+	startDnsResponder(localIP);
 
+	// the page is served from LittleFS, which csvFileManagerTask mounts while the WiFi comes up
+	xEventGroupWaitBits(bootEvents, FILESYSTEM_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+	loadStaticAssets();
 	setUpWebserver(server, localIP);
 	server.begin();
+	recordBootStage(bootWebserverStarted);
 
 #ifdef OTA
 	WiFi.begin(ssid, netpassword);
@@ -665,6 +4001,7 @@ void webserverTask(void* parameter) {
 			type = "filesystem";
 
 		// NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
+		xTaskNotify(csvFileManager, flushLogNotification, eSetBits);  // the records waiting in RAM would be lost with the reboot
 		Serial.println("Start updating " + type);
 			})
 		.onEnd([]() {
@@ -689,6 +4026,10 @@ void webserverTask(void* parameter) {
 
 	ArduinoOTA.setTimeout(30000);
 	ArduinoOTA.begin();
+#elif defined(FLEET_GATEWAY)
+	// no station join for the "time" network: it can be on another channel and the radio would follow it off WIFI_CHANNEL,
+	// taking the access point and the ESP-NOW receiver away from the leaves
+	WiFi.setTxPower(WIFI_POWER_2dBm);
 #else
 	WiFi.begin("time", "12345678");
 	WiFi.setAutoReconnect(false); //critically needed
@@ -697,334 +4038,689 @@ void webserverTask(void* parameter) {
 
 	ESP_LOGV("WiFi Tx Power Set To:", "%i", (WiFi.getTxPower()));
 
-	ESP_LOGV("", "Startup completed by %ims", (millis()));
+	ESP_LOGV("", "Startup completed by %ims (see kea_boot_stage_microseconds in /metrics)", (millis()));
 
-	while (true) {
-		dnsServer.processNextRequest();
+#ifdef LOW_POWER
+	AccessPointSchedule accessPointSchedule;
+	startAccessPointSchedule(accessPointSchedule);
+#endif
 
+	while (true) {
 #ifdef OTA
 		ArduinoOTA.handle();
 		telnet.loop();
 #endif
 
-		vTaskDelay(DNS_INTERVAL / portTICK_PERIOD_MS);
+#ifdef TRACE_ENABLED
+		if (Serial.available() > 0 && Serial.read() == 't') {  // send a 't' over the serial monitor to dump the trace
+			printTrace(Serial);
+		}
+#endif
+
+#if defined(LOW_POWER)
+		dutyCycleAccessPoint(accessPointSchedule);	// also the wait between serial trace checks
+#elif defined(OTA) || defined(TRACE_ENABLED)
+		vTaskDelay(SERVICE_INTERVAL / portTICK_PERIOD_MS);
+#else
+		vTaskSuspend(NULL);	 // the webserver and DNS responder are event driven (AsyncTCP and AsyncUDP tasks), this task only owns them
+#endif
 	}
 }
 
 /**
- * @brief Initializes a CSV file and adds a header if needed.
+ * @brief Loads the log index, and moves the files of older firmware out of the way.
  *
- * This function creates a new CSV file with the given filename and adds a header to it if it doesn't exist.
- * If a file with the same filename already exists and has some data in it, it is left alone.
+ * A legacy CSV file is renamed to oldCSVFilename so it can still be downloaded (the webserver serves any file
+ * on the device). The records of a single file binary log are appended to the segmented log, then it is removed.
  *
- * @param[in] filename The name of the CSV file.
- * @return True if the CSV was successfully initialized, false otherwise.
+ * @param[in] writer The newest segment file.
  */
-bool initializeCsvFile(const char* filename, char* csvHeader) {
-	// Attempt to open the CSV file (create if it doesn't exist)
-	File file = LittleFS.open(filename, FILE_APPEND, true);
-	if (!file) {
-		ESP_LOGE("", "Unable to open %s. Aborting task.", filename);
-		return false;
+void initializeLog(LogWriter& writer) {
+	if (LittleFS.exists(legacyCSVFilename)) {
+		LittleFS.remove(oldCSVFilename);
+		LittleFS.rename(legacyCSVFilename, oldCSVFilename);
+		ESP_LOGI("", "Moved %s to %s", legacyCSVFilename, oldCSVFilename);
 	}
 
-	// Check if the CSV file already has data
-	bool fileHasData = file.size() > 0;
+	loadLogIndex();
+#ifdef LOW_POWER
+	startLogBatch();
+	writeLogBatch(writer);
+#endif
 
-	// If the file is empty, add the CSV header
-	if (!fileHasData) {
-		if (!file.print(csvHeader)) {
-			ESP_LOGE("", "Error writing CSV header to file %s", filename);
-			file.close();
-			return false;
+	if (LittleFS.exists(unsegmentedLogFilename)) {
+		File file = LittleFS.open(unsegmentedLogFilename, FILE_READ);
+		LogRecord record;
+		while (file && file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+			if (record.epoch != 0) {  // zero epoch records were padding after a partly written record
+				appendLogRecord(writer, record);
+			}
 		}
+		file.close();
+		closeLogWriter(writer);
+		LittleFS.remove(unsegmentedLogFilename);
+		ESP_LOGI("", "Moved %s into %s", unsegmentedLogFilename, LOG_DIRECTORY);
 	}
+}
 
-	file.close();
-	return true;
+/**
+ * @brief Mounts LittleFS (formatting it if it won't mount), then releases the tasks waiting on FILESYSTEM_READY_BIT.
+ * This runs at the start of csvFileManagerTask, so a slow mount (or a format) never holds up the light bar or sensors.
+ */
+void mountFilesystem() {
+	if (LittleFS.begin(true) == false) {
+		sendLightBarCommand(setModeCommand, errorRed);
+		ESP_LOGE("", "Error mounting LittleFS (Even with Format on Fail)");
+	}
+
+	ESP_LOGI("LittleFS", "unused storage = %ikib", (LittleFS.totalBytes() - LittleFS.usedBytes()) / 1024);
+#ifndef FLEET_LEAF	// a leaf doesn't serve the page
+	if (LittleFS.exists("/index.html") == false) {
+		ESP_LOGE("LittleFS", "index.html doesn't exist");
+		sendLightBarCommand(setModeCommand, errorRed);
+	}
+#endif
+	recordBootStage(bootFilesystemMounted);
+	xEventGroupSetBits(bootEvents, FILESYSTEM_READY_BIT);
 }
 
 /**
- * @brief Takes a queue of char arrays and adds it to the CSV file in flash storage.
- * This function opens a CSV file named CSVLogFilename, either by appending to an existing file or creating a new one.
- * If the file is empty, a CSV header is added. The function then sets up the CSV file buffer and waits for
- * notifications.
+ * @brief Rolls the samples up into one minute records and adds them to the segmented log and the rollup tiers in flash storage.
+ * This function mounts LittleFS (see mountFilesystem), loads the log index from LOG_DIRECTORY and then waits for notifications.
  *
- * When a delete file notification is received, the CSV file is closed, removed, and re-opened with a new header.
+ * When a new sample notification is received, the newest Sample is read from the sampleMailbox and added to the
+ * min/max/mean of its `CSV_RECORD_INTERVAL_SECONDS` long bucket. When the next bucket starts the minute is logged.
  *
- * If the buffer is nearly full, the data is written to the file and the buffer is flushed. If the buffer is full, incoming data is ignored until the file is
- * cleared. If the CSV file exceeds MAX_CSV_SIZE_BYTES, incoming data is also ignored until the file is cleared.
+ * When a delete file notification is received, every log segment, rollup tier (and any legacy CSV file) is removed.
+ *
+ * The mean of each minute is coalesced in RAM and written to the newest segment about a flash sector at a time, see
+ * appendLogRecord (LOW_POWER builds batch the minutes in RTC memory first, see logMinute). A flush log notification
+ * writes out everything waiting. When the
+ * log is full the oldest segment is evicted, so the newest ~MAX_LOG_SIZE_BYTES of data is always kept. Each minute is
+ * also rolled up into the 15 minute and 1 hour tiers, see addToRollupTiers.
  * @param[in] parameter The task parameter (unused).
  */
 void csvFileManagerTask(void* parameter) {
-	// Generate a unique header based on the ESP32's MAC address
-	char csvHeader[128];
-	uint8_t mac[6];
-	esp_read_mac(mac, ESP_MAC_WIFI_STA);
-	snprintf(csvHeader, sizeof(csvHeader), "Kea-CO2-%02X (D/M/Y), Time(H:M), CO2(PPM), Humidity(\%RH), Temperature(DegC)\r\n", mac[5]);
-	const uint32_t BUFFER_SIZE = 256;
-	const uint32_t FLUSH_THRESHOLD = 128;
-	const uint32_t FLUSH_EVERY_THRESHOLD = 512;
+	LogWriter writer;
+	writer.isOpen = false;
+	writer.fileBytes = 0;
 
-	if (!initializeCsvFile(CSVLogFilename, csvHeader)) {
-		ESP_LOGE("", "Unable to initialize %s. Aborting task.", CSVLogFilename);
-		vTaskDelete(NULL);
-	}
+	RollupWriter rollupWriter;
+	startRollupWriter(rollupWriter);
 
-	File csvDataFile = LittleFS.open(CSVLogFilename, FILE_APPEND);
-	if (!csvDataFile) {
-		ESP_LOGE("", "Unable to open %s. Aborting task.", CSVLogFilename);
-		vTaskDelete(NULL);
-	}
+	mountFilesystem();
+
+	RollupAccumulator minute;  // the min/max/mean of the samples in this minute (the 1 minute rollup tier)
+	resetRollup(minute, 0);
+	uint32_t prevSequence = 0;
 
-	uint32_t bufferSizeNow = 0;
-	csvDataFile.setBufferSize(BUFFER_SIZE);
-	uint32_t csvDataFilesize = csvDataFile.size();
+	initializeLog(writer);
+#ifdef PRODUCTION_TEST
+	clearLog();
+#endif
 
 	while (true) {
 		// Wait for notifications
-		uint32_t notification = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		uint32_t notification;
+		xTaskNotifyWait(0, UINT32_MAX, &notification, portMAX_DELAY);
 
 		// Handle delete file notification
-		if (notification > 0) {
-			ESP_LOGI("", "Received delete file notification for %s", CSVLogFilename);
-			csvDataFile.close();
-			LittleFS.remove(CSVLogFilename);
-
-			if (!initializeCsvFile(CSVLogFilename, csvHeader)) {
-				ESP_LOGE("", "Unable to initialize %s. Aborting task.", CSVLogFilename);
-				vTaskDelete(NULL);
-			}
-
-			csvDataFile = LittleFS.open(CSVLogFilename, FILE_APPEND);
-			if (!csvDataFile) {
-				ESP_LOGE("", "Unable to open %s. Aborting task.", CSVLogFilename);
-				vTaskDelete(NULL);
-			}
-
-			bufferSizeNow = 0;
-			csvDataFile.setBufferSize(BUFFER_SIZE);
-			csvDataFilesize = csvDataFile.size();
+		if (notification & clearDataNotification) {
+			ESP_LOGI("", "Received delete file notification for %s", LOG_DIRECTORY);
+			discardLogTail();
+			closeLogWriter(writer);
+#ifdef LOW_POWER
+			rtcLogBatch.count = 0;
+#endif
+			clearLog();
+			clearRollupTiers(rollupWriter);
+			LittleFS.remove(oldCSVFilename);
 		}
 
-		char csvLine[CSV_LINE_MAX_CHARS];
-		if (xQueueReceive(charsForCSVFileQueue, csvLine, 0) == pdTRUE) {
-			// Write line to CSV file
-			if (csvDataFilesize < MAX_CSV_SIZE_BYTES) { // Prevent memory leaks
-				uint8_t bytesAdded = csvDataFile.println(csvLine);
-
-				if (bytesAdded > 0) {
-					bufferSizeNow += bytesAdded;
+		if (notification & flushLogNotification) {
+#ifdef LOW_POWER
+			writeLogBatch(writer);
+#endif
+			flushLogWriter(writer);
+		}
 
-					if (bufferSizeNow > FLUSH_THRESHOLD || csvDataFilesize < FLUSH_EVERY_THRESHOLD) {
-						csvDataFile.flush();
-						csvDataFilesize += bufferSizeNow;
-						bufferSizeNow = 0;
-						ESP_LOGI("", "%s Flushed to Flash Storage", CSVLogFilename);
-					}
-				} else {
-					ESP_LOGE("", "Error writing to %s", CSVLogFilename);
+		Sample sample;
+		if ((notification & newSampleNotification) && xQueuePeek(sampleMailbox, &sample, 0) == pdTRUE && sample.sequence != prevSequence) {
+			if (prevSequence != 0 && sample.sequence != prevSequence + 1) {
+				metrics.csvMissedSamples += sample.sequence - prevSequence - 1;
+				ESP_LOGW("", "Missed %u samples", sample.sequence - prevSequence - 1);
+			}
+			prevSequence = sample.sequence;
+
+			// roll the samples up into one minute records, the log gets each minute when the next one starts
+			uint32_t minuteEpoch = sample.epoch - (sample.epoch % CSV_RECORD_INTERVAL_SECONDS);
+			if (minute.bucketEpoch != minuteEpoch) {
+				if (minute.count > 0) {
+					RollupRecord record = toRollupRecord(minute);
+					LogRecord logRecord = toLogRecord(record);
+					logMinute(writer, logRecord);
+					addToRollupTiers(rollupWriter, record);
+
+					char buf[CSV_LINE_MAX_CHARS];  // temp char array for CSV 40000,99,99
+					formatCsvLine(buf, logRecord);
+					Serial.print(buf);
 				}
+				resetRollup(minute, minuteEpoch);
 			}
+			const int32_t values[SAMPLE_CHANNEL_COUNT] = {sample.co2, sample.humidity, sample.temperature};
+			addToRollup(minute, values);
 		}
 	}
 }
 
+// -----------------------------------------
+//
+//    Uplink Exporter
+//
+// -----------------------------------------
+
+#ifdef EXPORT_URL
+// Encodes up to EXPORT_BATCH_RECORDS records after cursor into batch, returns the epoch of the last one (cursor if there were none)
+uint32_t fillExportBatch(ExportEncoder& encoder, uint8_t* batch, uint32_t cursor) {
+	LogReader reader;
+	startLogReader(reader, cursor + 1);
+	startExportBatch(encoder);
+
+	uint32_t lastEpoch = cursor;
+	LogRecord record;
+	while (encoder.count < EXPORT_BATCH_RECORDS && nextLogRecord(reader, record)) {
+		addToExportBatch(encoder, batch, record);
+		lastEpoch = record.epoch;
+	}
+	stopLogReader(reader);
+	return lastEpoch;
+}
+
+// POSTs a batch to EXPORT_URL, returns true if the collector accepted it (a 2xx)
+bool sendExportBatch(uint8_t* batch, const ExportEncoder& encoder, const char* deviceName) {
+	HTTPClient http;
+	http.setTimeout(EXPORT_TIMEOUT);
+	if (http.begin(EXPORT_URL) == false) {
+		metrics.exportFailures++;
+		return false;
+	}
+	http.addHeader("Content-Type", "application/octet-stream");
+	http.addHeader("X-Kea-Device", deviceName);
+	http.addHeader("X-Kea-Format", "kea-delta-1");
+	http.addHeader("X-Kea-Records", String(encoder.count));
+	int status = http.POST(batch, encoder.length);
+	http.end();
+
+	if (status < 200 || status >= 300) {
+		metrics.exportFailures++;
+		ESP_LOGW("", "Collector did not take the batch (%i)", status);
+		return false;
+	}
+	metrics.exportBatches++;
+	metrics.exportRecords += encoder.count;
+	metrics.exportBytes += encoder.length;
+	return true;
+}
+
 /**
- * @brief Takes a queue of data points and adds it to the JSON data document in RAM
- * This function initializes the JSON document and continuously waits for a
- * notification. When a notification is received and the JSON data queue contains
- * three elements, it retrieves the elements and adds them to the JSON document.
- * The function also updates the index for each data type (CO2, humidity, and temperature)
- * to ensure that the data is stored in a circular buffer. The function also acquires and
- * releases a mutex to ensure that the JSON document is accessed safely in a multithreaded environment.
+ * @brief Sends the log to the collector at EXPORT_URL in batches, carrying on where it left off after an outage or a reboot.
+ * Every EXPORT_INTERVAL_SECONDS the records after the cursor are POSTed EXPORT_BATCH_RECORDS at a time as kea-delta-1
+ * batches (see Export Batches in KeaPipeline.h), so the radio and the collector see one request per interval, not one
+ * per sample. The cursor (the epoch of the newest record the collector has accepted) is kept in NVS and only moved on
+ * after a 2xx, so a lost batch is sent again, the collector should key the records on device and epoch. When the log
+ * is cleared or the clock steps back (the log's newest record is older than the cursor) the whole log is sent again.
  * @param[in] parameter The task parameter (unused).
  */
-void jsonFileManagerTask(void* parameter) {
-	time_t currentEpoch, prevEpoch = 0;
-	uint8_t CO2Index = 0, tempIndex = 0, humidityIndex = 0;
-	uint32_t notification;
-	double CO2, temperature, humidity;
-	double prevCO2 = 0, prevTemperature = 0, prevHumidity = 0;
+void exporterTask(void* parameter) {
+	static uint8_t batch[EXPORT_BATCH_RECORDS * EXPORT_RECORD_MAX_BYTES];
 
-	initializeJson();
+	Preferences cursorStore;
+	cursorStore.begin("exporter", false);
+	uint32_t cursor = cursorStore.getUInt("cursor", 0);
+	metrics.exportCursor = cursor;
+
+	char deviceName[16];  // the station MAC address, the same on every boot
+	uint8_t mac[6];
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+	snprintf(deviceName, sizeof(deviceName), "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+	xEventGroupWaitBits(bootEvents, FILESYSTEM_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+	uint32_t retrySeconds = EXPORT_RETRY_SECONDS;
+	uint32_t waitSeconds = EXPORT_RETRY_SECONDS;  // gives the station time to connect before the first batch
 
 	while (true) {
-		vTaskSuspend(NULL);
+		vTaskDelay(pdMS_TO_TICKS(waitSeconds * 1000));
+		waitSeconds = EXPORT_INTERVAL_SECONDS;
+		if (WiFi.status() != WL_CONNECTED) {
+			waitSeconds = EXPORT_RETRY_SECONDS;
+			continue;
+		}
 
-		xTaskNotifyWait(0, 65535, &notification, 0);
-		if (notification > 0) {
-			CO2Index = 0, tempIndex = 0, humidityIndex = 0;
-			prevCO2 = 0, prevTemperature = 0, prevHumidity = 0;
+		if (newestLogEpoch() < cursor) {
+			ESP_LOGW("", "The log is older than the export cursor, sending it all again");
+			cursor = 0;
+		}
+		ExportEncoder encoder;
+		uint32_t lastEpoch = fillExportBatch(encoder, batch, cursor);
+		if (encoder.count == 0) {
+			continue;
 		}
 
-		if (uxQueueMessagesWaiting(jsonDataQueue) == 3) {
-			time(&currentEpoch);
-			if (currentEpoch > prevEpoch) {
-				//----- SCD40 Data -------------------------------
-				xQueueReceive(jsonDataQueue, &CO2, 10);
-				xQueueReceive(jsonDataQueue, &humidity, 10);
-				xQueueReceive(jsonDataQueue, &temperature, 10);
-
-				// Serial.printf("%i,%4.0f,%2.1f,%2.0f\n\r", currentEpoch, CO2, temperature, humidity);
-
-				xSemaphoreTake(jsonDocMutex, 1000 / portTICK_PERIOD_MS);  // ask for control of json doc
-				//------------------------------------------------------
-				if ((int)CO2 != (int)prevCO2) {
-					jsonDataDocument[0]["data"][CO2Index][1] = (int)CO2;
-					jsonDataDocument[0]["data"][CO2Index][0] = currentEpoch;
-					CO2Index = (CO2Index < JSON_DATA_POINTS_MAX) ? (CO2Index + 1) : (0);  // increment from 0 -> JSON_DATA_POINTS_MAX -> 0 -> etc...
-				}
+		if (sendExportBatch(batch, encoder, deviceName) == false) {
+			waitSeconds = retrySeconds;
+			retrySeconds = min(retrySeconds * 2, (uint32_t)EXPORT_INTERVAL_SECONDS);
+			continue;
+		}
+		cursor = lastEpoch;
+		cursorStore.putUInt("cursor", cursor);
+		metrics.exportCursor = cursor;
+		retrySeconds = EXPORT_RETRY_SECONDS;
+		if (encoder.count == EXPORT_BATCH_RECORDS) {
+			waitSeconds = EXPORT_CATCH_UP_SECONDS;	// there is probably more of a backlog to send
+		}
+	}
+}
+#endif
 
-				if ((int)humidity != (int)prevHumidity) {
-					jsonDataDocument[1]["data"][humidityIndex][1] = (int)humidity;
-					jsonDataDocument[1]["data"][humidityIndex][0] = currentEpoch;
-					humidityIndex = (humidityIndex < JSON_DATA_POINTS_MAX) ? (humidityIndex + 1) : (0);	 // increment from 0 -> JSON_DATA_POINTS_MAX -> 0 -> etc...
-				}
+/**
+ * @brief Adds each new sample to the sample ring in RAM
+ * This function waits for the sensor manager to notify it of a new sample. It then reads the newest Sample from
+ * the sampleMailbox and writes it into the next slot of the sample ring, then pushes the new sample to any page
+ * listening on /events. The JSON served to the webserver is only built from the ring when a client requests it.
+ * @param[in] parameter The task parameter (unused).
+ */
+void jsonFileManagerTask(void* parameter) {
+	uint32_t prevEpoch = 0, prevSequence = 0;
+	Sample sample;
+
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		if (xQueuePeek(sampleMailbox, &sample, 0) == pdTRUE && sample.sequence != prevSequence) {
+			if (prevSequence != 0 && sample.sequence != prevSequence + 1) {
+				metrics.jsonMissedSamples += sample.sequence - prevSequence - 1;
+				ESP_LOGW("", "Missed %u samples", sample.sequence - prevSequence - 1);
+			}
+			prevSequence = sample.sequence;
+
+			if (sample.epoch > prevEpoch) {
+				// Serial.printf("%u,%u,%i,%i\n\r", sample.epoch, sample.co2, sample.temperature, sample.humidity);
 
-				if (roundToXDP(1, temperature) != roundToXDP(1, prevTemperature)) {
-					jsonDataDocument[2]["data"][tempIndex][1] = roundToXDP(1, temperature);
-					jsonDataDocument[2]["data"][tempIndex][0] = currentEpoch;
-					tempIndex = (tempIndex < JSON_DATA_POINTS_MAX) ? (tempIndex + 1) : (0);	 // increment from 0 -> JSON_DATA_POINTS_MAX -> 0 -> etc...
+				if (addSampleToRing(sample) == true) {
+					TRACE(traceRingAdded, sample.sequence);
+					broadcastNewestSample();
+				} else {
+					metrics.sampleRingBusyDrops++;
+					ESP_LOGW("", "Sample ring busy, sample dropped");
 				}
-				//------------------------------------------------------
-				xSemaphoreGive(jsonDocMutex);  // release control of json doc
 
-				prevCO2 = CO2;
-				prevHumidity = humidity;
-				prevTemperature = temperature;
-				prevEpoch = currentEpoch;
+				prevEpoch = sample.epoch;
 			}
 		}
 	}
 }
 
 /**
- * @brief Runs the CO2 sensor and RTC, puts data in CSV and JSON queues.
- *
- * This function initializes the PCF8563 RTC and SCD4X CO2 sensor, reads CO2, temperature,
- * and humidity data periodically, and puts the data into the CSV and JSON queues for file
- * management tasks to process. It also sends a notification to the `lightBar` task to
- * update the LED light bar based on the CO2 measurement. If the current time is more
- * than `CSV_RECORD_INTERVAL_SECONDS` seconds from the previous record time, a new record
- * is added to the CSV file. If the time has not been set yet and at least one NTP server
- * is reachable, the RTC is synchronized with the current time and a message is printed
- * to the serial monitor.
- *
- * @param[in] parameter The task parameter (unused).
+ * @brief Publishes a sample to every consumer.
+ * The sample overwrites the single slot of the sampleMailbox (so a consumer always reads the newest sample and the
+ * publisher never blocks), then each consumer task is notified. Consumers check Sample.sequence to spot missed samples.
  */
-void sensorManagerTask(void* parameter) {
+void publishSample(Sample& sample) {
+	static uint32_t sequence = 0;
+	sample.sequence = ++sequence;
+	xQueueOverwrite(sampleMailbox, &sample);
+	TRACE(traceSamplePublished, sample.sequence);
+	if (jsonFileManager != NULL) {
+		xTaskNotifyGive(jsonFileManager);
+	}
+	if (csvFileManager != NULL) {
+		xTaskNotify(csvFileManager, newSampleNotification, eSetBits);
+	}
+#ifdef FLEET_LEAF
+	if (fleet != NULL) {
+		xTaskNotifyGive(fleet);
+	}
+#endif
+}
+
+// SCD4x commands sent without the library (see the SCD4x datasheet, section 3.5)
+#define SCD4X_I2C_ADDRESS 0x62
+#define SCD4X_START_PERIODIC_MEASUREMENT 0x21B1
+#define SCD4X_STOP_PERIODIC_MEASUREMENT 0x3F86
+#define SCD4X_START_LOW_POWER_PERIODIC_MEASUREMENT 0x21AC
+#define SCD4X_MEASURE_SINGLE_SHOT 0x219D
+#define SCD4X_GET_DATA_READY_STATUS 0xE4B8
+#define SCD4X_READ_MEASUREMENT 0xEC05
+#define SCD4X_COMMAND_TIME 1			   // Milliseconds before the answer to a read command can be read
+#define SCD4X_NOT_READY 6				   // readScd4xJob errors (after the 1 - 5 of Wire.endTransmission())
+#define SCD4X_SHORT_READ 7
+#define SCD4X_CRC_ERROR 8
+#define SCD4X_PERIODIC_TIME 5000		   // Milliseconds between periodic measurements
+#define SCD4X_LOW_POWER_PERIODIC_TIME 30000  // Milliseconds between low power periodic measurements
+#define SCD4X_SINGLE_SHOT_TIME 5000		   // Milliseconds a single shot measurement takes
+#define SCD4X_STOP_TIME 500				   // Milliseconds the sensor needs after stop_periodic_measurement
+
+/**
+ * @brief When the next SCD4x measurement will be ready.
+ * The sensor runs on its own clock, so every read is scheduled from the last good read: if the sensor runs slow the read
+ * is retried every SCD4X_RETRY_TIME until it succeeds, which brings the schedule back in step.
+ */
+struct Scd4xSchedule {
+	scd4xModes mode;
+	TickType_t nextReadTick;  // when to read the next measurement (when to send the next single shot is this minus SCD4X_SINGLE_SHOT_TIME)
+	uint8_t retries;		  // reads in a row that found no measurement
+};
+
+// Sends a 16 bit command with no arguments to the SCD4x, returns the Wire.endTransmission() result (0 = success)
+uint8_t sendScd4xCommand(TwoWire& wire, uint16_t command) {
+	wire.beginTransmission(SCD4X_I2C_ADDRESS);
+	wire.write((uint8_t)(command >> 8));
+	wire.write((uint8_t)(command & 0xFF));
+	return wire.endTransmission();
+}
+
+// Sends the command pointed to by context (I2cJob on the sensorBus)
+uint8_t scd4xCommandJob(TwoWire& wire, void* context) {
+	return sendScd4xCommand(wire, *static_cast<uint16_t*>(context));
+}
+
+// Sends a command to the SCD4x from any task, returns 0 on success
+uint8_t runScd4xCommand(uint16_t command) {
+	return runOnI2cBus(sensorBus, scd4xCommandJob, &command);
+}
+
+// Milliseconds between measurements in each mode
+uint32_t scd4xInterval(scd4xModes mode) {
+	switch (mode) {
+	case scd4xLowPowerPeriodic:
+		return SCD4X_LOW_POWER_PERIODIC_TIME;
+	case scd4xSingleShot:
+		return SCD4X_SINGLE_SHOT_INTERVAL;
+	default:
+		return SCD4X_PERIODIC_TIME;
+	}
+}
+
+/**
+ * @brief Stops whatever the SCD4x was doing (it keeps measuring over an ESP32 reset) and starts it in a measurement mode.
+ * Sets the schedule to read the first measurement.
+ */
+void startScd4x(Scd4xSchedule& schedule, scd4xModes mode) {
+	runScd4xCommand(SCD4X_STOP_PERIODIC_MEASUREMENT);
+	vTaskDelay(pdMS_TO_TICKS(SCD4X_STOP_TIME));
+
+	uint8_t error = 0;
+	switch (mode) {
+	case scd4xLowPowerPeriodic:
+		error = runScd4xCommand(SCD4X_START_LOW_POWER_PERIODIC_MEASUREMENT);
+		break;
+	case scd4xSingleShot:
+		break;	// each shot is started by waitForScd4x()
+	default:
+		error = runScd4xCommand(SCD4X_START_PERIODIC_MEASUREMENT);
+		break;
+	}
+	if (error != 0) {
+		ESP_LOGE("", "SCD4x did not start measuring (I2C error %u)", error);
+	}
+
+	schedule.mode = mode;
+	schedule.retries = 0;
+	metrics.scd4xMode = mode;
+	if (mode == scd4xSingleShot) {
+		schedule.nextReadTick = xTaskGetTickCount() + pdMS_TO_TICKS(SCD4X_SINGLE_SHOT_TIME);  // the first shot is sent straight away
+	} else {
+		schedule.nextReadTick = xTaskGetTickCount() + pdMS_TO_TICKS(scd4xInterval(mode) + SCD4X_READY_MARGIN);
+	}
+}
+
+// Sleeps until the next measurement is ready (sending the single shot command on the way in scd4xSingleShot mode), see sleepUntilTick
+void waitForScd4x(Scd4xSchedule& schedule) {
+	if (schedule.mode == scd4xSingleShot && schedule.retries == 0) {
+		sleepUntilTick(schedule.nextReadTick - pdMS_TO_TICKS(SCD4X_SINGLE_SHOT_TIME));
+		runScd4xCommand(SCD4X_MEASURE_SINGLE_SHOT);
+		schedule.nextReadTick = xTaskGetTickCount() + pdMS_TO_TICKS(SCD4X_SINGLE_SHOT_TIME + SCD4X_READY_MARGIN);
+	}
+	sleepUntilTick(schedule.nextReadTick);
+}
+
+/**
+ * @brief Schedules the next read after a read of the SCD4x.
+ * After a good read the next one is due one interval later. A read that found no measurement is retried shortly, and if the sensor
+ * never answers (an SCD40 does not do single shots) it is restarted in scd4xPeriodic mode.
+ */
+void scheduleNextScd4xRead(Scd4xSchedule& schedule, bool readSucceeded) {
+	TickType_t now = xTaskGetTickCount();
+	if (readSucceeded == true) {
+		schedule.retries = 0;
+		schedule.nextReadTick = now + pdMS_TO_TICKS(scd4xInterval(schedule.mode));
+		return;
+	}
+
+	schedule.retries++;
+	if (schedule.retries > SCD4X_MAX_RETRIES) {
+		ESP_LOGW("", "SCD4x has not had a measurement in %u reads, restarting it in periodic mode", schedule.retries);
+		startScd4x(schedule, scd4xPeriodic);
+		return;
+	}
+	schedule.nextReadTick = now + pdMS_TO_TICKS(SCD4X_RETRY_TIME);
+}
+
+// The devices on the sensorBus
+struct SensorBusDevices {
 	PCF8563_Class rtc;
 	SCD4X co2;
+	bool clockValid;	// the RTC had a valid time, which was copied to the system clock
+	bool co2Connected;	// the SCD4x answered (only checked in a production test)
+};
+
+// Starts the RTC and SCD4x and sets the system clock from the RTC (I2cJob on the sensorBus, returns 1 if anything is wrong)
+uint8_t startSensorBusJob(TwoWire& wire, void* context) {
+	SensorBusDevices& devices = *static_cast<SensorBusDevices*>(context);
+	devices.rtc.begin(wire);
 
-	const char* time_format = "%d/%m/%Y,%H:%M";
+	devices.rtc.disableAlarm();
+	devices.rtc.resetAlarm();
 
-	Wire.begin(WIRE_SDA_PIN, WIRE_SCL_PIN, 100000);
+	devices.clockValid = devices.rtc.syncToSystem();
+	devices.co2.begin(wire);
+	devices.co2Connected = true;
 
-	rtc.begin(Wire);
+#ifdef PRODUCTION_TEST
+	devices.co2Connected = devices.co2.isConnected(wire, &Serial);
+	devices.co2.resetEEPROM();
+	devices.co2.setCalibrationMode(false);
+	devices.co2.saveSettings();
+#endif
+	return (devices.clockValid && devices.co2Connected) ? 0 : 1;
+}
+
+// CRC-8 of one 16 bit SCD4x word (polynomial 0x31, initialised to 0xFF, see the SCD4x datasheet section 3.11)
+uint8_t scd4xCrc(const uint8_t* word) {
+	uint8_t crc = 0xFF;
+	for (uint8_t i = 0; i < 2; i++) {
+		crc ^= word[i];
+		for (uint8_t bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+/**
+ * @brief Sends a read command to the SCD4x and reads its 16 bit words back.
+ * @return 0 on success, the Wire.endTransmission() error, SCD4X_SHORT_READ or SCD4X_CRC_ERROR
+ */
+uint8_t readScd4xWords(TwoWire& wire, uint16_t command, uint16_t* words, uint8_t wordCount) {
+	uint8_t error = sendScd4xCommand(wire, command);
+	if (error != 0) {
+		return error;
+	}
+	vTaskDelay(pdMS_TO_TICKS(SCD4X_COMMAND_TIME) + 1);	// + 1 tick so it is never shorter than the command time
+
+	uint8_t byteCount = wordCount * 3;	// each word is followed by its CRC
+	if (wire.requestFrom((uint8_t)SCD4X_I2C_ADDRESS, byteCount) != byteCount) {
+		return SCD4X_SHORT_READ;
+	}
+	for (uint8_t i = 0; i < wordCount; i++) {
+		uint8_t data[3] = {(uint8_t)wire.read(), (uint8_t)wire.read(), (uint8_t)wire.read()};
+		if (scd4xCrc(data) != data[2]) {
+			return SCD4X_CRC_ERROR;
+		}
+		words[i] = (data[0] << 8) | data[1];
+	}
+	return 0;
+}
 
-	rtc.disableAlarm();
-	rtc.resetAlarm();
+// A measurement from the SCD4x in the units a Sample stores (before calibration and smoothing)
+struct Scd4xReading {
+	uint16_t co2;		   // PPM
+	int16_t temperature;   // Centi DegC
+	int16_t humidity;	   // Centi %RH
+};
+
+// Reads a measurement from the SCD4x (I2cJob on the sensorBus, fails if there is no new measurement)
+uint8_t readScd4xJob(TwoWire& wire, void* context) {
+	Scd4xReading& reading = *static_cast<Scd4xReading*>(context);
+	uint16_t words[3];
+	uint8_t error = readScd4xWords(wire, SCD4X_GET_DATA_READY_STATUS, words, 1);
+	if (error != 0) {
+		return error;
+	}
+	if ((words[0] & 0x07FF) == 0) {
+		return SCD4X_NOT_READY;
+	}
+	error = readScd4xWords(wire, SCD4X_READ_MEASUREMENT, words, 3);
+	if (error != 0) {
+		return error;
+	}
+	reading.co2 = words[0];
+	reading.temperature = scd4xToCentiDegrees(words[1]);
+	reading.humidity = scd4xToCentiPercent(words[2]);
+	return 0;
+}
+
+// Copies the system clock to the RTC (I2cJob on the sensorBus)
+uint8_t syncRtcJob(TwoWire& wire, void* context) {
+	return static_cast<PCF8563_Class*>(context)->syncToRtc() ? 0 : 1;
+}
+
+/**
+ * @brief Runs the CO2 sensor and RTC, publishes each measurement as a Sample.
+ *
+ * This function initializes the PCF8563 RTC and SCD4X CO2 sensor, reads CO2, temperature,
+ * and humidity data periodically, and publishes each reading once (see publishSample) for the
+ * file management tasks to process. It also sends a setTargetCommand to the `lightBar` task to
+ * update the LED light bar based on the CO2 measurement. If the time has not been set
+ * yet and at least one NTP server is reachable, the RTC is synchronized with the current
+ * time and a message is printed to the serial monitor.
+ *
+ * Every transaction runs on the sensorBus task (see runOnI2cBus).
+ *
+ * The sensor is read once when its next measurement is due (see Scd4xSchedule) rather than
+ * polled with get_data_ready_status, so the task sleeps between measurements and the bus is
+ * only used for the read itself. SCD4X_MODE picks the periodic, low power periodic or single
+ * shot mode.
+ *
+ * @param[in] parameter The task parameter (unused).
+ */
+void sensorManagerTask(void* parameter) {
+	SensorBusDevices devices;
+	runOnI2cBus(sensorBus, startSensorBusJob, &devices);
 
-	if (rtc.syncToSystem() == true) {
+	bool clockValid = devices.clockValid;
+	if (clockValid == true) {
 		setenv("TZ", time_zone, 1);
 		tzset();
 	} else {
-		xTaskNotify(lightBar, errorRed, eSetValueWithOverwrite);
+		sendLightBarCommand(setModeCommand, errorRed);
 	}
-
-	co2.begin(Wire);
-
-#ifdef PRODUCTION_TEST
-	if (co2.isConnected(Wire, &Serial) == false) {
-		xTaskNotify(lightBar, errorRed, eSetValueWithOverwrite);
+	if (devices.co2Connected == false) {
+		sendLightBarCommand(setModeCommand, errorRed);
 	}
-	co2.resetEEPROM();
-	co2.setCalibrationMode(false);
-	co2.saveSettings();
-#endif
 
-	double CO2, rawTemperature, temperature = 20.0, rawHumidity, humidity = 0.0;
-	double prevCO2 = 0, trendCO2 = 0;
+	// everything from the sensor to the Sample is integer (PPM and centi units), see Sample Processing in KeaPipeline.h
+	SampleFilter temperatureFilter = {0, false};
+	SampleFilter humidityFilter = {0, false};
+	SampleFilter trendFilter = {0, false};	// CO2 change per measurement (PPM), added to the CO2 so the light bar leads a little
+	int32_t prevCO2 = -1;
 	uint16_t lightbarPosition;
 
 	time_t currentEpoch;
-	time(&currentEpoch);
-	time_t prevEpoch = currentEpoch;
-	uint32_t notification;
 
 	bool timeSet = false;
 
-	co2.startPeriodicMeasurement();
+	Scd4xSchedule schedule;
+#ifdef PRODUCTION_TEST
+	startScd4x(schedule, scd4xPeriodic);
+#else
+	startScd4x(schedule, SCD4X_MODE);
+#endif
+	recordBootStage(bootSensorsStarted);
 
 	while (true) {
-		vTaskDelay(4700 / portTICK_PERIOD_MS);	// chill while scd40 gets new data
-		while (co2.isDataReady() == false) {
-			vTaskDelay(30 / portTICK_PERIOD_MS);
-		}
-
-		if (co2.readMeasurement(CO2, rawTemperature, rawHumidity) == 0) {
-			if (prevCO2 == 0) {
+		waitForScd4x(schedule);	 // chill while the scd4x gets new data
+
+		Scd4xReading reading;
+		bool readSucceeded = (runOnI2cBus(sensorBus, readScd4xJob, &reading) == 0);
+		scheduleNextScd4xRead(schedule, readSucceeded);
+		if (readSucceeded) {
+			recordBootStage(bootFirstCo2Reading);
+			int32_t CO2 = max((int32_t)reading.co2 + CO2_OFFSET, (int32_t)0);
+			TRACE(traceSensorRead, (uint32_t)CO2);
+			if (prevCO2 < 0) {
 				prevCO2 = CO2;
 			}
 
-			trendCO2 = 0.5 * (CO2 - prevCO2) + (1 - 0.5) * trendCO2;
+			int32_t trendCO2 = updateSampleFilter(trendFilter, CO2 - prevCO2, SMOOTHING_SHIFT);
 			lightbarPosition = mapCO2toPosition(CO2 + trendCO2);
-			uint32_t notification = lightbarPosition << 16; //put the lightbar Position in the top 16bits (bottom 8bits is the mode)
-			xTaskNotify(lightBar, notification, eSetValueWithoutOverwrite);
-
-			rawTemperature -= TEMP_OFFSET;
+			sendLightBarCommand(setTargetCommand, lightbarPosition);
 
-			temperature = temperature + (rawTemperature - temperature) * 0.5;
-			humidity = humidity + (rawHumidity - humidity) * 0.5;
+			int32_t temperature = updateSampleFilter(temperatureFilter, reading.temperature + TEMPERATURE_OFFSET, SMOOTHING_SHIFT);
+			int32_t humidity = updateSampleFilter(humidityFilter, reading.humidity + HUMIDITY_OFFSET, SMOOTHING_SHIFT);
 
-			xQueueReset(jsonDataQueue);
-			xQueueSend(jsonDataQueue, &CO2, 0);
-			xQueueSend(jsonDataQueue, &humidity, 0);
-			xQueueSend(jsonDataQueue, &temperature, 0);
-			vTaskResume(jsonFileManager);
+			Sample sample;
+			time(&currentEpoch);
+			sample.epoch = (uint32_t)currentEpoch;
+			sample.co2 = (uint16_t)min(CO2, (int32_t)UINT16_MAX);
+			sample.humidity = (int16_t)constrain(humidity, (int32_t)0, (int32_t)10000);
+			sample.temperature = (int16_t)constrain(temperature, (int32_t)INT16_MIN, (int32_t)INT16_MAX);
+			sample.lux = ambientLux;
+			sample.status = (clockValid ? sampleClockValid : 0) | (timeSet ? sampleNtpSynced : 0) | (ambientLuxValid ? sampleLuxValid : 0);
+			publishSample(sample);
 
 			prevCO2 = CO2;
-			// Serial.printf("%4.0f,%2.1f,%1.0f\n", CO2, temperature, humidity);
-		}
-
-		time(&currentEpoch);
-		if (prevEpoch + CSV_RECORD_INTERVAL_SECONDS <= currentEpoch) {
-			prevEpoch += CSV_RECORD_INTERVAL_SECONDS;
-
-			struct tm timeInfo;
-			localtime_r(&currentEpoch, &timeInfo);
-			char timeStamp[24];
-			strftime(timeStamp, sizeof(timeStamp), time_format, &timeInfo);
-
-			char buf[CSV_LINE_MAX_CHARS];  // temp char array for CSV 40000,99,99
-			// CO2(PPM),Humidity(%RH),Temperature(DegC)"
-			sprintf(buf, "%s,%3.0f,%2.0f,%2.1f", timeStamp, CO2, humidity, temperature);
-			xQueueSend(charsForCSVFileQueue, &buf, 1000 / portTICK_PERIOD_MS);
-			Serial.println(buf);
-
-			vTaskResume(csvFileManager);
+			// Serial.printf("%i,%i,%i\n", CO2, temperature, humidity);
 		}
 
 		if (timeSet == false && (sntp_getreachability(0) + sntp_getreachability(1) + sntp_getreachability(2) > 0)) {
-			rtc.syncToRtc();
+			runOnI2cBus(sensorBus, syncRtcJob, &devices.rtc);
 			timeSet = true;
+			clockValid = true;
 		}
 	}
 }
 
+/**
+ * @brief Starts everything in stages, so the light bar shows the CO2 level as soon as the sensor has a reading.
+ * 1. The light bar and I2C bus tasks, then the sensor and sample ring tasks (they need nothing else)
+ * 2. The webserver task brings up the WiFi (once, see startSoftAccessPoint) while csvFileManagerTask mounts LittleFS,
+ *    the webserver starts serving once the filesystem is ready (FILESYSTEM_READY_BIT)
+ * The time each stage is reached is in /metrics (kea_boot_stage_microseconds).
+ */
 void setup() {
+	recordBootStage(bootSetupStarted);
+
 	// Create a task for controlling the light bar.
-	// Parameters are: task function, name for debugging, stack size, parameters to pass to task function, priority, pointer to task handle.
-	xTaskCreate(lightBarTask, "lightBar", 4200, NULL, 2, &lightBar);
+	// Parameters are: task function, name for debugging, stack size, parameters to pass to task function, priority, pointer to task handle, core (see Task Plan).
+	lightBarCommandQueue = xQueueCreate(LIGHTBAR_COMMAND_QUEUE_LENGTH, sizeof(LightBarCommand));
+	startI2cBuses();  // the light bar and sensor tasks queue their I2C transactions on the bus tasks
+	xTaskCreatePinnedToCore(lightBarTask, "lightBar", 4200, NULL, LIGHTBAR_TASK_PRIORITY, &lightBar, LIGHTBAR_TASK_CORE);
 
 	// Set the transmit buffer size for the Serial object and start it with a baud rate of 115200.
 	Serial.setTxBufferSize(1024);
 	Serial.begin(115200);
 
-	// Wait for the Serial object to become available.
-	while (!Serial)
-		;
 	Serial.printf("\r\n Kea CO2 \r\n %s compiled on " __DATE__ " at " __TIME__ " \r\n %s%s in the %s environment \r\n\r\n", USER, VERSION, TAG, ENV);
 
 	// Print chip model and revision if production test mode is enabled.
@@ -1032,40 +4728,44 @@ void setup() {
 	Serial.printf("%s-%d\n\r", ESP.getChipModel(), ESP.getChipRevision());
 #endif
 
-	// Create a queue for storing characters for the CSV file.
-	// Parameters are: maximum number of items in the queue, size of each item in bytes.
-	char csvLine[CSV_LINE_MAX_CHARS];
-	charsForCSVFileQueue = xQueueCreate(3, sizeof(csvLine));
-
-	// Create a queue for storing CO2, humidity, and temperature data
+	// Create a single slot queue holding the newest sample for every sample consumer.
 	// Parameters are: maximum number of items in the queue, size of each item in bytes.
-	jsonDataQueue = xQueueCreate(3, sizeof(double));
+	sampleMailbox = xQueueCreate(1, sizeof(Sample));
 
-	// Create a mutex for controlling access to the JSON document used for storing data for the webserver.
-	jsonDocMutex = xSemaphoreCreateMutex();
+	// Create a mutex for controlling access to the sample ring used for storing data for the webserver.
+	sampleRingMutex = xSemaphoreCreateMutex();
 
-	// Parameters are: task function, name for debugging, stack size, parameters to pass to task function, priority, pointer to task handle.
-	xTaskCreate(sensorManagerTask, "sensorManagerTask", 3800, NULL, 1, &sensorManager);
-	xTaskCreate(jsonFileManagerTask, "jsonFileManagerTask", 21000, NULL, 0, &jsonFileManager);
+	// Create a mutex for controlling access to the index of the log segments in flash.
+	logIndexMutex = xSemaphoreCreateMutex();
 
-	// Initialize LittleFS (ESP32 Storage) and format it if it fails to mount.
-	if (LittleFS.begin(true) == false) {
-		xTaskNotify(lightBar, errorRed, eSetValueWithOverwrite);
-		ESP_LOGE("", "Error mounting LittleFS (Even with Format on Fail)");
-	}
+	// Create the event group the boot stages wait on.
+	bootEvents = xEventGroupCreate();
 
-#ifdef PRODUCTION_TEST
-	LittleFS.remove(F(CSVLogFilename));
+	// Parameters are: task function, name for debugging, stack size, parameters to pass to task function, priority, pointer to task handle, core.
+	xTaskCreatePinnedToCore(sensorManagerTask, "sensorManagerTask", 3800, NULL, SENSOR_TASK_PRIORITY, &sensorManager, SENSOR_TASK_CORE);
+#ifdef FLEET_LEAF
+	// A leaf has no page to serve, so no sample ring or webserver, the samples go to the gateway instead
+	xTaskCreatePinnedToCore(fleetLeafTask, "fleetLeafTask", 3000, NULL, FLEET_TASK_PRIORITY, &fleet, FLEET_TASK_CORE);
+#else
+	// jsonFileManagerTask pushes each sample to the /events clients, events.send() builds the message and queues it on every
+	// client's AsyncClient from this stack (check kea_task_stack_free_bytes with tools/loadtest.py --sse 4)
+	xTaskCreatePinnedToCore(jsonFileManagerTask, "jsonFileManagerTask", 5120, NULL, JSON_TASK_PRIORITY, &jsonFileManager, JSON_TASK_CORE);
+
+#ifdef FLEET_GATEWAY
+	// Create the queue from the ESP-NOW callback and the mutex for the rings of the leaves.
+	fleetPacketQueue = xQueueCreate(FLEET_QUEUE_LENGTH, sizeof(FleetArrival));
+	fleetMutex = xSemaphoreCreateMutex();
+	xTaskCreatePinnedToCore(fleetGatewayTask, "fleetGatewayTask", 3000, NULL, FLEET_TASK_PRIORITY, &fleet, FLEET_TASK_CORE);
 #endif
-	ESP_LOGI("LittleFS", "unused storage = %ikib", (LittleFS.totalBytes() - LittleFS.usedBytes()) / 1024);
-	if (LittleFS.exists("/index.html.gz") == false) {
-		ESP_LOGE("LittleFS", "index.html.gz doesn't exist");
-		xTaskNotify(lightBar, errorRed, eSetValueWithOverwrite);
-	}
 
-	// Parameters are: task function, name for debugging, stack size, parameters to pass to task function, priority, pointer to task handle.
-	xTaskCreate(webserverTask, "webserverTask", 17060, NULL, 1, &webserver);
-	xTaskCreate(csvFileManagerTask, "csvFileManagerTask", 4000, NULL, 0, &csvFileManager);
+	// Parameters are: task function, name for debugging, stack size, parameters to pass to task function, priority, pointer to task handle, core.
+	// LittleFS is mounted by csvFileManagerTask (see mountFilesystem).
+	xTaskCreatePinnedToCore(webserverTask, "webserverTask", 17060, NULL, WEBSERVER_TASK_PRIORITY, &webserver, WEBSERVER_TASK_CORE);
+#endif
+	xTaskCreatePinnedToCore(csvFileManagerTask, "csvFileManagerTask", 4000, NULL, CSV_TASK_PRIORITY, &csvFileManager, CSV_TASK_CORE);
+#ifdef EXPORT_URL
+	xTaskCreatePinnedToCore(exporterTask, "exporterTask", 6000, NULL, EXPORTER_TASK_PRIORITY, &exporter, EXPORTER_TASK_CORE);
+#endif
 }
 
 void loop() {
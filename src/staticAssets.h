@@ -0,0 +1,30 @@
+// Generated by tools/asset_manifest.py from data/ (don't edit, it is rewritten before every build)
+#ifndef STATIC_ASSETS_H
+#define STATIC_ASSETS_H
+
+#include <stdint.h>
+
+// One gzipped file of the page bundle
+struct StaticAsset {
+	const char* path;		  // the URL (the file on LittleFS is path + ".gz")
+	const char* contentType;
+	const char* etag;		  // strong ETag (quoted) from the file's content hash
+	uint32_t size;			  // bytes of the gzipped file
+	bool cacheInRam;		  // small enough to keep a copy in RAM
+};
+
+#define STATIC_ASSET_COUNT 9
+
+const StaticAsset staticAssets[STATIC_ASSET_COUNT] = {
+	{"/apexcharts.min.js", "application/javascript", "\"ddc720485103c374\"", 122657, false},
+	{"/clear.html", "text/html", "\"034c9f1f0e8daa5e\"", 315, true},
+	{"/co2.svg", "image/svg+xml", "\"2ce2cade72ca1d8f\"", 372, true},
+	{"/download.svg", "image/svg+xml", "\"8f03201d0d2f67b3\"", 212, true},
+	{"/fleet.html", "text/html", "\"6928c20289994967\"", 1482, true},
+	{"/humidity.svg", "image/svg+xml", "\"0b7e88238bc34341\"", 344, true},
+	{"/index.css", "text/css", "\"277011cce959d7b6\"", 695, true},
+	{"/index.js", "application/javascript", "\"f6d41a244af8550d\"", 2771, true},
+	{"/temperature.svg", "image/svg+xml", "\"d077173d31cfae36\"", 273, true},
+};
+
+#endif
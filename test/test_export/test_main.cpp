@@ -0,0 +1,130 @@
+/**
+ * @file test_main.cpp
+ * @brief Host tests of the collector batch coding ("kea-delta-1", lib/KeaPipeline), run with [env:native]:
+ *   pio test -e native
+ * @author Chris Dirks (@CDFER)
+ * @url https://www.keastudios.co.nz
+ * @license HIPPOCRATIC LICENSE Version 3.0
+ */
+#include <unity.h>
+
+#include "KeaPipeline.h"
+
+#define TEST_BATCH_RECORDS 6
+
+// Reads a varint written by writeVarint, returns the bytes read
+size_t readVarint(const uint8_t* buffer, uint32_t& value) {
+	size_t length = 0;
+	value = 0;
+	uint8_t byte;
+	do {
+		byte = buffer[length];
+		value |= (uint32_t)(byte & 0x7F) << (7 * length);
+		length++;
+	} while (byte & 0x80);
+	return length;
+}
+
+// Undoes zigzag
+int32_t unzigzag(uint32_t value) {
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Decodes a batch the way the collector does (tools/export_collector.py), returns the records read
+uint16_t decodeExportBatch(const uint8_t* buffer, size_t length, LogRecord* records) {
+	LogRecord previous = {0, 0, 0, 0};
+	uint16_t count = 0;
+	size_t offset = 0;
+	while (offset < length) {
+		uint32_t value;
+		offset += readVarint(buffer + offset, value);
+		previous.epoch += value;
+		offset += readVarint(buffer + offset, value);
+		previous.co2 = (uint16_t)(previous.co2 + unzigzag(value));
+		offset += readVarint(buffer + offset, value);
+		previous.humidity = (int16_t)(previous.humidity + unzigzag(value));
+		offset += readVarint(buffer + offset, value);
+		previous.temperature = (int16_t)(previous.temperature + unzigzag(value));
+		records[count++] = previous;
+	}
+	return count;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Little endian groups of 7 bits, the top bit set on every byte but the last
+void testVarintBytes() {
+	uint8_t buffer[5];
+	TEST_ASSERT_EQUAL_UINT32(1, writeVarint(buffer, 0));
+	TEST_ASSERT_EQUAL_UINT8(0x00, buffer[0]);
+	TEST_ASSERT_EQUAL_UINT32(1, writeVarint(buffer, 127));
+	TEST_ASSERT_EQUAL_UINT8(0x7F, buffer[0]);
+	TEST_ASSERT_EQUAL_UINT32(2, writeVarint(buffer, 300));
+	TEST_ASSERT_EQUAL_UINT8(0xAC, buffer[0]);
+	TEST_ASSERT_EQUAL_UINT8(0x02, buffer[1]);
+	TEST_ASSERT_EQUAL_UINT32(5, writeVarint(buffer, UINT32_MAX));
+	TEST_ASSERT_EQUAL_UINT8(0x0F, buffer[4]);
+
+	const uint32_t values[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 1700000000, UINT32_MAX};
+	for (uint8_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		uint32_t value;
+		size_t length = writeVarint(buffer, values[i]);
+		TEST_ASSERT_EQUAL_UINT32(length, readVarint(buffer, value));
+		TEST_ASSERT_EQUAL_UINT32(values[i], value);
+	}
+}
+
+// Small differences of either sign become small numbers, and every difference comes back
+void testZigzag() {
+	TEST_ASSERT_EQUAL_UINT32(0, zigzag(0));
+	TEST_ASSERT_EQUAL_UINT32(1, zigzag(-1));
+	TEST_ASSERT_EQUAL_UINT32(2, zigzag(1));
+	TEST_ASSERT_EQUAL_UINT32(3, zigzag(-2));
+	TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, zigzag(INT32_MIN));
+	TEST_ASSERT_EQUAL_UINT32(UINT32_MAX - 1, zigzag(INT32_MAX));
+	for (int32_t value = -70000; value <= 70000; value++) {
+		TEST_ASSERT_EQUAL_INT32(value, unzigzag(zigzag(value)));
+	}
+}
+
+// A batch decodes back to its records, including the widest jumps a field can make, and no record passes EXPORT_RECORD_MAX_BYTES
+void testBatchRoundTrip() {
+	const LogRecord records[TEST_BATCH_RECORDS] = {
+		{1700000000, 612, 4512, 2130},
+		{1700000060, 615, 4498, 2131},	// a typical minute (4 bytes)
+		{1700000120, 0, INT16_MIN, INT16_MIN},
+		{1700000180, UINT16_MAX, INT16_MAX, INT16_MAX},
+		{1700003780, 400, -1, -837},
+		{UINT32_MAX, 401, 0, -836},
+	};
+	uint8_t buffer[TEST_BATCH_RECORDS * EXPORT_RECORD_MAX_BYTES];
+	ExportEncoder encoder;
+	startExportBatch(encoder);
+	for (uint8_t i = 0; i < TEST_BATCH_RECORDS; i++) {
+		size_t lengthBefore = encoder.length;
+		addToExportBatch(encoder, buffer, records[i]);
+		TEST_ASSERT_LESS_OR_EQUAL_UINT32(EXPORT_RECORD_MAX_BYTES, encoder.length - lengthBefore);
+		if (i == 1) {
+			TEST_ASSERT_EQUAL_UINT32(4, encoder.length - lengthBefore);
+		}
+	}
+	TEST_ASSERT_EQUAL_UINT32(TEST_BATCH_RECORDS, encoder.count);
+
+	LogRecord decoded[TEST_BATCH_RECORDS];
+	TEST_ASSERT_EQUAL_UINT32(TEST_BATCH_RECORDS, decodeExportBatch(buffer, encoder.length, decoded));
+	for (uint8_t i = 0; i < TEST_BATCH_RECORDS; i++) {
+		TEST_ASSERT_EQUAL_UINT32(records[i].epoch, decoded[i].epoch);
+		TEST_ASSERT_EQUAL_UINT16(records[i].co2, decoded[i].co2);
+		TEST_ASSERT_EQUAL_INT16(records[i].humidity, decoded[i].humidity);
+		TEST_ASSERT_EQUAL_INT16(records[i].temperature, decoded[i].temperature);
+	}
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(testVarintBytes);
+	RUN_TEST(testZigzag);
+	RUN_TEST(testBatchRoundTrip);
+	return UNITY_END();
+}
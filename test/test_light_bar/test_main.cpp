@@ -0,0 +1,60 @@
+/**
+ * @file test_main.cpp
+ * @brief Host tests of the light bar position steps (lib/KeaPipeline), run with [env:native]:
+ *   pio test -e native
+ * @author Chris Dirks (@CDFER)
+ * @url https://www.keastudios.co.nz
+ * @license HIPPOCRATIC LICENSE Version 3.0
+ */
+#include <unity.h>
+
+#include "KeaPipeline.h"
+
+#define MAX_STEPS 4000	// More than the steps from one end of the bar to the other (it moves down one step at a time)
+
+// Steps the position until updatePosition reports no change, returns the steps taken (MAX_STEPS if it never settles)
+uint16_t stepUntilSettled(uint16_t& position, uint16_t targetPosition) {
+	for (uint16_t steps = 0; steps < MAX_STEPS; steps++) {
+		if (updatePosition(position, targetPosition) == false) {
+			return steps;
+		}
+	}
+	return MAX_STEPS;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// CO2 below ~545 ppm maps under the bar, the bar pins to the minimum and then settles (so the light bar task can idle)
+void testTargetBelowMinimumSettles() {
+	uint16_t position = 5 * 255;
+	uint16_t steps = stepUntilSettled(position, mapCO2toPosition(450));
+	TEST_ASSERT_LESS_THAN(MAX_STEPS, steps);
+	TEST_ASSERT_EQUAL_UINT16(LIGHTBAR_MIN_POSITION, position);
+	TEST_ASSERT_FALSE(updatePosition(position, 0));
+}
+
+// At or past the top of the bar the position is left alone, so it is settled straight away
+void testTargetAtMaximumSettles() {
+	uint16_t position = 5 * 255;
+	TEST_ASSERT_FALSE(updatePosition(position, LIGHTBAR_MAX_POSITION));
+	TEST_ASSERT_FALSE(updatePosition(position, UINT16_MAX));
+	TEST_ASSERT_EQUAL_UINT16(5 * 255, position);
+}
+
+// A target on the bar is reached from either side and then reported as settled
+void testTargetOnBarIsReached() {
+	uint16_t position = LIGHTBAR_MIN_POSITION;
+	TEST_ASSERT_LESS_THAN(MAX_STEPS, stepUntilSettled(position, 2000));
+	TEST_ASSERT_EQUAL_UINT16(2000, position);
+	TEST_ASSERT_LESS_THAN(MAX_STEPS, stepUntilSettled(position, 700));
+	TEST_ASSERT_EQUAL_UINT16(700, position);
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(testTargetBelowMinimumSettles);
+	RUN_TEST(testTargetAtMaximumSettles);
+	RUN_TEST(testTargetOnBarIsReached);
+	return UNITY_END();
+}
@@ -0,0 +1,94 @@
+/**
+ * @file test_main.cpp
+ * @brief Host tests of the SCD4x conversions and the sample filter (lib/KeaPipeline), run with [env:native]:
+ *   pio test -e native
+ * @author Chris Dirks (@CDFER)
+ * @url https://www.keastudios.co.nz
+ * @license HIPPOCRATIC LICENSE Version 3.0
+ */
+#include <math.h>
+#include <unity.h>
+
+#include "KeaPipeline.h"
+
+#define FILTER_SHIFT 1		   // SMOOTHING_SHIFT in main.cpp (half of each step)
+#define MAX_FILTER_STEPS 100  // Far more updates than a FILTER_SHIFT filter takes to settle
+
+void setUp() {}
+void tearDown() {}
+
+// Every raw temperature word matches the datasheet formula (T = -45 + 175 * raw / (2^16 - 1)) rounded to centi DegC
+void testTemperatureMatchesDatasheet() {
+	for (uint32_t raw = 0; raw <= UINT16_MAX; raw++) {
+		int16_t expected = (int16_t)lround(-4500.0 + 17500.0 * raw / 65535.0);
+		TEST_ASSERT_EQUAL_INT16(expected, scd4xToCentiDegrees((uint16_t)raw));
+	}
+}
+
+// Every raw humidity word matches the datasheet formula (RH = 100 * raw / (2^16 - 1)) rounded to centi %RH
+void testHumidityMatchesDatasheet() {
+	for (uint32_t raw = 0; raw <= UINT16_MAX; raw++) {
+		int16_t expected = (int16_t)lround(10000.0 * raw / 65535.0);
+		TEST_ASSERT_EQUAL_INT16(expected, scd4xToCentiPercent((uint16_t)raw));
+	}
+}
+
+// Updates the filter with input until its output reaches it, returns the updates taken (MAX_FILTER_STEPS if it never does).
+// The output must only move towards the input on the way, and stay on it after.
+uint16_t filterUntilSettled(SampleFilter& filter, int32_t input, int32_t& output) {
+	uint16_t steps = 0;
+	while (output != input && steps < MAX_FILTER_STEPS) {
+		int32_t next = updateSampleFilter(filter, input, FILTER_SHIFT);
+		if (input > output) {
+			TEST_ASSERT_GREATER_OR_EQUAL_INT32(output, next);
+			TEST_ASSERT_LESS_OR_EQUAL_INT32(input, next);
+		} else {
+			TEST_ASSERT_LESS_OR_EQUAL_INT32(output, next);
+			TEST_ASSERT_GREATER_OR_EQUAL_INT32(input, next);
+		}
+		output = next;
+		steps++;
+	}
+	for (uint16_t update = 0; update < MAX_FILTER_STEPS; update++) {
+		TEST_ASSERT_EQUAL_INT32(input, updateSampleFilter(filter, input, FILTER_SHIFT));
+	}
+	return steps;
+}
+
+// The first input is passed straight through, a step either way is followed without overshoot and ends exactly on the input
+void testFilterStepResponse() {
+	SampleFilter filter = {0, false};
+	int32_t output = updateSampleFilter(filter, 600, FILTER_SHIFT);
+	TEST_ASSERT_EQUAL_INT32(600, output);
+
+	TEST_ASSERT_LESS_THAN(MAX_FILTER_STEPS, filterUntilSettled(filter, 1400, output));
+	TEST_ASSERT_EQUAL_INT32(1400, output);
+	TEST_ASSERT_LESS_THAN(MAX_FILTER_STEPS, filterUntilSettled(filter, 450, output));
+	TEST_ASSERT_EQUAL_INT32(450, output);
+
+	// one unit at a time (the smallest step the fraction bits are there for)
+	TEST_ASSERT_LESS_THAN(MAX_FILTER_STEPS, filterUntilSettled(filter, 451, output));
+	TEST_ASSERT_EQUAL_INT32(451, output);
+	TEST_ASSERT_LESS_THAN(MAX_FILTER_STEPS, filterUntilSettled(filter, 450, output));
+	TEST_ASSERT_EQUAL_INT32(450, output);
+}
+
+// A constant input never drifts, of either sign (temperatures go below zero)
+void testFilterConstantInputDoesNotDrift() {
+	const int32_t inputs[] = {0, 1, 2125, -1, -837, 10000, -4500};
+	for (uint8_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+		SampleFilter filter = {0, false};
+		for (uint16_t update = 0; update < 1000; update++) {
+			TEST_ASSERT_EQUAL_INT32(inputs[i], updateSampleFilter(filter, inputs[i], FILTER_SHIFT));
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(testTemperatureMatchesDatasheet);
+	RUN_TEST(testHumidityMatchesDatasheet);
+	RUN_TEST(testFilterStepResponse);
+	RUN_TEST(testFilterConstantInputDoesNotDrift);
+	return UNITY_END();
+}
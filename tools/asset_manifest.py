@@ -0,0 +1,87 @@
+"""
+Writes src/staticAssets.h, the manifest of the gzipped page bundle in data/.
+
+Each file gets a strong ETag (the start of its SHA-256), its content type and size, and whether the firmware keeps a
+copy in RAM (files up to CACHE_MAX_BYTES, the page, the stylesheet and the icons) or streams it from LittleFS
+(apexcharts). See serveStaticAsset in src/main.cpp.
+
+It runs before every build of the ESP32 environments (extra_scripts in platformio.ini), and can be run by hand:
+    python3 tools/asset_manifest.py
+The header is only rewritten when the manifest changes, so an unchanged data/ doesn't rebuild main.cpp.
+Build the firmware from the same data/ that is uploaded (pio run -t uploadfs), the firmware checks each file's size at
+boot and serves a file that doesn't match without an ETag.
+
+@author Chris Dirks (@CDFER)
+@url https://www.keastudios.co.nz
+@license HIPPOCRATIC LICENSE Version 3.0
+"""
+
+import hashlib
+import os
+
+CACHE_MAX_BYTES = 4096  # Files up to this size are kept in RAM by the firmware
+ETAG_HEX_CHARS = 16  # 64 bits of the SHA-256
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".svg": "image/svg+xml",
+    ".json": "application/json",
+    ".ico": "image/x-icon",
+}
+
+HEADER = """// Generated by tools/asset_manifest.py from data/ (don't edit, it is rewritten before every build)
+#ifndef STATIC_ASSETS_H
+#define STATIC_ASSETS_H
+
+#include <stdint.h>
+
+// One gzipped file of the page bundle
+struct StaticAsset {
+	const char* path;		  // the URL (the file on LittleFS is path + ".gz")
+	const char* contentType;
+	const char* etag;		  // strong ETag (quoted) from the file's content hash
+	uint32_t size;			  // bytes of the gzipped file
+	bool cacheInRam;		  // small enough to keep a copy in RAM
+};
+
+"""
+
+
+def build_manifest(project_dir):
+    data_dir = os.path.join(project_dir, "data")
+    lines = []
+    for name in sorted(os.listdir(data_dir)):
+        base, extension = os.path.splitext(name)
+        content_type = CONTENT_TYPES.get(os.path.splitext(base)[1])
+        if extension != ".gz" or content_type is None:
+            continue
+        with open(os.path.join(data_dir, name), "rb") as file:
+            content = file.read()
+        etag = hashlib.sha256(content).hexdigest()[:ETAG_HEX_CHARS]
+        lines.append('\t{"/%s", "%s", "\\"%s\\"", %d, %s},' % (base, content_type, etag, len(content),
+                                                              "true" if len(content) <= CACHE_MAX_BYTES else "false"))
+
+    return (HEADER + "#define STATIC_ASSET_COUNT %d\n\n" % len(lines)
+            + "const StaticAsset staticAssets[STATIC_ASSET_COUNT] = {\n" + "\n".join(lines) + "\n};\n\n#endif\n")
+
+
+def write_manifest(project_dir):
+    path = os.path.join(project_dir, "src", "staticAssets.h")
+    manifest = build_manifest(project_dir)
+    if os.path.exists(path):
+        with open(path) as file:
+            if file.read() == manifest:
+                return
+    with open(path, "w") as file:
+        file.write(manifest)
+    print("Wrote %s" % path)
+
+
+try:
+    Import("env")  # run by PlatformIO (SCons)
+    write_manifest(env.subst("$PROJECT_DIR"))
+except NameError:
+    if __name__ == "__main__":
+        write_manifest(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""
+Reference collector for the Kea CO2 exporter (firmware built with -D EXPORT_URL, see exporterTask in src/main.cpp).
+
+Each unit POSTs its log in kea-delta-1 batches, every record is its epoch, CO2 (PPM), humidity (centi %RH) and
+temperature (centi DegC) as zigzag varint differences from the record before it (see Export Batches in
+lib/KeaPipeline/src/KeaPipeline.h). The records of each unit are appended to <directory>/<device>.csv, a batch that is
+sent again (the unit didn't see the 2xx) only adds the records newer than the newest one already in the file.
+
+    python3 tools/export_collector.py --port 8080 --directory exports
+and build the firmware with '-D EXPORT_URL="http://<this machine>:8080/kea"'.
+
+Only the Python standard library is used.
+
+@author Chris Dirks (@CDFER)
+@url https://www.keastudios.co.nz
+@license HIPPOCRATIC LICENSE Version 3.0
+"""
+
+import argparse
+import http.server
+import os
+import re
+import threading
+
+BATCH_FORMAT = "kea-delta-1"
+MAX_BATCH_BYTES = 240 * 14  # EXPORT_BATCH_RECORDS * EXPORT_RECORD_MAX_BYTES in the firmware
+
+
+def read_varint(data, offset):
+    """Reads one varint, returns (value, offset after it)."""
+    value = 0
+    shift = 0
+    while True:
+        if offset >= len(data) or shift > 28:
+            raise ValueError("truncated varint")
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        if byte < 0x80:
+            return value, offset
+        shift += 7
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode_batch(data):
+    """Decodes a kea-delta-1 batch into [(epoch, co2, humidity, temperature)] in stored units."""
+    records = []
+    epoch = co2 = humidity = temperature = 0
+    offset = 0
+    while offset < len(data):
+        delta, offset = read_varint(data, offset)
+        epoch += delta
+        delta, offset = read_varint(data, offset)
+        co2 += unzigzag(delta)
+        delta, offset = read_varint(data, offset)
+        humidity += unzigzag(delta)
+        delta, offset = read_varint(data, offset)
+        temperature += unzigzag(delta)
+        records.append((epoch, co2, humidity, temperature))
+    return records
+
+
+class DeviceLogs:
+    """The CSV file of each unit, and the newest epoch already in it (so a resent batch isn't stored twice)."""
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.lock = threading.Lock()
+        self.newest = {}
+        os.makedirs(directory, exist_ok=True)
+
+    def newest_epoch(self, path):
+        if path not in self.newest:
+            self.newest[path] = 0
+            if os.path.exists(path):
+                with open(path) as file:
+                    for line in file:
+                        if line[:1].isdigit():
+                            self.newest[path] = max(self.newest[path], int(line.split(",")[0]))
+        return self.newest[path]
+
+    def append(self, device, records):
+        """Appends the records newer than the file's newest, returns how many were new."""
+        path = os.path.join(self.directory, device + ".csv")
+        with self.lock:
+            newest = self.newest_epoch(path)
+            fresh = [record for record in records if record[0] > newest]
+            is_new_file = not os.path.exists(path)
+            with open(path, "a") as file:
+                if is_new_file:
+                    file.write("epoch,co2_ppm,humidity_rh,temperature_c\n")
+                for epoch, co2, humidity, temperature in fresh:
+                    file.write("%d,%d,%.2f,%.2f\n" % (epoch, co2, humidity / 100, temperature / 100))
+            if fresh:
+                self.newest[path] = fresh[-1][0]
+        return len(fresh)
+
+
+def make_handler(logs):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_POST(self):
+            device = self.headers.get("X-Kea-Device", "")
+            length = int(self.headers.get("Content-Length", 0))
+            if (self.headers.get("X-Kea-Format") != BATCH_FORMAT or not re.fullmatch(r"[0-9A-F]{12}", device)
+                    or not 0 < length <= MAX_BATCH_BYTES):
+                self.send_error(400)
+                return
+            try:
+                records = decode_batch(self.rfile.read(length))
+            except ValueError:
+                self.send_error(400)
+                return
+            stored = logs.append(device, records)
+            self.log_message("%s: %d records (%d new), %d bytes", device, len(records), stored, length)
+            self.send_response(204)
+            self.end_headers()
+
+    return Handler
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Reference collector for the Kea CO2 exporter")
+    parser.add_argument("--port", type=int, default=8080, help="port to listen on (default 8080)")
+    parser.add_argument("--directory", default="exports", help="where the CSV file of each unit is written")
+    arguments = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer(("", arguments.port), make_handler(DeviceLogs(arguments.directory)))
+    print("Collecting on port %d into %s" % (arguments.port, arguments.directory))
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
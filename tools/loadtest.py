@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+"""
+Load and soak test for the Kea CO2 webserver.
+
+Simulates the clients a unit sees in the field: every client that joins fires the captive portal probes of the
+common phones and laptops, loads the page, then polls data.json every 5 s the way the page does (with ?since= so
+only new points come back), now and then downloads the CSV or a /history range. --sse keeps that many /events
+streams open as well (each pushed sample is sent to every one of them by jsonFileManagerTask). While it runs, /metrics
+is scraped so the heap and stack low water marks can be read against the load.
+
+Join the unit's access point (4.3.2.1), then for example:
+    python3 tools/loadtest.py --clients 4 --duration 600
+
+Only the Python standard library is used. The results are printed as a table (p50/p99 latency and errors per route,
+the heap minima and the least free stack of each task), --json writes them to a file as well.
+
+@author Chris Dirks (@CDFER)
+@url https://www.keastudios.co.nz
+@license HIPPOCRATIC LICENSE Version 3.0
+"""
+
+import argparse
+import http.client
+import json
+import random
+import threading
+import time
+
+MAX_CLIENTS = 4  # Same as MAX_CLIENTS in startSoftAccessPoint (the access point refuses a 5th station)
+POLL_SECONDS = 5  # The page asks for data.json this often
+METRICS_SECONDS = 2  # How often /metrics is scraped
+
+# Probes sent by phones and laptops when they join a network, see setUpWebserver
+CAPTIVE_PORTAL_PROBES = [
+    "/generate_204",
+    "/hotspot-detect.html",
+    "/connecttest.txt",
+    "/ncsi.txt",
+    "/redirect",
+    "/canonical.html",
+    "/success.txt",
+    "/wpad.dat",
+    "/favicon.ico",
+]
+
+# Metrics where the lowest value seen during the run is the interesting one
+LOW_WATER_METRICS = [
+    "kea_heap_free_bytes",
+    "kea_heap_min_free_bytes",
+    "kea_heap_largest_free_block_bytes",
+    "kea_task_stack_free_bytes",
+]
+
+
+class Results:
+    """Latencies (seconds) and errors per route, shared by every client thread."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latencies = {}
+        self.errors = {}
+        self.bytes = {}
+
+    def add(self, route, seconds, size):
+        with self.lock:
+            self.latencies.setdefault(route, []).append(seconds)
+            self.bytes[route] = self.bytes.get(route, 0) + size
+
+    def add_error(self, route):
+        with self.lock:
+            self.errors[route] = self.errors.get(route, 0) + 1
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def request(host, path, results, route=None, timeout=10):
+    """GETs a path (without following redirects), records its latency under route, returns the body or None."""
+    route = route or path
+    start = time.monotonic()
+    try:
+        connection = http.client.HTTPConnection(host, 80, timeout=timeout)
+        connection.request("GET", path, headers={"Connection": "close"})
+        response = connection.getresponse()
+        body = response.read()
+        connection.close()
+    except (OSError, http.client.HTTPException):
+        results.add_error(route)
+        return None
+    if response.status >= 500:
+        results.add_error(route)
+        return None
+    results.add(route, time.monotonic() - start, len(body))
+    return body
+
+
+def newest_epoch(body, since):
+    """Finds the newest epoch in a data.json body (so the next poll only asks for newer points)."""
+    try:
+        series = json.loads(body)
+        return max([since] + [point[0] for one in series for point in one["data"]])
+    except (ValueError, KeyError, IndexError, TypeError):
+        return since
+
+
+def client(host, number, stop_at, results, csv_chance, history_chance):
+    """One simulated phone: joins (probe storm + page load), then polls like the page until stop_at."""
+    random.seed(number)
+    time.sleep(random.uniform(0, POLL_SECONDS))  # clients don't all join on the same tick
+
+    while time.monotonic() < stop_at:
+        for probe in random.sample(CAPTIVE_PORTAL_PROBES, len(CAPTIVE_PORTAL_PROBES)):
+            request(host, probe, results, "probes")
+        request(host, "/index.html", results)
+        body = request(host, "/data.json", results)
+        since = newest_epoch(body, 0) if body else 0
+
+        # stay on the page for a while, then leave and join again
+        leave_at = min(stop_at, time.monotonic() + random.uniform(60, 300))
+        while time.monotonic() < leave_at:
+            time.sleep(POLL_SECONDS)
+            body = request(host, "/data.json?since=%d" % since, results, "/data.json?since=")
+            if body:
+                since = newest_epoch(body, since)
+            if random.random() < csv_chance:
+                request(host, "/Kea-CO2-Data.csv", results, timeout=60)
+            if random.random() < history_chance:
+                now = since or int(time.time())
+                request(host, "/history?from=%d&to=%d&step=3600" % (now - 7 * 86400, now), results, "/history")
+
+
+def listen_events(host, stop_at, results):
+    """Holds one /events stream open (reconnecting if it drops) until stop_at, counting the samples pushed."""
+    while time.monotonic() < stop_at:
+        try:
+            connection = http.client.HTTPConnection(host, 80, timeout=30)
+            connection.request("GET", "/events", headers={"Accept": "text/event-stream"})
+            response = connection.getresponse()
+            while time.monotonic() < stop_at:
+                line = response.readline()
+                if not line:
+                    break
+                if line.startswith(b"event: sample"):
+                    results.add("/events", 0, len(line))
+            connection.close()
+        except (OSError, http.client.HTTPException):
+            results.add_error("/events")
+            time.sleep(POLL_SECONDS)
+
+
+def parse_metrics(text):
+    """Reads the Prometheus text format into {name{labels}: value}."""
+    values = {}
+    for line in text.splitlines():
+        if not line or line.startswith("#"):
+            continue
+        name, _, value = line.rpartition(" ")
+        try:
+            values[name] = float(value)
+        except ValueError:
+            pass
+    return values
+
+
+def scrape_metrics(host, stop_at, low_water, results):
+    """Keeps the lowest value of every LOW_WATER_METRICS series seen until stop_at."""
+    while time.monotonic() < stop_at:
+        body = request(host, "/metrics", results)
+        if body:
+            for name, value in parse_metrics(body.decode("utf-8", "replace")).items():
+                if any(name.startswith(metric) for metric in LOW_WATER_METRICS):
+                    low_water[name] = min(value, low_water.get(name, value))
+        time.sleep(METRICS_SECONDS)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load and soak test for the Kea CO2 webserver")
+    parser.add_argument("--host", default="4.3.2.1", help="address of the unit (default 4.3.2.1)")
+    parser.add_argument("--clients", type=int, default=MAX_CLIENTS, help="simulated clients (default %d)" % MAX_CLIENTS)
+    parser.add_argument("--duration", type=int, default=300, help="seconds to run for (default 300)")
+    parser.add_argument("--csv-chance", type=float, default=0.01, help="chance a poll is followed by a CSV download")
+    parser.add_argument("--history-chance", type=float, default=0.05, help="chance a poll is followed by a /history request")
+    parser.add_argument("--sse", type=int, default=0, help="/events streams held open (default 0)")
+    parser.add_argument("--json", help="also write the results to this file")
+    arguments = parser.parse_args()
+
+    results = Results()
+    low_water = {}
+    stop_at = time.monotonic() + arguments.duration
+
+    threads = [threading.Thread(target=scrape_metrics, args=(arguments.host, stop_at, low_water, results), daemon=True)]
+    for number in range(arguments.clients):
+        threads.append(threading.Thread(target=client, daemon=True, args=(arguments.host, number, stop_at, results,
+                                                                          arguments.csv_chance, arguments.history_chance)))
+    for _ in range(arguments.sse):
+        threads.append(threading.Thread(target=listen_events, args=(arguments.host, stop_at, results), daemon=True))
+    print("%d clients (%d /events streams) for %d s against %s" % (arguments.clients, arguments.sse, arguments.duration,
+                                                                   arguments.host))
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join(arguments.duration + 120)
+
+    summary = {"routes": {}, "low_water": low_water}
+    print("\n%-22s %8s %8s %10s %10s %12s" % ("route", "requests", "errors", "p50 ms", "p99 ms", "bytes"))
+    for route in sorted(set(results.latencies) | set(results.errors)):
+        latencies = results.latencies.get(route, [])
+        errors = results.errors.get(route, 0)
+        p50 = percentile(latencies, 0.50) * 1000 if latencies else float("nan")
+        p99 = percentile(latencies, 0.99) * 1000 if latencies else float("nan")
+        print("%-22s %8d %8d %10.1f %10.1f %12d" % (route, len(latencies), errors, p50, p99, results.bytes.get(route, 0)))
+        summary["routes"][route] = {"requests": len(latencies), "errors": errors, "p50_ms": p50, "p99_ms": p99,
+                                    "bytes": results.bytes.get(route, 0)}
+
+    print("\nLowest values seen in /metrics:")
+    if not low_water:
+        print("  (none, is the firmware new enough to have /metrics?)")
+    for name in sorted(low_water):
+        print("  %-60s %10.0f" % (name, low_water[name]))
+
+    if arguments.json:
+        with open(arguments.json, "w") as file:
+            json.dump(summary, file, indent=2)
+
+
+if __name__ == "__main__":
+    main()